@@ -26,6 +26,15 @@ void (*_tm_write_barrier_root)(void *referent) = __tm_write_barrier_ignore;
  */
 void (*_tm_write_barrier)(void *referent) = __tm_write_barrier_ignore;
 
+/*! If true, write barrier hooks are called. */
+int _tm_write_barrier_active = 0;
+
+/*! The tm_node_color() of BLACK nodes. */
+int _tm_write_barrier_black = tm_BLACK;
+
+/*! The tm_node_color() of GREY nodes. */
+int _tm_write_barrier_grey = tm_GREY;
+
 /*@}*/
 
 
@@ -159,7 +168,7 @@ void __tm_write_barrier_root(void *ptr)
    * do nothing, because the stack will be scanned atomically before
    * the sweep phase.
    */
-  if ( (void*) &ptr <= ptr && ptr <= tm.roots[1].h ) {
+  if ( (void*) &ptr <= ptr && ptr <= tm.root_stack.h ) {
     ++ tm.stack_mutations; 
 #if 0
     tm_msg("w s p%p\n", ptr);
@@ -182,8 +191,9 @@ void __tm_write_barrier_root(void *ptr)
 
   /**
    * Otherwise, ptr must be a pointer to statically allocated (root) object.
-   * Mark the roots as being mutated.
+   * Mark the root card as being mutated.
    */
+  _tm_root_card_mark(ptr);
   ++ tm.data_mutations;
 #if 0
   tm_msg("w r p%p\n", ptr);
@@ -225,7 +235,7 @@ void __tm_write_barrier(void *ptr)
    * do nothing, because the stack will be marked before
    * the sweep phase.
    */
-  if ( (void*) &ptr <= ptr && ptr <= tm.roots[1].h ) {
+  if ( (void*) &ptr <= ptr && ptr <= tm.root_stack.h ) {
     ++ tm.stack_mutations; 
     // tm_msg("w s p%p\n", ptr);
     RETURN;
@@ -244,6 +254,7 @@ void __tm_write_barrier(void *ptr)
   if ( (n = tm_ptr_to_node(ptr)) ) {
     tm_write_barrier_node(n);
   } else {
+    _tm_root_card_mark(ptr);
     ++ tm.data_mutations;
 #if 0
     tm_msg("w r p%p\n", ptr);
@@ -8,13 +8,38 @@
 /*! \defgroup write_barrier Write barrier */
 /*@}*/
 
+/**
+ * If true, write barriers must record mutations:
+ * roots have been scanned and nodes may be BLACK.
+ *
+ * Set at the first flip; see _tm_alloc_flip_all().
+ * Until then, write barriers are a single test.
+ * 2 if every write barrier calls its hook, for tracing; see trace.c.
+ */
+extern int _tm_write_barrier_active;
+
+/**
+ * The tm_node_color() of BLACK nodes.
+ *
+ * Updated at each flip, so the inline barriers need not consult tm.colors.
+ */
+extern int _tm_write_barrier_black;
+
+/**
+ * The tm_node_color() of GREY nodes.
+ *
+ * Updated at each flip, with _tm_write_barrier_black.
+ */
+extern int _tm_write_barrier_grey;
+
+
 /**
  * Write barrier hook for a pointer to the stack, to a data segment, or within
  * a tm_alloc()'ed node.
  */
 extern void (*_tm_write_barrier)(void *referent);
-/*! Wrapper around _tm_write_barrier(). */
-#define tm_write_barrier(R) (*_tm_write_barrier)(R)
+/*! Wrapper around _tm_write_barrier(): only called while write barriers are active. */
+#define tm_write_barrier(R) (_tm_write_barrier_active ? (*_tm_write_barrier)(R) : (void) 0)
 
 /**
  * Write barrier hook to a tm_alloc()'ed node.
@@ -22,8 +47,30 @@ extern void (*_tm_write_barrier)(void *referent);
  * Assumes referent is a tm_malloc() ptr
  */
 extern void (*_tm_write_barrier_pure)(void *referent);
-/*! Wrapper around _tm_write_barrier_pure(). */
-#define tm_write_barrier_pure(R) (*_tm_write_barrier_pure)(R)
+
+/**
+ * Inline write barrier for a tm_alloc()'ed node.
+ *
+ * The fast path tests the active flag and the color bits in the referent's tm_node header.
+ * Only mutations of GREY or BLACK nodes call _tm_write_barrier_pure():
+ * a GREY node may be the node being scanned; see tm_write_barrier_node().
+ */
+static __inline
+void tm_write_barrier_pure_inline(void *R)
+{
+#if tm_node_SIDE_TABLE
+  /*! The tm_node is not before R: the hook checks its color. */
+  if ( _tm_write_barrier_active )
+#else
+  int c;
+
+  if ( _tm_write_barrier_active &&
+       ((c = tm_node_color(((tm_node*) R) - 1)) == _tm_write_barrier_black || c == _tm_write_barrier_grey || _tm_write_barrier_active > 1) )
+#endif
+    (*_tm_write_barrier_pure)(R);
+}
+/*! Wrapper around tm_write_barrier_pure_inline(). */
+#define tm_write_barrier_pure(R) tm_write_barrier_pure_inline(R)
 
 
 /**
@@ -32,8 +79,8 @@ extern void (*_tm_write_barrier_pure)(void *referent);
  * Assumes referent is a stack or data segment location.
  */
 extern void (*_tm_write_barrier_root)(void *referent);
-/*! Wrapper around _tm_write_barrier_root(). */
-#define tm_write_barrier_root(X)(*_tm_write_barrier_root)(X)
+/*! Wrapper around _tm_write_barrier_root(): only called while write barriers are active. */
+#define tm_write_barrier_root(X) (_tm_write_barrier_active ? (*_tm_write_barrier_root)(X) : (void) 0)
 
 void __tm_write_barrier(void *referent);
 void __tm_write_barrier_pure(void *referent);
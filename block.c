@@ -50,9 +50,6 @@ void tm_block_init(tm_block *b)
   /*! Clear tm_block stats. */
   memset(b->n, 0, sizeof(b->n));
 
-  /*! Reset tm_block sweep iterator. */
-  _tm_block_sweep_init();
-
   /*! Remember the first block and most recent blocks allocated. */
   tm.block_last = b;
   if ( ! tm.block_first ) {
@@ -83,40 +80,139 @@ size_t tm_block_align_size(size_t size)
 
 
 /**
- * Allocate a tm_block from the free list.
- * 
- * Force allocation to a multiple of tm_block_SIZE.
+ * Returns the tm.free_blocks[] index for a tm_block size.
+ *
+ * Sizes beyond the last index share the last free list.
  */
-tm_block *_tm_block_alloc_from_free_list(size_t size)
+static __inline
+int _tm_block_free_list_index(size_t size)
 {
-  tm_block *b = 0;
+  size_t i = size / tm_block_SIZE - 1;
 
-  size = tm_block_align_size(size);
+  return i < tm_free_blocks_LEN - 1 ? (int) i : tm_free_blocks_LEN - 1;
+}
 
-  /*! Scan global tm_block free list for a block of the right size. */
-  {
-    tm_block *bi;
 
-    tm_list_LOOP(&tm.free_blocks, bi);
-    {
-      if ( bi->size == size &&
-	   tm_list_color(bi) == tm_FREE_BLOCK
-	   ) {
-	tm_assert_test(tm.free_blocks_n);
-	-- tm.free_blocks_n;
+/**
+ * Adds a tm_block to its free list.
+ */
+static __inline
+void _tm_block_free_list_add(tm_block *b)
+{
+  int i = _tm_block_free_list_index(b->size);
 
-	tm_list_remove(bi);
+  tm_list_remove_and_append(&tm.free_blocks[i], b);
+  tm.free_blocks_mask |= 1UL << i;
+  ++ tm.free_blocks_n;
 
-	b = bi;
+  /*! Mark block as tm_FREE_BLOCK. */
+  tm_list_set_color(b, tm_FREE_BLOCK);
+}
 
-	tm_msg("b a fl b%p %d\n", (void*) b, tm.free_blocks_n);
-	break;
+
+/**
+ * Removes a tm_block from its free list.
+ */
+static __inline
+void _tm_block_free_list_remove(tm_block *b)
+{
+  int i = _tm_block_free_list_index(b->size);
+
+  tm_assert_test(tm_list_color(b) == tm_FREE_BLOCK);
+  tm_assert_test(tm.free_blocks_n);
+  -- tm.free_blocks_n;
+
+  tm_list_remove(b);
+  if ( tm_list_empty(&tm.free_blocks[i]) )
+    tm.free_blocks_mask &= ~ (1UL << i);
+}
+
+
+/**
+ * Splits any excess beyond size off the end of a tm_block,
+ * and adds it to the free lists.
+ */
+static
+void _tm_block_split(tm_block *b, size_t size)
+{
+  tm_block *r;
+
+  if ( b->size <= size )
+    return;
+
+  r = (void*) ((char*) b + size);
+
+  r->id = 0;
+  r->size = b->size - size;
+  r->type = 0;
+  r->begin = r->next_parcel = (char*) r + tm_block_HDR_SIZE;
+  r->end = (char*) r + r->size;
+  tm_list_init(&r->list);
+#if tm_block_GUARD
+  r->guard1 = r->guard2 = tm_block_hash(r);
+#endif
+  b->size = size;
+
+  /*! The remainder is returned to the OS separately, so count it as an OS block. */
+  ++ tm.n[tm_B_OS];
+  if ( tm.n[tm_B_OS_M] < tm.n[tm_B_OS] )
+    tm.n[tm_B_OS_M] = tm.n[tm_B_OS];
+
+  _tm_block_free_list_add(r);
+}
+
+
+/**
+ * Allocate a tm_block from the free lists.
+ * 
+ * Force allocation to a multiple of tm_block_SIZE.
+ *
+ * The free lists are indexed by size, so finding a tm_block
+ * does not depend on the number of free tm_blocks,
+ * except for sizes beyond the last free list.
+ * A larger free tm_block is split and the remainder
+ * is returned to the free lists.
+ */
+tm_block *_tm_block_alloc_from_free_list(size_t size)
+{
+  tm_block *b = 0;
+  int i;
+  unsigned long mask;
+
+  size = tm_block_align_size(size);
+  i = _tm_block_free_list_index(size);
+  mask = tm.free_blocks_mask & (~ 0UL << i);
+
+  /*! Find the first non-empty free list that holds a tm_block of at least size. */
+  if ( mask ) {
+    int j = __builtin_ctzl(mask);
+
+    if ( j < tm_free_blocks_LEN - 1 || i < tm_free_blocks_LEN - 1 ) {
+      /*! Any tm_block on that list is large enough. */
+      b = tm_list_first(&tm.free_blocks[j]);
+    } else {
+      /*! Otherwise, scan the last free list for a tm_block that is large enough. */
+      tm_block *bi;
+
+      tm_list_LOOP(&tm.free_blocks[j], bi);
+      {
+	if ( bi->size >= size ) {
+	  b = bi;
+	  break;
+	}
       }
+      tm_list_LOOP_END;
     }
-    tm_list_LOOP_END;
   }
   
   if ( b ) {
+    _tm_block_free_list_remove(b);
+
+    /*! Return any excess at the end of a larger tm_block to the free lists. */
+    _tm_block_split(b, size);
+
+    tm_msg("b a fl b%p %d\n", (void*) b, tm.free_blocks_n);
+
     /*! Initialize the tm_block. */
     tm_block_init(b);
     
@@ -146,8 +242,22 @@ tm_block *_tm_block_alloc(size_t size)
    * Otherwise, allocate a new tm_block from the OS.
    */
   if ( ! b ) {
+    /**
+     * Allocate a batch of up to tm_block_alloc_batch tm_blocks' worth of memory,
+     * so the cost of each OS allocation and its alignment is amortized.
+     */
+    size_t batch_size = size;
+
+    while ( batch_size + size <= tm_block_alloc_batch * tm_block_SIZE )
+      batch_size += size;
+
     /*! Make sure it's aligned to tm_block_SIZE. */
-    b = _tm_os_alloc_aligned(size);
+    b = _tm_os_alloc_aligned(batch_size);
+
+    /*! If the OS denied the batch, try just one tm_block. */
+    if ( ! b && batch_size > size ) {
+      b = _tm_os_alloc_aligned(batch_size = size);
+    }
 
     /*! Return 0 if OS denied. */
     if ( ! b )
@@ -157,19 +267,22 @@ tm_block *_tm_block_alloc(size_t size)
     b->id = 0;
 
     /*! Initialize its size. */
-    b->size = size;
+    b->size = batch_size;
     
     /*! Increment OS block stats. */
     ++ tm.n[tm_B_OS];
     if ( tm.n[tm_B_OS_M] < tm.n[tm_B_OS] )
       tm.n[tm_B_OS_M] = tm.n[tm_B_OS];
 
-    tm.n[tm_b_OS] += size;
+    tm.n[tm_b_OS] += batch_size;
     if ( tm.n[tm_b_OS_M] < tm.n[tm_b_OS] )
       tm.n[tm_b_OS_M] = tm.n[tm_b_OS];
 
     tm_msg("b a os b%p\n", (void*) b);
 
+    /*! Cache the rest of the batch on the free lists. */
+    _tm_block_split(b, size);
+
     /*! Initialize the tm_block. */
     tm_block_init(b);
     
@@ -190,49 +303,46 @@ tm_block *_tm_block_alloc(size_t size)
 /**
  * Begin sweeping of tm_blocks.
  *
- * UNIMPLEMENTED!
+ * Restarts the round-robin sweep of tm_types at the first tm_type.
+ * Each tm_type keeps its own tm_block sweep iterator.
  */
 void _tm_block_sweep_init()
 {
-#if 0
-  tm.bt = tm_list_next(&tm.types);
-  tm.bb = tm.bt != tm_list_next(tm.bt) ?
-    tm_list_next(&tm.bt->blocks) :
-    0;
-#endif
+  tm.bt = 0;
+  tm.bb = 0;
 }
 
 
-#if 0
 /**
- * Scavenges all tm_types for an unused tm_block.
+ * Scavenges an unused tm_block from any tm_type for tm_type t.
  *
- * NOT USED!
+ * A tm_block is unused when all of its parceled tm_nodes are WHITE.
+ * tm_blocks only become unused at a flip, when their ECRU tm_nodes
+ * become WHITE in place, so they are found by the lazy sweep of their
+ * tm_type rather than by walking every tm_block of every tm_type:
+ * the sweep of each tm_type resumes where it stopped,
+ * so each tm_block is visited at most once per flip.
+ *
+ * The sweep releases the first unused tm_block found to the
+ * block free lists, where it is taken from.
+ *
+ * Returns 0 if no unused tm_block was found.
  */
 tm_block *tm_block_scavenge(tm_type *t)
 {
-  tm_type *type = 0;
+  tm_block *b = 0;
 
-  tm_list_LOOP(&tm.types, type);
-  {
-    tm_block *block = 0;
-
-    tm_list_LOOP(&type->blocks, block);
-    {
-      if ( block->type != t && 
-	   tm_block_unused(block) &&
-	   block->n[tm_TOTAL]
-	   ) {
-	return block;
-      }
-    }
-    tm_list_LOOP_END;
+  /*! Sweep tm_types until one tm_block is released. */
+  if ( _tm_block_sweep_some(tm.n[tm_B], 1) ) {
+    b = _tm_block_alloc_from_free_list(tm_block_SIZE);
   }
-  tm_list_LOOP_END;
 
-  return 0;
+  if ( b ) {
+    tm_msg("b s b%p t%p\n", (void*) b, (void*) t);
+  }
+
+  return b;
 }
-#endif
 
 
 /**********************************************************/
@@ -253,32 +363,62 @@ int _tm_block_sweep_maybe(tm_block *b)
 
 
 /**
- * Sweep some blocks.
+ * Sweep some blocks of all tm_types, round-robin, since the last flip.
+ *
+ * - Sweeps at most left tm_blocks.
+ * - If want is non-zero, stops after releasing want tm_blocks.
+ *
+ * Returns the number of tm_blocks released.
+ * See tm_type_sweep_some_blocks().
  */
-int tm_block_sweep_some()
+int _tm_block_sweep_some(long left, int want)
 {
   int count = 0;
-  // unsigned long bytes = 0;
-  // int left = tm_block_sweep_some_size;
+  int ntypes = tm.type_id;
 
-#if tm_USE_SBRK
-  /*
-  ** Try to sweep last block allocated from OS first
-  ** because we might be able to return it to the OS.
-  */
-#endif
+  if ( ! tm.bt ) {
+    tm.bt = tm_list_next(&tm.types);
+  }
 
-  /*! NOT IMPLEMENTED! */
+  /*! Visit each tm_type at most once. */
+  while ( left > 0 && ntypes -- > 0 ) {
+    if ( (void*) tm.bt == (void*) &tm.types ) {
+      tm.bt = tm_list_next(tm.bt);
+      if ( (void*) tm.bt == (void*) &tm.types ) 
+	break;
+    }
+
+    if ( tm_type_sweep_pending(tm.bt) ) {
+      count += tm_type_sweep_some_blocks(tm.bt, &left, want ? want - count : 0);
+      if ( want && count >= want )
+	break;
+    }
+
+    /*! Move to the next tm_type when this one is swept. */
+    if ( ! tm_type_sweep_pending(tm.bt) ) {
+      tm.bt = tm_list_next(tm.bt);
+    }
+  }
 
-#if 0
   if ( count ) 
-    tm_msg("b s b%lu b%lu\n", (unsigned long) count, (unsigned long) bytes);
-#endif
+    tm_msg("b s b%lu\n", (unsigned long) count);
 
   return count;
 }
 
 
+/**
+ * Sweep some blocks of tm_types that are not allocating.
+ *
+ * Sweeps at most tm_block_sweep_some_size tm_blocks.
+ * Returns the number of tm_blocks released.
+ */
+int tm_block_sweep_some()
+{
+  return _tm_block_sweep_some(tm_block_sweep_some_size, 0);
+}
+
+
 /**
  * Deletes a WHITE tm_node from a tm_block.
  */
@@ -293,8 +433,8 @@ void _tm_block_delete_node(tm_block *b, tm_node *n)
   t = b->type;
   tm_assert_test(nc == WHITE);
 
-  /*! Remove tm_node from tm_type's color list. */
-  tm_list_remove(n);
+  /*! Remove tm_node from tm_type's tread. */
+  tm_tread_remove_white(tm_type_tread(t), n);
 
   // tm_validate_lists();
 
@@ -307,6 +447,30 @@ void _tm_block_delete_node(tm_block *b, tm_node *n)
 }
 
 
+#if tm_node_SIDE_TABLE
+/**
+ * Lay out a tm_block for its tm_type, with a tm_node side table.
+ *
+ * Node data starts on the first page after the tm_block header
+ * and a side table large enough for the nodes that fit in the remaining pages.
+ */
+void _tm_block_side_table_init(tm_block *b)
+{
+  size_t size = tm_block_node_size(b);
+  char *begin;
+
+  for ( begin = (char*) b + tm_page_SIZE; begin < b->end; begin += tm_page_SIZE ) {
+    size_t capacity = (b->end - begin) / size;
+
+    if ( (char*) (tm_block_nodes(b) + capacity) <= begin )
+      break;
+  }
+
+  b->begin = b->next_parcel = begin;
+}
+#endif
+
+
 /**
  * Unparcels the tm_nodes in a tm_block.
  *
@@ -328,11 +492,13 @@ int _tm_block_unparcel_nodes(tm_block *b)
   tm_assert_test(tm_block_unused(b));
 
   {
-    tm_node *n;
+    void *p;
     
     /*! Start at first tm_node in tm_block. */
-    n = tm_block_node_begin(b);
-    while ( (void*) n < tm_block_node_next_parcel(b) ) {
+    p = tm_block_node_begin(b);
+    while ( p < tm_block_node_next_parcel(b) ) {
+      tm_node *n = tm_block_node_at(b, p);
+
       /*! Remove node from WHITE list and advance. */
       ++ count;
       bytes += b->size;
@@ -340,7 +506,7 @@ int _tm_block_unparcel_nodes(tm_block *b)
       tm_assert_test(tm_node_color(n) == WHITE);
       _tm_block_delete_node(b, n);
 
-      n = tm_block_node_next(b, n);
+      p = tm_block_node_next(b, p);
     }
   }
 
@@ -379,6 +545,9 @@ void _tm_block_reclaim(tm_block *b)
   tm_assert_test(b);
   tm_assert_test(tm_list_color(b) == tm_LIVE_BLOCK);
 
+  /*! Remove any write protection. */
+  _tm_wb_block_free(b);
+
   /*! Unparcel any allocated nodes from type free lists. */
   _tm_block_unparcel_nodes(b);
 
@@ -422,8 +591,12 @@ void _tm_block_free(tm_block *b)
   _tm_block_reclaim(b);
 
 #if tm_USE_MMAP
-  /*! If using mmap(), reduce calls to _tm_os_free() by keeping tm_block_min_free free blocks. */
-  if ( tm.free_blocks_n > tm_block_min_free ) {
+  /**
+   * If using mmap(), reduce calls to _tm_os_free() by keeping tm_block_min_free free blocks,
+   * and at least tm_block_alloc_batch: otherwise the leftovers of each batch would send
+   * every freed tm_block back to the OS, and the next allocation would map a new batch.
+   */
+  if ( tm.free_blocks_n > tm_block_min_free && tm.free_blocks_n > tm_block_alloc_batch ) {
     // fprintf(stderr, "  tm_block_free too many free blocks: %d\n", tm.free_blocks_n);
     os_free = 1;
   } else {
@@ -461,19 +634,12 @@ void _tm_block_free(tm_block *b)
 
     tm_msg("b f os b%p\n", (void*) b);
   } else {
-    /*! Otherwise, remove from t->blocks list and add to global free block list. */
-    tm_list_remove_and_append(&tm.free_blocks, b);
-    ++ tm.free_blocks_n;
-
-    /*! Mark block as tm_FREE_BLOCK. */
-    tm_list_set_color(b, tm_FREE_BLOCK);
+    /*! Otherwise, remove from t->blocks list and add to the global free block list for its size. */
+    _tm_block_free_list_add(b);
 
     tm_msg("b f fl b%p %d\n", (void*) b, tm.free_blocks_n);
   }
 
-  /*! Reset block sweep iterator. */
-  _tm_block_sweep_init();
-
   // tm_validate_lists();
 
   // fprintf(stderr, "  _tm_block_free(%p)\n", b);
@@ -95,6 +95,20 @@ typedef struct tm_block {
 /*! The adddress of the next tm_node after n, parcelled from tm_block. */
 #define tm_block_node_next(b, n) ((void*) (((char*) (n)) + tm_block_node_size(b)))
 
+#if tm_node_SIDE_TABLE
+/*! The tm_node side table of a tm_block: immediately after its header. */
+#define tm_block_nodes(b) ((tm_node*) ((char*) (b) + tm_block_HDR_SIZE))
+
+/*! The tm_node of the node parcelled at address p of a tm_block. */
+#define tm_block_node_at(b, p) (tm_block_nodes(b) + ((char*) (p) - (b)->begin) / tm_block_node_size(b))
+
+/*! The data of tm_node n of a tm_block. */
+#define tm_block_node_data(b, n) ((void*) ((b)->begin + ((n) - tm_block_nodes(b)) * tm_block_node_size(b)))
+#else
+/*! The tm_node of the node parcelled at address p of a tm_block. */
+#define tm_block_node_at(b, p) ((tm_node*) (p))
+#endif
+
 #if tm_block_GUARD
 /*! Validates tm_block for data corruption. */
 #define _tm_block_validate(b) do { \
@@ -119,9 +133,14 @@ tm_block *_tm_block_alloc(size_t size);
 int _tm_block_unparcel_nodes(tm_block *b);
 void _tm_block_reclaim(tm_block *b);
 void _tm_block_sweep_init();
+tm_block *tm_block_scavenge(struct tm_type *t);
+int _tm_block_sweep_some(long left, int want);
 int tm_block_sweep_some();
 void _tm_block_free(tm_block *b);
 void tm_block_init_node(tm_block *b, tm_node *n);
+#if tm_node_SIDE_TABLE
+void _tm_block_side_table_init(tm_block *b);
+#endif
 
 
 /*@}*/
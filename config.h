@@ -36,18 +36,42 @@
 #define tm_block_GUARD 0 /*!< If true, enable data corruption guards in internal structures. */
 #endif
 
+#ifndef tm_node_SIDE_TABLE
+#define tm_node_SIDE_TABLE 0 /*!< If true, tm_node headers are kept in a side table on the first pages of each tm_block, so marking and sweeping never write to pages holding node data; see node.h. */
+#endif
+
+#ifndef tm_block_PAGES
+#if tm_node_SIDE_TABLE
+#define tm_block_PAGES 8 /*!< The number of pages in a tm_block: room for a side table and node data on separate pages. */
+#else
+#define tm_block_PAGES 1 /*!< The number of pages in a tm_block. */
+#endif
+#endif
+
+#ifndef tm_root_CARD_SIZE
+#define tm_root_CARD_SIZE 512 /*!< The size of a root card: the unit of root rescanning after a root write barrier.  Must be a power of 2. */
+#endif
+
 #ifndef tm_GC_THRESHOLD
 #define tm_GC_THRESHOLD 3 / 4
 #endif
 
-/*! Size of tm_node headers. */
+/*! Size of tm_node headers before node data: none, if tm_nodes are in a side table. */
+#if tm_node_SIDE_TABLE
+#define tm_node_HDR_SIZE 0
+#else
 #define tm_node_HDR_SIZE sizeof(struct tm_node)
+#endif
 
 /*! Size of tm_block headers. */
 #define tm_block_HDR_SIZE sizeof(struct tm_block)
 
 /*! The maxinum size tm_node that can be allocated from a single tm_block. */
+#if tm_node_SIDE_TABLE
+#define tm_block_SIZE_MAX  (tm_block_SIZE - tm_page_SIZE)
+#else
 #define tm_block_SIZE_MAX  (tm_block_SIZE - tm_block_HDR_SIZE)
+#endif
 
 
 /**
@@ -61,11 +85,17 @@ enum tm_config {
   tm_PTR_ALIGN = __alignof(void*),
 
   /*! Size of tm_block. Allocations from operating system are aligned to this size. */
-  tm_block_SIZE = tm_PAGESIZE,
+  tm_block_SIZE = tm_PAGESIZE * tm_block_PAGES,
 
   /*! Operating system pages are aligned to this size. */
   tm_page_SIZE = tm_PAGESIZE,
 
+  /*! Size and alignment of arenas that tm_blocks are carved from: one huge page. */
+  tm_arena_SIZE = 2 * 1024 * 1024,
+
+  /*! Number of tm_blocks in an arena, including the arena header. */
+  tm_arena_BLOCKS = tm_arena_SIZE / tm_block_SIZE,
+
   /*! The addressable range of process memory in 1024 blocks. */
   tm_address_range_k = 1UL << (sizeof(void*) * 8 - 10),
 
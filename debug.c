@@ -248,16 +248,28 @@ void tm_validate_lists()
   fflush(tm_msg_file);
 #endif
 
-  /* Validate free block list. */
-  tm_assert(tm_list_color(&tm.free_blocks) == tm_FREE_BLOCK);
-  tm_list_LOOP(&tm.free_blocks, b);
+  /* Validate free block lists. */
   {
-    _tm_block_validate(b);
-    tm_assert(tm_list_color(b) == tm_FREE_BLOCK);
-    tm_assert(b->type == 0);
-    tm_assert(b->next_parcel == b->begin);
+    int i, free_blocks_n = 0;
+
+    for ( i = 0; i < tm_free_blocks_LEN; ++ i ) {
+      tm_assert(tm_list_color(&tm.free_blocks[i]) == tm_FREE_BLOCK);
+      tm_assert((! (tm.free_blocks_mask & (1UL << i))) == tm_list_empty(&tm.free_blocks[i]));
+      tm_list_LOOP(&tm.free_blocks[i], b);
+      {
+	_tm_block_validate(b);
+	tm_assert(tm_list_color(b) == tm_FREE_BLOCK);
+	tm_assert(b->type == 0);
+	tm_assert(b->next_parcel == b->begin);
+	tm_assert(i == tm_free_blocks_LEN - 1 ? 
+		  b->size >= tm_free_blocks_LEN * tm_block_SIZE :
+		  b->size == (i + 1) * tm_block_SIZE);
+	++ free_blocks_n;
+      }
+      tm_list_LOOP_END;
+    }
+    tm_assert(free_blocks_n == tm.free_blocks_n);
   }
-  tm_list_LOOP_END;
 
   /* Validate types. */
   tm_assert(tm_list_color(&tm.types) == tm_LIVE_TYPE);
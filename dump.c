@@ -0,0 +1,259 @@
+/** \file dump.c
+ * \brief Heap Dump.
+ *
+ * tm_heap_dump() streams a binary snapshot of the heap; see dump.h:
+ *
+ * - A tm_dump_TYPE record for each tm_type,
+ *   a tm_dump_BLOCK record for each of its tm_blocks, and
+ *   a tm_dump_NODE record for each allocated node in the tm_block,
+ *   followed by its conservative edges.
+ * - A tm_dump_ROOT record for each address range root, followed by its edges.
+ *   Root callbacks cannot be dumped: nodes they mark are only reachable from the dump's
+ *   virtual root.
+ * .
+ *
+ * Records are written through a static buffer: nothing is allocated, and
+ * the collector does not run while the heap is dumped.
+ *
+ * See tmdump.c to analyze dumps.
+ */
+#include "internal.h"
+#include "tredmill/dump.h"
+
+#include <errno.h>
+#include <time.h>
+
+
+/****************************************************************************/
+/*! \defgroup heap_dump Heap Dump */
+/*@{*/
+
+/*! The size of the heap dump write buffer, in bytes. */
+#define tm_dump_BUF_SIZE (64 * 1024)
+
+/*! The heap dump write buffer: scanning skips it, since it holds node addresses. */
+static char _tm_dump_buf[tm_dump_BUF_SIZE];
+
+/*! Heap dump state. */
+static struct {
+  /*! The file descriptor. */
+  int fd;
+  /*! The number of bytes in _tm_dump_buf. */
+  size_t n;
+  /*! The number of bytes written, or -1 on error. */
+  long long written;
+} _tm_dump;
+
+
+/**
+ * Write the buffer.
+ */
+static
+void _tm_dump_flush()
+{
+  char *p = _tm_dump_buf;
+
+  while ( _tm_dump.n && _tm_dump.written >= 0 ) {
+    ssize_t n = write(_tm_dump.fd, p, _tm_dump.n);
+
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+	continue;
+      _tm_dump.written = -1;
+      break;
+    }
+
+    p += n;
+    _tm_dump.n -= n;
+    _tm_dump.written += n;
+  }
+
+  _tm_dump.n = 0;
+}
+
+
+/**
+ * Append size bytes to the buffer.
+ */
+static __inline
+void _tm_dump_write(const void *ptr, size_t size)
+{
+  if ( _tm_dump.n + size > tm_dump_BUF_SIZE ) {
+    _tm_dump_flush();
+  }
+  memcpy(_tm_dump_buf + _tm_dump.n, ptr, size);
+  _tm_dump.n += size;
+}
+
+
+/**
+ * Append a record.
+ */
+static
+void _tm_dump_record(int tag, int color, size_t n, tm_dump_word a, tm_dump_word b, tm_dump_word c)
+{
+  tm_dump_record r;
+
+  memset(&r, 0, sizeof(r));
+  r.tag = tag;
+  r.color = color;
+  r.n = n;
+  r.a = a;
+  r.b = b;
+  r.c = c;
+
+  _tm_dump_write(&r, sizeof(r));
+}
+
+
+/**
+ * Find the edges in range [b, e): the allocated nodes referenced by its words.
+ *
+ * If emit is true, the edges are appended.
+ * Returns the number of edges.
+ */
+static
+size_t _tm_dump_edges(const void *b, const void *e, int emit)
+{
+  const char *p;
+  size_t n = 0;
+
+  e = ((char *) e) - sizeof(void*);
+
+  for ( p = b; (char*) p <= (char*) e; p += tm_PTR_ALIGN ) {
+    tm_node *node;
+
+    if ( _tm_dump_buf <= p && p < _tm_dump_buf + tm_dump_BUF_SIZE )
+      continue;
+
+    if ( (node = tm_ptr_to_node(* (void**) p)) ) {
+      if ( emit ) {
+	tm_dump_word w = (tm_ptr_word) tm_node_ptr(node);
+
+	_tm_dump_write(&w, sizeof(w));
+      }
+      ++ n;
+    }
+  }
+
+  return n;
+}
+
+
+/**
+ * Append a record for a node or root [b, e), followed by its edges.
+ */
+static
+void _tm_dump_ranged(int tag, int color, const void *b, const void *e, tm_dump_word c)
+{
+  size_t n = _tm_dump_edges(b, e, 0);
+
+  _tm_dump_record(tag, color, n, (tm_ptr_word) b, tag == tm_dump_NODE ? (tm_dump_word) ((char*) e - (char*) b) : (tm_ptr_word) e, c);
+  _tm_dump_edges(b, e, 1);
+}
+
+
+/**
+ * Dump the heap to fd.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ */
+static
+long long _tm_heap_dump_inner(int fd)
+{
+  tm_dump_header h;
+  tm_type *t;
+  tm_block *b;
+  size_t n_types = 0, n_blocks = 0, n_nodes = 0;
+  int i;
+
+  _tm_dump.fd = fd;
+  _tm_dump.n = 0;
+  _tm_dump.written = 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, tm_dump_MAGIC, sizeof(h.magic));
+  h.version = tm_dump_VERSION;
+  h.ptr_size = sizeof(void*);
+  h.flip_id = tm.colors.flip_id;
+  h.time = time(0);
+  _tm_dump_write(&h, sizeof(h));
+
+  tm_list_LOOP(&tm.types, t) {
+    _tm_dump_record(tm_dump_TYPE, 0, 0, t->id, t->size, t->n[tm_TOTAL] - t->n[WHITE]);
+    ++ n_types;
+
+    tm_list_LOOP(&t->blocks, b) {
+      void *p;
+
+      _tm_dump_record(tm_dump_BLOCK, 0, 0, (tm_ptr_word) b, b->size, t->id);
+      ++ n_blocks;
+
+      for ( p = tm_block_node_begin(b); p < tm_block_node_next_parcel(b); p = tm_block_node_next(b, p) ) {
+	tm_node *n = tm_block_node_at(b, p);
+	char *ptr;
+
+	if ( tm_node_color(n) == WHITE )
+	  continue;
+
+	ptr = tm_node_ptr(n);
+	_tm_dump_ranged(tm_dump_NODE, tm.colors.c1[tm_node_color(n)], ptr, ptr + t->size, t->id);
+	++ n_nodes;
+      }
+    }
+    tm_list_LOOP_END;
+  }
+  tm_list_LOOP_END;
+
+  for ( i = 0; i < tm.roots.n; ++ i ) {
+    if ( tm.roots.r[i].l < tm.roots.r[i].h )
+      _tm_dump_ranged(tm_dump_ROOT, 0, tm.roots.r[i].l, tm.roots.r[i].h, 0);
+  }
+  for ( i = 0; i < tm.dl_roots.n; ++ i ) {
+    if ( tm.dl_roots.r[i].l < tm.dl_roots.r[i].h )
+      _tm_dump_ranged(tm_dump_ROOT, 0, tm.dl_roots.r[i].l, tm.dl_roots.r[i].h, 0);
+  }
+  _tm_dump_ranged(tm_dump_ROOT, 0, tm.root_register.l, tm.root_register.h, 0);
+  _tm_dump_ranged(tm_dump_ROOT, 0, tm.root_stack.l, tm.root_stack.h, 0);
+
+  _tm_dump_record(tm_dump_END, 0, 0, n_types, n_blocks, n_nodes);
+  _tm_dump_flush();
+
+  tm_msg("D %lu types %lu blocks %lu nodes %lld bytes\n",
+	 (unsigned long) n_types,
+	 (unsigned long) n_blocks,
+	 (unsigned long) n_nodes,
+	 _tm_dump.written);
+
+  return _tm_dump.written;
+}
+
+
+/**
+ * API: Write a heap snapshot to fd; see dump.h.
+ *
+ * Nothing is allocated, and the collector is paused, while the heap is dumped.
+ *
+ * Returns the number of bytes written, or -1 on error.
+ */
+long long tm_heap_dump(int fd)
+{
+  long long result;
+
+  if ( ! tm.inited ) {
+    tm_init(0, (char***) 0, 0);
+  }
+
+  _tm_clear_some_stack_words();
+  _tm_set_stack_ptr(&result);
+  _tm_wb_enter();
+
+  result = _tm_heap_dump_inner(fd);
+
+  _tm_wb_leave();
+
+  return result;
+}
+
+/*@}*/
+
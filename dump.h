@@ -0,0 +1,85 @@
+/** \file dump.h
+ * \brief Heap snapshot dump format.
+ *
+ * Written by tm_heap_dump(); read by tmdump.
+ */
+#ifndef tm_DUMP_H
+#define tm_DUMP_H
+
+/****************************************************************************/
+/*! \defgroup heap_dump Heap Dump */
+/*@{*/
+
+/*! The magic number at the start of a heap dump. */
+#define tm_dump_MAGIC "TMDUMP\0\1"
+
+/*! The heap dump format version. */
+#define tm_dump_VERSION 1
+
+/*! A word in a heap dump: addresses and sizes are 64 bits, whatever the address size. */
+typedef unsigned long long tm_dump_word;
+
+/**
+ * The heap dump header.
+ */
+typedef struct tm_dump_header {
+  /*! tm_dump_MAGIC. */
+  char magic[8];
+
+  /*! tm_dump_VERSION. */
+  unsigned int version;
+
+  /*! sizeof(void*) of the dumped process. */
+  unsigned int ptr_size;
+
+  /*! tm.colors.flip_id when dumped. */
+  tm_dump_word flip_id;
+
+  /*! The time when dumped, in seconds since the epoch. */
+  tm_dump_word time;
+} tm_dump_header;
+
+
+/**
+ * Heap dump record tags.
+ */
+enum tm_dump_tag {
+  /*! A tm_type: a = id, b = node size, c = number of nodes. */
+  tm_dump_TYPE = 'T',
+  /*! A tm_block: a = address, b = size, c = tm_type id. */
+  tm_dump_BLOCK = 'B',
+  /*! A node: a = address, b = size, c = tm_type id; followed by its edges. */
+  tm_dump_NODE = 'N',
+  /*! An address range root: a = low address, b = high address; followed by its edges. */
+  tm_dump_ROOT = 'R',
+  /*! The end of the dump: a = number of tm_types, b = number of tm_blocks, c = number of nodes. */
+  tm_dump_END = 'E'
+};
+
+
+/**
+ * A heap dump record.
+ *
+ * A tm_dump_NODE or tm_dump_ROOT record is followed by n tm_dump_words:
+ * the addresses of the allocated nodes referenced by the words of the node or root.
+ * Interior pointers are edges to the node's address.
+ */
+typedef struct tm_dump_record {
+  /*! An enum tm_dump_tag. */
+  unsigned char tag;
+
+  /*! For tm_dump_NODE, the node's tm_color. */
+  unsigned char color;
+
+  unsigned short _pad;
+
+  /*! The number of edges following the record. */
+  unsigned int n;
+
+  /*! Record fields: see enum tm_dump_tag. */
+  tm_dump_word a, b, c;
+} tm_dump_record;
+
+/*@}*/
+
+#endif
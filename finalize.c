@@ -0,0 +1,263 @@
+/** \file finalize.c
+ * \brief Finalization.
+ *
+ * Finalizers release external resources held by nodes that became unreachable:
+ *
+ * - tm_register_finalizer() records the node in a side table, tm_data.finalizers,
+ *   which is allocated from the OS and not scanned, so it does not keep the node alive.
+ * - At the end of marking, before colors flip, registered nodes still ECRU are unreachable:
+ *   they are moved to tm_data.finalize_queue and marked, with everything they reference,
+ *   so they survive one more cycle.
+ * - Queued nodes are kept alive by a root callback until tm_run_finalizers()
+ *   runs their finalizers in one batch; they are then collected by the next cycle,
+ *   unless a finalizer made them reachable again.
+ * .
+ *
+ * Finalizers never run within tm_alloc().
+ */
+#include "internal.h"
+
+
+/****************************************************************************/
+/*! \defgroup finalization_set Finalization: Sets */
+/*@{*/
+
+/**
+ * Make sure s can hold n entries.
+ *
+ * Returns 0 if s could not be grown.
+ */
+static
+int _tm_finalizer_set_reserve(tm_finalizer_set *s, size_t n)
+{
+  if ( n > s->max ) {
+    size_t new_size = n * 2 * sizeof(s->e[0]);
+    tm_finalizer_entry *e;
+
+    new_size += tm_block_SIZE - new_size % tm_block_SIZE;
+    if ( ! (e = _tm_os_alloc_aligned(new_size)) )
+      return 0;
+
+    if ( s->e ) {
+      memcpy(e, s->e, s->n * sizeof(s->e[0]));
+      _tm_os_free_aligned(s->e, s->size);
+    }
+
+    s->e = e;
+    s->size = new_size;
+    s->max = new_size / sizeof(s->e[0]);
+  }
+
+  return 1;
+}
+
+
+/**
+ * Returns the index of the first entry in s at or above ptr.
+ *
+ * Registered entries are sorted by ptr.
+ */
+static
+size_t _tm_finalizer_set_search(const tm_finalizer_set *s, const void *ptr)
+{
+  size_t lo = 0, hi = s->n;
+
+  while ( lo < hi ) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if ( (const char*) s->e[mid].ptr < (const char*) ptr ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup finalization_gc Finalization: GC */
+/*@{*/
+
+/**
+ * Root callback: mark finalizer data, and queued nodes.
+ */
+static
+void _tm_finalize_scan(void *data)
+{
+  size_t i;
+
+  for ( i = 0; i < tm.finalizers.n; ++ i ) {
+    _tm_mark_possible_ptr(tm.finalizers.e[i].data);
+  }
+
+  for ( i = 0; i < tm.finalize_queue.n; ++ i ) {
+    _tm_mark_possible_ptr(tm.finalize_queue.e[i].ptr);
+    _tm_mark_possible_ptr(tm.finalize_queue.e[i].data);
+  }
+}
+
+
+/**
+ * Queue the finalizers of unreachable nodes, and resurrect the nodes.
+ *
+ * Called atomically at the end of marking, before colors flip.
+ * Nodes still ECRU are unreachable.
+ *
+ * Returns the number of nodes resurrected:
+ * if non-zero, the caller must finish marking again.
+ */
+int _tm_finalize_flip()
+{
+  tm_finalizer_set *s = &tm.finalizers;
+  size_t i, j;
+  int n = 0;
+
+  for ( i = j = 0; i < s->n; ++ i ) {
+    tm_finalizer_entry *e = &s->e[i];
+    tm_node *node = tm_pure_ptr_to_node(e->ptr);
+
+    if ( tm_node_color(node) == ECRU ) {
+      _tm_node_mark(node);
+      ++ n;
+
+      if ( _tm_finalizer_set_reserve(&tm.finalize_queue, tm.finalize_queue.n + 1) ) {
+	tm.finalize_queue.e[tm.finalize_queue.n ++] = *e;
+	continue;
+      }
+
+      /*! If the queue cannot grow, keep the node registered for the next cycle. */
+      tm_msg("F WARNING: cannot grow finalize queue\n");
+    }
+
+    s->e[j ++] = *e;
+  }
+
+  if ( n ) {
+    tm_msg("F q %d\n", n);
+  }
+
+  s->n = j;
+  tm.finalize_queued += n;
+
+  return n;
+}
+
+
+/**
+ * Initialize finalization.
+ *
+ * Called by tm_init().
+ */
+int _tm_finalize_init()
+{
+  memset(&tm.finalizers, 0, sizeof(tm.finalizers));
+  memset(&tm.finalize_queue, 0, sizeof(tm.finalize_queue));
+  tm.finalizing = 0;
+  tm.finalize_queued = tm.finalize_run = 0;
+
+  return tm_root_add_callback("finalizers", _tm_finalize_scan, 0);
+}
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup finalization_api Finalization: API */
+/*@{*/
+
+/**
+ * API: Register finalizer fn for the node at ptr.
+ *
+ * fn(ptr, data) is called by tm_run_finalizers() after the node becomes unreachable.
+ * A node has at most one finalizer: fn replaces any previous finalizer, and
+ * if fn is 0, the finalizer is removed.
+ *
+ * data is marked while the finalizer is registered, so it must not reference the node.
+ *
+ * Returns 0 if ptr is not a pure pointer to a node, or the finalizer could not be registered.
+ */
+int tm_register_finalizer(void *ptr, tm_finalizer fn, void *data)
+{
+  tm_finalizer_set *s = &tm.finalizers;
+  tm_node *n;
+  size_t i;
+  int result = 1;
+
+  if ( ! ptr || ! (n = tm_ptr_to_node(ptr)) || (void*) tm_node_ptr(n) != ptr )
+    return 0;
+
+  _tm_wb_enter();
+
+  i = _tm_finalizer_set_search(s, ptr);
+  if ( i < s->n && s->e[i].ptr == ptr ) {
+    if ( fn ) {
+      s->e[i].fn = fn;
+      s->e[i].data = data;
+    } else {
+      memmove(&s->e[i], &s->e[i + 1], (s->n - i - 1) * sizeof(s->e[0]));
+      -- s->n;
+    }
+  } else if ( fn ) {
+    if ( _tm_finalizer_set_reserve(s, s->n + 1) ) {
+      memmove(&s->e[i + 1], &s->e[i], (s->n - i) * sizeof(s->e[0]));
+      s->e[i].ptr = ptr;
+      s->e[i].fn = fn;
+      s->e[i].data = data;
+      ++ s->n;
+    } else {
+      result = 0;
+    }
+  }
+
+  /*! data may have been stored after the finalizers were scanned. */
+  if ( fn ) {
+    _tm_mark_possible_ptr(data);
+  }
+
+  _tm_wb_leave();
+
+  return result;
+}
+
+
+/**
+ * API: Run the finalizers of the nodes queued since the last call.
+ *
+ * Finalizers may allocate; nodes queued while running them are left for the next call.
+ * Calls from within a finalizer do nothing.
+ *
+ * Returns the number of finalizers run.
+ */
+size_t tm_run_finalizers()
+{
+  tm_finalizer_set *q = &tm.finalize_queue;
+  size_t i, n;
+
+  if ( tm.finalizing )
+    return 0;
+  ++ tm.finalizing;
+
+  n = q->n;
+  for ( i = 0; i < n; ++ i ) {
+    /*! The queue may grow while the finalizer runs. */
+    tm_finalizer_entry e = q->e[i];
+
+    e.fn(e.ptr, e.data);
+  }
+
+  /*! Remove the batch: the nodes are collected by the next cycle. */
+  memmove(&q->e[0], &q->e[n], (q->n - n) * sizeof(q->e[0]));
+  q->n -= n;
+  tm.finalize_run += n;
+
+  -- tm.finalizing;
+
+  return n;
+}
+
+/*@}*/
+
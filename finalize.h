@@ -0,0 +1,51 @@
+/** \file finalize.h
+ * \brief Finalization.
+ */
+#ifndef tm_FINALIZE_H
+#define tm_FINALIZE_H
+
+/****************************************************************************/
+/*! \defgroup finalization Finalization */
+/*@{*/
+
+/**
+ * A finalizer registered for a node, or queued to run.
+ */
+typedef struct tm_finalizer_entry {
+  /*! The pure pointer to the node's data. */
+  void *ptr;
+
+  /*! The finalizer. */
+  tm_finalizer fn;
+
+  /*! The finalizer data. */
+  void *data;
+} tm_finalizer_entry;
+
+
+/**
+ * A growable array of tm_finalizer_entry.
+ *
+ * Allocated from the OS, so it is not scanned as a root.
+ */
+typedef struct tm_finalizer_set {
+  /*! The entries. */
+  tm_finalizer_entry *e;
+
+  /*! The number of entries. */
+  size_t n;
+
+  /*! The number of entries allocated. */
+  size_t max;
+
+  /*! The size of the allocation, in bytes. */
+  size_t size;
+} tm_finalizer_set;
+
+
+int _tm_finalize_init();
+int _tm_finalize_flip();
+
+/*@}*/
+
+#endif
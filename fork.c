@@ -0,0 +1,102 @@
+/** \file fork.c
+ * \brief Fork.
+ *
+ * fork() copies the heap into the child process, copy-on-write.
+ * An incremental cycle in progress in the child marks, unmarks and relinks
+ * inherited nodes, writing their headers, which copies most of the parent's pages.
+ *
+ * - tm_atfork_prepare() brings the collector to a safe point in the parent:
+ *   marking of GREY nodes is finished, and write barrier faults are processed.
+ * - tm_atfork_parent() resumes the parent.
+ * - In the child, tm_atfork_child() replaces process state not inherited from the parent,
+ *   and the collector is suspended for the first tm_fork_child_delay allocations,
+ *   which are parcelled from free nodes without scanning, flipping or sweeping.
+ * .
+ *
+ * tm_init() registers the handlers with pthread_atfork(), unless tm_atfork_handlers is false.
+ */
+#include "internal.h"
+
+#include <pthread.h>
+
+
+/****************************************************************************/
+/*! \defgroup fork Fork */
+/*@{*/
+
+/**
+ * API: Called before fork().
+ *
+ * Finishes marking GREY nodes:
+ * the child does not inherit a partially scanned heap.
+ */
+void tm_atfork_prepare()
+{
+  if ( ! tm.inited )
+    return;
+
+  _tm_wb_enter();
+
+  _tm_scan_all_inner();
+
+  tm_msg("P f %lu\n", (unsigned long) tm.n[tm_TOTAL]);
+}
+
+
+/**
+ * API: Called in the parent process after fork().
+ */
+void tm_atfork_parent()
+{
+  if ( ! tm.inited )
+    return;
+
+  _tm_wb_leave();
+}
+
+
+/**
+ * API: Called in the child process after fork().
+ *
+ * Suspends the collector for the first tm_fork_child_delay allocations;
+ * see _tm_alloc_type_inner().
+ */
+void tm_atfork_child()
+{
+  if ( ! tm.inited )
+    return;
+
+  /*! The userfaultfd and /proc/self/pagemap still refer to the parent. */
+  _tm_wb_atfork_child();
+  if ( tm_root_soft_dirty ) {
+    _tm_root_soft_dirty_atfork_child();
+  }
+
+  /*! The trace file and the allocation log belong to the parent. */
+  _tm_trace_atfork_child();
+  _tm_alloc_log_atfork_child();
+
+  tm.fork_delay = tm_fork_child_delay;
+  tm.alloc_since_flip = 0;
+  ++ tm.forks;
+
+  _tm_wb_leave();
+}
+
+
+/**
+ * Register the fork handlers with pthread_atfork().
+ *
+ * Called by tm_init().
+ * Returns 0 if the handlers could not be registered.
+ */
+int _tm_fork_init()
+{
+  tm.fork_delay = 0;
+  tm.forks = 0;
+
+  return ! pthread_atfork(tm_atfork_prepare, tm_atfork_parent, tm_atfork_child);
+}
+
+/*@}*/
+
@@ -27,15 +27,42 @@ long tm_node_unmark_some_size = 8;
 /*! Number of blocks per tm_alloc() to sweep after sweep phase. */
 long tm_block_sweep_some_size = 2;
 
-/*! Minimum number of tm_blocks to retain on block free list.*/
-int tm_block_min_free = 4;
+/*! Minimum number of tm_blocks to retain on block free list; at least tm_block_alloc_batch are retained. */
+int tm_block_min_free = 8;
+
+/*! Number of tm_blocks to allocate from the OS at once; the extra tm_blocks are kept on the block free lists. */
+int tm_block_alloc_batch = 8;
+
+/*! If true, unused tm_blocks of other tm_types are scavenged before allocating tm_blocks from the OS. */
+int tm_block_scavenge_enable = 1;
 
 /* Soft OS allocation limit in bytes. */
 size_t tm_os_alloc_max = 64 * 1024 * 1024; /* 64MiB */
 
+/*! If non-zero, tm_init() reserves a contiguous heap address range of this many bytes; all tm_blocks are committed inside it. */
+size_t tm_heap_reserve_size = 0;
+
 /*! If true, all roots are scanned atomically before moving to the SCAN phase.  */
 int    tm_root_scan_full = 1;
 
+/*! If true, the stack is scanned incrementally after a flip, and only its active part is rescanned atomically at the end of marking. */
+int    tm_stack_scan_incremental = 1;
+
+/*! If true, the writable data segments and thread-local storage of shared libraries are roots. */
+int    tm_root_scan_shared_libraries = 1;
+
+/*! If true, data roots written since they were scanned are found by the kernel's soft-dirty page bits, so mutators need not call tm_write_barrier_root(). */
+int    tm_root_soft_dirty = 0;
+
+/*! If true, tm_init() registers tm_atfork_prepare(), tm_atfork_parent() and tm_atfork_child() with pthread_atfork(). */
+int    tm_atfork_handlers = 1;
+
+/*! Number of allocations in the child process after fork() before the collector resumes, so inherited pages are not copied by marking. */
+long   tm_fork_child_delay = 10000;
+
+/*! The write barrier: see enum tm_barrier_mode.  Overridden by the TM_BARRIER environment variable: "software", "mprotect" or "uffd".  "mprotect", and "uffd" with tm_wb_uffd_user_mode_only, can make system calls that write into heap nodes fail with EFAULT; see wb.h. */
+int    tm_write_barrier_mode = tm_BARRIER_SOFTWARE;
+
 /*@}*/
 
 
@@ -90,6 +117,9 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
   tm_phase_data_init(&tm.p);
 #endif
 
+  /*! Initialize the time stat clock. */
+  tm_time_stat_init();
+
   /*! Initialize time stat names. */
   tm.ts_os_alloc.name = "tm_os_alloc";
   tm.ts_os_free.name = "tm_os_free";
@@ -97,6 +127,7 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
   tm.ts_free.name = "tm_free";
   tm.ts_gc.name = "gc";
   tm.ts_gc_inner.name = "gc_inner";
+  tm.ts_flip.name = "flip";
   tm.ts_barrier.name = "tm_barrier";
   tm.ts_barrier_pure.name = "tm_barrier_p";
   tm.ts_barrier_root.name = "tm_barrier_r";
@@ -135,19 +166,45 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
 #undef P
 #endif
 
+  /*! Initialize page managment before root sets: root sets are allocated from the OS. */
+  memset(tm.page_in_use, 0, sizeof(tm.page_in_use));
+
+  /*! Initialize the heap address range: all addresses, */
+  tm.heap_base = 0;
+  tm.heap_size = ~ (size_t) 0;
+
+  /*! Or reserve a contiguous heap address range. */
+#if tm_USE_MMAP
+  if ( tm_heap_reserve_size ) {
+    if ( ! _tm_os_reserve(tm_heap_reserve_size) ) {
+      tm_msg("WARNING: tm_init(): could not reserve heap address range of %lu bytes.\n", (unsigned long) tm_heap_reserve_size);
+    }
+  }
+#endif
+
+  /*! Initialize tm_arena list. */
+  tm_list_init(&tm.arenas);
+  tm.arenas_n = 0;
+  memset(tm.arena_map, 0, sizeof(tm.arena_map));
+
   /*! Initialize possible pointer range. */
   tm_ptr_l = (void*) ~0UL;
   tm_ptr_h = 0;
 
   /*! Initialize root sets. */
-  tm.nroots = 0;
+  _tm_root_set_init(&tm.roots);
+  _tm_root_set_init(&tm.aroots);
+  _tm_root_set_init(&tm.root_callbacks);
+  _tm_root_set_init(&tm.dl_roots);
   tm.data_mutations = tm.stack_mutations = 0;
 
-  tm.root_datai = -1;
-
   /*! Initialize root set for the register set, using a jmpbuf struct. */
   /* A C jmpbuf struct contains the saved registers set, hopefully. */
-  tm_root_add("register", &tm.jb, (&tm.jb) + 1);
+  tm.root_register.name = "register";
+  tm.root_register.l = &tm.jb;
+  tm.root_register.h = (&tm.jb) + 1;
+  tm.root_register.callback = 0;
+  tm.root_register.callback_data = 0;
 
   /*! Initialize roots set for the stack. */
 
@@ -190,18 +247,20 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
 	h = (void*) ((tm_ptr_word) (h) + (stack_page_size - ((tm_ptr_word) (h) % stack_page_size)));
       }
 
-      i = tm_root_add("stack", l, h);
+      tm.root_stack.name = "stack";
+      tm.root_stack.l = l;
+      tm.root_stack.h = h;
+      tm.root_stack.callback = 0;
+      tm.root_stack.callback_data = 0;
     }
 
     /* Remember where to put the stack pointer. */
     if ( tm.stack_grows < 0 ) {
-      tm.stack_ptrp = (void**) &tm.roots[i].l;
+      tm.stack_ptrp = (void**) &tm.root_stack.l;
     } else {
-      tm.stack_ptrp = (void**) &tm.roots[i].h;
+      tm.stack_ptrp = (void**) &tm.root_stack.h;
     }
 
-    tm.root_datai = i + 1;
-
     /* IMPLEMENT: Support for multithreading stacks. */
   }
 
@@ -245,20 +304,47 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
 #endif
 
 
-  /*! IMPLEMENT: Support dynamically-loaded library data segments. */
+  /*! Initialize root set for shared library data segments and thread-local storage. */
+  if ( tm_root_scan_shared_libraries ) {
+    _tm_root_dl_init();
+  }
+
+  /*! Initialize finalization: queued nodes are marked by a root callback. */
+  _tm_finalize_init();
+
+  /*! Initialize weak references. */
+  _tm_weak_init();
+
+  /*! Track root mutations with soft-dirty page bits. */
+  tm.root_pagemap_fd = -1;
+  if ( tm_root_soft_dirty && ! _tm_root_soft_dirty_init() ) {
+    tm_msg("WARNING: tm_init(): soft-dirty page bits not supported.\n");
+    tm_root_soft_dirty = 0;
+  }
+
+  /*! Bring the collector to a safe point around fork(). */
+  if ( tm_atfork_handlers && ! _tm_fork_init() ) {
+    tm_msg("WARNING: tm_init(): pthread_atfork() failed.\n");
+  }
 
   /*! Dump the tm_root sets. */
   tm_msg_enable("R", 1);
 
   tm_msg("R ROOTS {\n");
-  for ( i = 0; tm.roots[i].name; ++ i ) {
-    if ( tm.roots[i].l != tm.roots[i].h ) {
-      tm_msg("R \t [%p,%p] %s %d\n",
-	     tm.roots[i].l,
-	     tm.roots[i].h,
-	     tm.roots[i].name,
-	     i);
-    }
+  tm_msg("R \t [%p,%p] %s\n", tm.root_register.l, tm.root_register.h, tm.root_register.name);
+  tm_msg("R \t [%p,%p] %s\n", tm.root_stack.l, tm.root_stack.h, tm.root_stack.name);
+  for ( i = 0; i < tm.roots.n; ++ i ) {
+    tm_msg("R \t [%p,%p] %s %d\n",
+	   tm.roots.r[i].l,
+	   tm.roots.r[i].h,
+	   tm.roots.r[i].name,
+	   i);
+  }
+  for ( i = 0; i < tm.root_callbacks.n; ++ i ) {
+    tm_msg("R \t %p(%p) %s\n",
+	   tm.root_callbacks.r[i].callback,
+	   tm.root_callbacks.r[i].callback_data,
+	   tm.root_callbacks.r[i].name);
   }
   tm_msg("R }\n");
 
@@ -295,12 +381,12 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
 #undef X
 #endif
 
-  /*! Initialize page managment. */
-  memset(tm.page_in_use, 0, sizeof(tm.page_in_use));
-
-  /*! Initialize tm_block free list. */
-  tm_list_init(&tm.free_blocks);
-  tm_list_set_color(&tm.free_blocks, tm_FREE_BLOCK);
+  /*! Initialize tm_block free lists. */
+  for ( i = 0; i < tm_free_blocks_LEN; ++ i ) {
+    tm_list_init(&tm.free_blocks[i]);
+    tm_list_set_color(&tm.free_blocks[i], tm_FREE_BLOCK);
+  }
+  tm.free_blocks_mask = 0;
   tm.free_blocks_n = 0;
 
   /* Types. */
@@ -329,7 +415,36 @@ void tm_init(int *argcp, char ***argvp, char ***envpp)
   _tm_write_barrier = __tm_write_barrier;
   _tm_write_barrier_pure = __tm_write_barrier_pure;
   _tm_write_barrier_root = __tm_write_barrier_root;
+
+  /*! Select the write barrier. */
+  {
+    const char *s = getenv("TM_BARRIER");
+
+    if ( s && ! strcmp(s, "software") )
+      tm_write_barrier_mode = tm_BARRIER_SOFTWARE;
+    else if ( s && ! strcmp(s, "mprotect") )
+      tm_write_barrier_mode = tm_BARRIER_MPROTECT;
+    else if ( s && ! strcmp(s, "uffd") )
+      tm_write_barrier_mode = tm_BARRIER_UFFD;
+    else if ( s )
+      tm_msg("WARNING: tm_init(): unknown TM_BARRIER=%s\n", s);
+  }
+
+  /*! With page-protection write barriers, mutators need not call write barriers. */
+  if ( tm_write_barrier_mode != tm_BARRIER_SOFTWARE ) {
+    if ( _tm_wb_init(tm_write_barrier_mode) ) {
+      _tm_write_barrier = __tm_write_barrier_ignore;
+      _tm_write_barrier_pure = __tm_write_barrier_ignore;
+      _tm_write_barrier_root = __tm_write_barrier_ignore;
+    } else {
+      tm_msg("WARNING: tm_init(): write barrier mode %d not supported.\n", tm_write_barrier_mode);
+      tm_write_barrier_mode = tm_BARRIER_SOFTWARE;
+    }
+  }
   
+  /*! Trace API calls and write barriers. */
+  _tm_trace_init();
+
   /*! Mark system as initialized. */
   -- tm.initing;
   ++ tm.inited;
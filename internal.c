@@ -37,7 +37,9 @@ void tm_node_mutation(tm_node *n)
   tm_block *block = tm_node_to_block(n);
   tm_type *type = tm_block_type(block);
   if ( tm_tread_mutation(tm_type_tread(type), n) ) {
+#if 0
     fprintf(stderr, "*");
+#endif
   }
 }
 
@@ -100,6 +102,7 @@ void _tm_alloc_flip_all()
 {
   tm_type *type;
 
+#if 0
   fprintf(stderr, "#### _tm_alloc_flip_all %lu: %lu %lu %lu %lu %lu\n", 
 	  (unsigned long) tm.alloc_id,
 	  (unsigned long) tm.n[0],
@@ -107,10 +110,17 @@ void _tm_alloc_flip_all()
 	  (unsigned long) tm.n[2],
 	  (unsigned long) tm.n[3],
 	  (unsigned long) tm.n[4]);
+#endif
 
   /* Flip the colors, globally. */
   tm_colors_flip(&tm.colors);
 
+  /* Roots are about to be scanned: write barriers must record mutations. */
+  _tm_write_barrier_black = BLACK;
+  _tm_write_barrier_grey = GREY;
+  _tm_write_barrier_active = _tm_trace_active ? 2 : ! tm.wb_active;
+  _tm_wb_flip();
+
   /* Flip each type. */
   tm_list_LOOP(&tm.types, type) {
     tm_tread_flip(&type->tread);
@@ -127,6 +137,9 @@ void _tm_alloc_flip_all()
   tm_list_LOOP_END;
 
   tm.alloc_since_flip = 0;
+
+  /*! Restart the lazy tm_block sweep; see tm_type_sweep_some_blocks(). */
+  _tm_block_sweep_init();
 }
 
 
@@ -162,6 +175,7 @@ void *_tm_alloc_type_inner(tm_type *t)
 
   /* BEGIN CRITICAL SECTION */
 
+#if 0
   fprintf(stderr, "%lu %lu %lu %lu: %lu %lu\n", 
 	  (unsigned long) tm.n[WHITE],
 	  (unsigned long) tm.n[ECRU],
@@ -169,22 +183,72 @@ void *_tm_alloc_type_inner(tm_type *t)
 	  (unsigned long) tm.n[BLACK],
 	  (unsigned long) tm.alloc_since_flip,
 	  (unsigned long) tm.n[tm_TOTAL]);
+#endif
+
+  /*! After fork(), allocate without collecting for a while; see tm_atfork_child(). */
+  if ( tm.fork_delay ) {
+    -- tm.fork_delay;
+    goto parcel;
+  }
 
   /* HACK!!! */
   if ( ! tm.n[WHITE] ) {
     if ( tm.alloc_since_flip > tm.n[tm_TOTAL] / 2 ) {
+#if 0
       fprintf(stderr, "[SCANALL]");
+#endif
       _tm_alloc_scan_all();
     }
   }
 
+  /*! Scan some of the stack since the last flip. */
+  if ( tm.stack_scan_l ) {
+    _tm_stack_scan_some(tm_root_scan_some_size);
+  }
+
   /*! If no WHITE or GREY nodes, maybe flip? */
   if ( ! tm.n[WHITE] && ! tm.n[GREY] ) {
+#if tm_TIME_STAT
+    tm_time_stat_begin(&tm.ts_flip);
+#endif
+
+    /*! Rescan mutated root cards and the active part of the stack and finish marking, atomically. */
+    _tm_wb_final();
+    _tm_root_scan_dirty();
+    _tm_stack_scan();
+    _tm_alloc_scan_all();
+
+    /*! Resurrect unreachable nodes with finalizers for one more cycle; see finalize.c. */
+    if ( _tm_finalize_flip() ) {
+      _tm_alloc_scan_all();
+    }
+
+    /*! Clear weak pointers to nodes that are still unreachable; see weak.c. */
+    _tm_weak_flip();
+
+    /*! Trace the nodes still unreachable; see trace.c. */
+    _tm_trace_flip();
+
     _tm_alloc_flip_all();
+
+#if tm_TIME_STAT
+    tm_time_stat_end(&tm.ts_flip);
+#endif
   }
 
   /* Allocate some more nodes. */
+ parcel:
   if ( ! t->n[WHITE] ) {
+    /*! Lazily sweep some of this tm_type's tm_blocks since the last flip, only when its free list is empty. */
+    if ( tm_type_sweep_pending(t) && ! tm.fork_delay ) {
+      long left = tm_block_sweep_some_size;
+      tm_type_sweep_some_blocks(t, &left, 0);
+    }
+
+    /*! If a new tm_block is needed, sweep other tm_types until one is released. */
+    if ( ! t->parcel_from_block && ! tm.free_blocks_n && ! tm.fork_delay ) {
+      _tm_block_sweep_some(tm.n[tm_B], 1);
+    }
     tm_type_parcel_or_alloc_node(t);
   }
 
@@ -202,13 +266,15 @@ void *_tm_alloc_type_inner(tm_type *t)
 
   /* END CRITICAL SECTION */
 
+#if 0
   fprintf(stderr, "A");
+#endif
 
 #if tm_ptr_to_node_TEST
   /* Validate tm_ptr_to_node() */
   if ( ptr ) {
     char *p = ptr;
-    tm_node *n = (void*) (p - tm_node_HDR_SIZE);
+    tm_node *n = tm_pure_ptr_to_node(p);
     tm_assert(tm_ptr_to_node(n) == 0);
     tm_assert(tm_ptr_to_node(p) == n);
     tm_assert(tm_ptr_to_node(p + 1) == n);
@@ -222,7 +288,7 @@ void *_tm_alloc_type_inner(tm_type *t)
   }
 #endif
 
-  tm_alloc_log(ptr);
+  tm_alloc_log(ptr, t->size);
 
 #if 0
   tm_msg("a %p[%lu]\n", ptr, (unsigned long) t->size);
@@ -302,6 +368,15 @@ void _tm_gc_full_inner()
 }
 
 
+/**
+ * Finish marking: scan all GREY nodes.
+ */
+void _tm_scan_all_inner()
+{
+  _tm_alloc_scan_all();
+}
+
+
 /*@}*/
 
 
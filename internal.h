@@ -163,6 +163,9 @@ void *_tm_alloc_desc_inner(tm_adesc *desc);
 void *_tm_realloc_inner(void *ptr, size_t size);
 void _tm_free_inner(void *ptr);
 void _tm_gc_full_inner();
+void _tm_scan_all_inner();
+
+int _tm_fork_init();
 
 /*@}*/
 
@@ -175,6 +178,8 @@ void _tm_gc_full_inner();
 #include "tredmill/ptr.h"
 #include "tredmill/mark.h"
 #include "tredmill/node_color.h"
+#include "tredmill/wb.h"
+#include "tredmill/trace.h"
 
 /****************************************************************************/
 /* Support. */
@@ -1,13 +1,38 @@
+/** \file log.c
+ * \brief Allocation log.
+ *
+ * If TM_ALLOC_LOG names a file, every allocation is logged to it as
+ * a binary tm_alloc_log_record, in a ring of tm_alloc_log_records records
+ * memory-mapped from the file; see log.h.
+ * Logging a record is a few stores: the kernel writes the pages back.
+ * Child processes do not log; see _tm_alloc_log_atfork_child().
+ *
+ * See tmalloclog.c to convert a log to the text columns used by alloc_log.gp.
+ */
 #include "internal.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+
 const char *tm_alloc_log_name = 0;
-FILE *tm_alloc_log_fh;
 
-static unsigned long log_id = 0;
-static unsigned long log_ratio = 1;
+/*! Number of records in the allocation log ring.  Overridden by the TM_ALLOC_LOG_RECORDS environment variable. */
+size_t tm_alloc_log_records = 1024 * 1024;
+
+/*! The mapped log header. */
+static tm_alloc_log_header *log_header;
+
+/*! The mapped log ring. */
+static tm_alloc_log_record *log_ring;
+
 
 void tm_alloc_log_init()
 {
+  const char *s;
+  size_t size;
+  void *p;
+  int fd;
+
   if ( ! tm_alloc_log_name ) {
     tm_alloc_log_name = getenv("TM_ALLOC_LOG");
   }
@@ -15,50 +40,69 @@ void tm_alloc_log_init()
   if ( ! (tm_alloc_log_name && tm_alloc_log_name[0]) )
     return;
 
-  if ( ! tm_alloc_log_fh ) {
+  if ( (s = getenv("TM_ALLOC_LOG_RECORDS")) && atol(s) > 0 ) {
+    tm_alloc_log_records = atol(s);
+  }
+
+  if ( ! log_header ) {
     fprintf(stderr, "OPENING %s\n", tm_alloc_log_name);
-    tm_alloc_log_fh = fopen(tm_alloc_log_name, "w+");
-    if ( ! tm_alloc_log_fh ) {
+
+    size = sizeof(*log_header) + tm_alloc_log_records * sizeof(*log_ring);
+    if ( (fd = open(tm_alloc_log_name, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0 ||
+	 ftruncate(fd, size) ||
+	 (p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
       tm_abort();
     }
-    fprintf(tm_alloc_log_fh,
-	    "%6s %12s %6s %6s %6s %6s %6s %6s %6s %6s\n",
-	    "#ID", 
-	    "PTR",
-	    "WHITE",
-	    "ECRU",
-	    "GREY",
-	    "BLACK",
-	    "TOTAL",
-	    "BLOCKS",
-	    "FREE_BLOCKS",
-	    "FLIP");
+    close(fd);
+
+    log_header = p;
+    log_ring = (tm_alloc_log_record*) (log_header + 1);
+
+    memcpy(log_header->magic, tm_alloc_log_MAGIC, sizeof(log_header->magic));
+    log_header->record_size = sizeof(*log_ring);
+    log_header->ptr_size = sizeof(void*);
+    log_header->capacity = tm_alloc_log_records;
+    log_header->head = 0;
   }
 }
 
 
-void tm_alloc_log(void *ptr)
+/**
+ * Stop logging in a child process after fork().
+ *
+ * The ring is MAP_SHARED with the parent:
+ * parent and child would race on log_header->head and overwrite each other's records.
+ * Called by tm_atfork_child().
+ */
+void _tm_alloc_log_atfork_child()
 {
-  if ( tm_alloc_log_fh ) {
-    if ( log_id ++ % log_ratio == 0 ) {
-      fprintf(tm_alloc_log_fh,
-	      "%6lu %24llu %6lu %6lu %6lu %6lu %6lu %6lu %6lu %6lu\n",  
-	      (unsigned long) tm.alloc_id,
-	      (unsigned long long) ptr,
-	      (unsigned long) tm.n[WHITE],
-	      (unsigned long) tm.n[ECRU],
-	      (unsigned long) tm.n[GREY],
-	      (unsigned long) tm.n[BLACK],
-	      (unsigned long) tm.n[tm_TOTAL],
-	      (unsigned long) tm.n[tm_B],
-	      (unsigned long) tm.free_blocks_n,
-	      (unsigned long) tm.colors.flip_id
-	      );
-    }
-#if 1
-    if ( log_ratio < 1000 && log_id / log_ratio > 100 ) {
-      log_ratio *= 10;
-    }
-#endif
+  if ( ! log_header )
+    return;
+
+  munmap(log_header, sizeof(*log_header) + log_header->capacity * sizeof(*log_ring));
+  log_header = 0;
+  log_ring = 0;
+}
+
+
+void tm_alloc_log(void *ptr, size_t size)
+{
+  if ( log_header ) {
+    unsigned long long head = log_header->head;
+    tm_alloc_log_record *r = &log_ring[head % log_header->capacity];
+
+    r->id = tm.alloc_id;
+    r->ptr = (tm_ptr_word) ptr;
+    r->size = size;
+    r->flip = tm.colors.flip_id;
+    r->n[tm_WHITE] = tm.n[WHITE];
+    r->n[tm_ECRU] = tm.n[ECRU];
+    r->n[tm_GREY] = tm.n[GREY];
+    r->n[tm_BLACK] = tm.n[BLACK];
+    r->n[tm_TOTAL] = tm.n[tm_TOTAL];
+    r->blocks = tm.n[tm_B];
+    r->free_blocks = tm.free_blocks_n;
+
+    log_header->head = head + 1;
   }
 }
@@ -3,13 +3,59 @@
 
 #include <stdio.h>
 
+/*! The magic number at the start of an allocation log. */
+#define tm_alloc_log_MAGIC "TMALOG\0\1"
+
+/**
+ * The allocation log header.
+ *
+ * The log is a ring of tm_alloc_log_record after the header:
+ * record i is at ring index i % capacity.
+ */
+typedef struct tm_alloc_log_header {
+  /*! tm_alloc_log_MAGIC. */
+  char magic[8];
+  /*! sizeof(tm_alloc_log_record). */
+  unsigned int record_size;
+  /*! sizeof(void*) of the logging process. */
+  unsigned int ptr_size;
+  /*! The number of records in the ring. */
+  unsigned long long capacity;
+  /*! The number of records logged: the oldest record kept is max(0, head - capacity). */
+  volatile unsigned long long head;
+} tm_alloc_log_header;
+
+
+/**
+ * An allocation log record.
+ */
+typedef struct tm_alloc_log_record {
+  /*! tm_data.alloc_id. */
+  unsigned long long id;
+  /*! The node's address, or 0 if out of memory. */
+  unsigned long long ptr;
+  /*! The node size of its tm_type: the size class. */
+  unsigned int size;
+  /*! tm_colors.flip_id: the collection cycle. */
+  unsigned int flip;
+  /*! Global node counts: WHITE, ECRU, GREY, BLACK and tm_TOTAL. */
+  unsigned int n[5];
+  /*! tm_blocks in use. */
+  unsigned int blocks;
+  /*! tm_blocks on the free lists. */
+  unsigned int free_blocks;
+  unsigned int _pad;
+} tm_alloc_log_record;
+
+
 extern
 const char *tm_alloc_log_name;
 
 extern
-FILE *tm_alloc_log_fh;
+size_t tm_alloc_log_records;
 
 void tm_alloc_log_init();
-void tm_alloc_log(void *ptr);
+void _tm_alloc_log_atfork_child();
+void tm_alloc_log(void *ptr, size_t size);
 
 #endif
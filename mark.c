@@ -44,58 +44,203 @@ long tm_root_scan_some_size = 512;
  */
 void _tm_root_loop_init()
 {
-  tm.rooti = tm.root_datai;
-  tm.rp = tm.roots[tm.rooti].l;
+  tm.rp = 0;
   tm.data_mutations = tm.stack_mutations = 0;
 }
 
 
 /**
- * Scan a root id.
+ * Scan a root.
  */
 static
-void _tm_root_scan_id(int i)
+void _tm_root_scan(const tm_root *r)
 {
-  if ( tm.roots[i].l < tm.roots[i].h ) {
-    tm_msg("r [%p,%p] %s\n", tm.roots[i].l, tm.roots[i].h, tm.roots[i].name);
-    _tm_range_scan(tm.roots[i].l, tm.roots[i].h);
+  if ( r->l < r->h ) {
+    tm_msg("r [%p,%p] %s\n", r->l, r->h, r->name);
+    _tm_range_scan(r->l, r->h);
   }
-  if ( tm.roots[i].callback ) {
-    tm_msg("r %p(%p) %s\n", tm.roots[i].callback, tm.roots[i].callback_data, tm.roots[i].name);
-    tm.roots[i].callback(tm.roots[i].callback_data);
+  if ( r->callback ) {
+    tm_msg("r %p(%p) %s\n", r->callback, r->callback_data, r->name);
+    r->callback(r->callback_data);
   }
 }
 
+
+/**
+ * Call all root callbacks.
+ */
+static
+void _tm_root_scan_callbacks()
+{
+  int i;
+
+  for ( i = 0; i < tm.root_callbacks.n; ++ i ) {
+    _tm_root_scan(&tm.root_callbacks.r[i]);
+  }
+}
+
+
 /**
  * Scan registers.
  * 
- * Registers are in tm.root[0].
+ * Registers are in tm.root_register.
  */
 void _tm_register_scan()
 {
-  _tm_root_scan_id(0);
+  _tm_root_scan(&tm.root_register);
 }
 
 /**
  * Set the stack pointer.
  *
  * Adjust for slack.
+ *
+ * Also maintains the stack watermark:
+ * the shallowest stack pointer seen since the stack scan began.
  */
 void _tm_set_stack_ptr(void *stackvar)
 {
-  *tm.stack_ptrp = (char*) stackvar - 64;
+  char *sp = (char*) stackvar - 64;
+
+  *tm.stack_ptrp = sp;
+
+  if ( sp > tm.stack_watermark ) 
+    tm.stack_watermark = sp;
+}
+
+
+/*! True if the stack is scanned incrementally; only supported for stacks growing down. */
+#define tm_stack_scan_INCREMENTAL (tm_stack_scan_incremental && tm.stack_grows < 0)
+
+/*! The address of the copy of stack address A. */
+#define tm_stack_copy_of(A) (tm.stack_copy + tm.stack_copy_size - ((const char*) tm.root_stack.h - (const char*) (A)))
+
+
+/**
+ * Make sure the stack copy can hold size bytes.
+ *
+ * Returns 0 if the stack copy could not be grown.
+ */
+static
+int _tm_stack_copy_reserve(size_t size)
+{
+  if ( size > tm.stack_copy_size ) {
+    size_t new_size = size * 2;
+    char *ptr;
+
+    new_size += tm_block_SIZE - new_size % tm_block_SIZE;
+    if ( ! (ptr = _tm_os_alloc_aligned(new_size)) )
+      return 0;
+
+    /*! Keep the copy aligned to its high end. */
+    if ( tm.stack_copy ) {
+      memcpy(ptr + new_size - tm.stack_copy_size, tm.stack_copy, tm.stack_copy_size);
+      _tm_os_free_aligned(tm.stack_copy, tm.stack_copy_size);
+    }
+
+    tm.stack_copy = ptr;
+    tm.stack_copy_size = new_size;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Begin scanning the stack.
+ *
+ * Called when roots are scanned after a flip.
+ *
+ * If the stack is scanned incrementally,
+ * the stack is scanned by _tm_stack_scan_some(), coldest frames first,
+ * and the stack watermark is reset to the current stack pointer.
+ * Otherwise, the stack is scanned now.
+ */
+void _tm_stack_scan_begin()
+{
+  if ( tm_stack_scan_INCREMENTAL ) {
+    tm.stack_scan_l = (char*) tm.root_stack.h;
+    tm.stack_watermark = (char*) tm.root_stack.l;
+  } else {
+    tm.stack_scan_l = 0;
+    _tm_root_scan(&tm.root_stack);
+  }
+}
+
+
+/**
+ * Scan some of the stack, coldest frames first.
+ *
+ * Each range scanned is copied,
+ * so _tm_stack_scan() can tell whether it changed.
+ *
+ * Returns 0 if the stack was scanned as far as the current stack pointer.
+ */
+int _tm_stack_scan_some(long left)
+{
+  const char *l = tm.root_stack.l;
+  char *h = tm.stack_scan_l, *b;
+
+  if ( ! h || h <= l )
+    return 0;
+
+  b = h - left;
+  if ( b < l )
+    b = (char*) l;
+  b = (char*) ((tm_ptr_word) b & ~ ((tm_ptr_word) tm_PTR_ALIGN - 1));
+
+  _tm_range_scan(b, h);
+
+  if ( _tm_stack_copy_reserve((char*) tm.root_stack.h - b) ) {
+    memcpy(tm_stack_copy_of(b), b, h - b);
+    tm.stack_scan_l = b;
+  } else {
+    /*! If the copy failed, _tm_stack_scan() must scan the stack fully. */
+    tm.stack_scan_l = 0;
+  }
+
+  return b > l;
 }
 
 
 /**
  * Scan stack (and registers).
  *
+ * Called atomically at the end of root marking.
+ *
+ * If the stack was scanned incrementally since the last flip,
+ * only frames below the stack watermark are scanned:
+ * frames above the watermark are compared against the copy taken
+ * when they were scanned.  If they changed, because frames were popped
+ * and pushed again between calls to _tm_set_stack_ptr(),
+ * the whole stack is scanned.
+ *
  * Mark stack as un-mutated.
  */
 void _tm_stack_scan()
 {
   _tm_register_scan();
-  _tm_root_scan_id(1);
+
+  if ( tm_stack_scan_INCREMENTAL && tm.stack_scan_l ) {
+    const char *l = tm.root_stack.l, *h = tm.root_stack.h;
+    const char *w = tm.stack_watermark > tm.stack_scan_l ? tm.stack_watermark : tm.stack_scan_l;
+
+    w = (const char*) ((tm_ptr_word) w & ~ ((tm_ptr_word) tm_PTR_ALIGN - 1));
+    if ( w > h ) 
+      w = h;
+
+    if ( l <= w && ! memcmp(tm_stack_copy_of(w), w, h - w) ) {
+      tm_msg("r s [%p,%p] [%p,%p]\n", l, w, w, h);
+      _tm_range_scan(l, w);
+    } else {
+      tm_msg("r s [%p,%p]\n", l, h);
+      _tm_range_scan(l, h);
+    }
+  } else {
+    _tm_root_scan(&tm.root_stack);
+  }
+
+  tm.stack_scan_l = 0;
   tm.stack_mutations = 0;
 }
 
@@ -108,9 +253,20 @@ void tm_root_scan_all()
   int i;
 
   tm_msg("r G%lu B%lu {\n", tm.n[GREY], tm.n[BLACK]);
-  for ( i = 0; tm.roots[i].name; ++ i ) {
-    _tm_root_scan_id(i);
+  _tm_register_scan();
+
+  /*! The stack may be scanned incrementally; see _tm_stack_scan_begin(). */
+  _tm_stack_scan_begin();
+
+  /*! Clear the root cards: only roots mutated after this are rescanned; see _tm_root_scan_dirty(). */
+  if ( tm_root_soft_dirty )
+    _tm_root_soft_dirty_clear();
+  _tm_root_set_cards_clear(&tm.roots);
+  for ( i = 0; i < tm.roots.n; ++ i ) {
+    _tm_root_scan(&tm.roots.r[i]);
   }
+  _tm_root_scan_callbacks();
+
   tm.data_mutations = tm.stack_mutations = 0;
   _tm_root_loop_init();
 #if 0
@@ -119,50 +275,80 @@ void tm_root_scan_all()
 }
 
 
+/**
+ * Rescan the root cards dirtied by root write barriers, or soft-dirty pages, since the roots were scanned.
+ *
+ * Called atomically at the end of root marking,
+ * so its cost is proportional to how much of the roots was mutated.
+ *
+ * Mark roots as un-mutated.
+ */
+void _tm_root_scan_dirty()
+{
+  /*! Roots written without tm_write_barrier_root() are found by soft-dirty page bits. */
+  if ( tm_root_soft_dirty )
+    _tm_root_soft_dirty_mark();
+
+  if ( tm.data_mutations ) {
+    tm_msg("r c %lu %lu\n", tm.roots.cards_dirty, tm.dl_roots.cards_dirty);
+  }
+
+  _tm_root_set_scan_dirty(&tm.roots);
+  _tm_root_set_scan_dirty(&tm.dl_roots);
+
+  tm.data_mutations = 0;
+}
+
+
 /**
  * Scan some roots.
+ *
+ * The data roots are scanned in address order from tm.rp,
+ * so roots may be added or removed between calls.
+ * After the data roots, the root callbacks are called.
+ *
+ * Returns 0 if all roots were scanned.
  */
 int _tm_root_scan_some()
 {
   int result = 1;
   long left = tm_root_scan_some_size;
+  int i;
 
   tm_msg("r G%lu B%lu {\n", tm.n[GREY], tm.n[BLACK]);
-  tm_msg("r [%p,%p] %p(%p) %s\n", 
-	 tm.roots[tm.rooti].l, 
-	 tm.roots[tm.rooti].h,
-	 tm.roots[tm.rooti].callback, 
-	 tm.roots[tm.rooti].callback_data, 
-	 tm.roots[tm.rooti].name 
-	 );
+
+  /*! Find the root containing, or following, tm.rp. */
+  i = _tm_root_set_search(&tm.roots, tm.rp);
 
   do {
-    /* Try marking some roots. */
-    while ( (void*) (tm.rp + sizeof(void*)) >= tm.roots[tm.rooti].h ) {
-      ++ tm.rooti;
-      if ( ! tm.roots[tm.rooti].name ) {
-	_tm_root_loop_init();
-	tm_msg("r done\n");
-
-	result = 0;
-	goto done;
-      }
-
-      tm_msg("r [%p,%p] %p(%p) %s\n", 
-	     tm.roots[tm.rooti].l, 
-	     tm.roots[tm.rooti].h,
-	     tm.roots[tm.rooti].callback,
-	     tm.roots[tm.rooti].callback_data,
-	     tm.roots[tm.rooti].name);
-      
-      tm.rp = tm.roots[tm.rooti].l;
+    const tm_root *r;
+
+    if ( i >= tm.roots.n ) {
+      _tm_root_scan_callbacks();
+      _tm_root_loop_init();
+      tm_msg("r done\n");
+
+      result = 0;
+      goto done;
     }
 
-    _tm_mark_possible_ptr(* (void**) tm.rp);
+    r = &tm.roots.r[i];
+    if ( tm.rp < (const char*) r->l ) {
+      tm_msg("r [%p,%p] %s\n", r->l, r->h, r->name);
+      tm.rp = r->l;
+    }
 
-    tm.rp += tm_PTR_ALIGN;
-    left -= tm_PTR_ALIGN;
+    /* Try marking some roots. */
+    while ( (void*) (tm.rp + sizeof(void*)) <= r->h && left > 0 ) {
+      _tm_mark_possible_ptr(* (void**) tm.rp);
 
+      tm.rp += tm_PTR_ALIGN;
+      left -= tm_PTR_ALIGN;
+    }
+
+    if ( (void*) (tm.rp + sizeof(void*)) > r->h ) {
+      ++ i;
+    }
   } while ( left > 0 );
 
  done:
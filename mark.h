@@ -72,9 +72,12 @@ void _tm_root_loop_init();
 void _tm_register_scan();
 
 void _tm_set_stack_ptr(void *stackvar);
+void _tm_stack_scan_begin();
+int _tm_stack_scan_some(long left);
 void _tm_stack_scan();
 
 void tm_root_scan_all();
+void _tm_root_scan_dirty();
 int _tm_root_scan_some();
 
 __inline
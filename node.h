@@ -26,6 +26,11 @@
  *
  * A tm_node's tm_type is determined by the tm_block it resides in.
  *
+ * If tm_node_SIDE_TABLE is true, tm_nodes are not before their data:
+ * each tm_block has a side table of tm_nodes after its header,
+ * and node data starts on a later page.
+ * Pages holding node data are then only written by the mutator,
+ * and stay shared with the parent after fork().
  */
 typedef struct tm_node {
   /*! The current type list for the node. */
@@ -43,7 +48,11 @@ typedef struct tm_node {
 #define tm_node_color(n) ((tm_color) tm_list_color(n))
 
 /*! A pointer to the data of a tm_node. */
+#if tm_node_SIDE_TABLE
+#define tm_node_ptr(n) tm_node_to_ptr((tm_node*) (n))
+#else
 #define tm_node_ptr(n) ((void*)(((tm_node*) n) + 1))
+#endif
 
 /*! Return the tm_node's tm_type. */
 #define tm_node_type(n) tm_block_type(tm_node_to_block(n))
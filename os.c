@@ -3,6 +3,10 @@
  */
 #include "internal.h"
 
+#if tm_USE_MMAP
+#include <sys/mman.h> 
+#endif
+
 /****************************************************************************/
 /*! \defgroup allocation_low_level Allocation: Low-level */
 /*@{*/
@@ -13,12 +17,140 @@ size_t tm_os_alloc_total = 0;
 
 
 #if tm_USE_MMAP
-#include <sys/mman.h> 
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
 #endif
 
+/**
+ * Reserve a contiguous heap address range of size bytes.
+ *
+ * The range is mapped PROT_NONE and is aligned to tm_arena_SIZE.
+ * Pages are committed by _tm_os_alloc_() on demand.
+ * Afterwards, tm_ptr_in_heap() is a single compare against the range
+ * and page-indexed bit maps are indexed by offset into the range.
+ *
+ * Returns 0 if the range could not be reserved.
+ */
+int _tm_os_reserve(size_t size)
+{
+  char *ptr;
+  size_t offset;
+
+  tm_assert(! tm.heap_base);
+
+  /*! Limit the range to what the page-indexed bit maps can hold. */
+  if ( size / tm_page_SIZE > tm_BITMAP_SIZE * bitset_ELEM_BSIZE - tm_arena_SIZE / tm_page_SIZE )
+    size = (tm_BITMAP_SIZE * bitset_ELEM_BSIZE - tm_arena_SIZE / tm_page_SIZE) * tm_page_SIZE;
+  size -= size % tm_arena_SIZE;
+  if ( ! size )
+    return 0;
+
+  /*! Reserve extra room for alignment; the slack stays reserved. */
+  ptr = mmap((void*) 0,
+	     size + tm_arena_SIZE,
+	     PROT_NONE,
+	     MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+	     -1,
+	     (off_t) 0
+	     );
+  if ( ptr == MAP_FAILED ) {
+    perror("tm: mmap() reserve failed");
+    return 0;
+  }
+
+  if ( (offset = ((tm_ptr_word) ptr) % tm_arena_SIZE) )
+    ptr += tm_arena_SIZE - offset;
+
+  tm.heap_base = ptr;
+  tm.heap_size = size;
+  tm.heap_next = 0;
+  memset(tm.heap_committed, 0, sizeof(tm.heap_committed));
+
+  tm_msg("A r %p[%lu]\n", (void*) ptr, (unsigned long) size);
+
+  return 1;
+}
+
+
+/**
+ * Commit size bytes of pages in the reserved heap address range.
+ *
+ * Uses next-fit over the bit map of committed pages.
+ * Runs of pages start on a tm_block boundary, so the result is aligned to tm_block_SIZE.
+ * Returns 0 if the reserved range is exhausted.
+ */
+static
+void *_tm_heap_commit(size_t size)
+{
+  size_t n = (size + tm_page_SIZE - 1) / tm_page_SIZE;
+  size_t pages = tm.heap_size / tm_page_SIZE;
+  size_t bp = tm_block_SIZE / tm_page_SIZE;
+  size_t i = (tm.heap_next + bp - 1) / bp * bp, run = 0, left = pages + n;
+  char *ptr;
+
+  while ( left -- > 0 ) {
+    if ( i >= pages ) {
+      i = 0;
+      run = 0;
+    }
+    if ( bitset_get(tm.heap_committed, i) ) {
+      /*! Restart the run at the next tm_block. */
+      run = 0;
+      i = (i / bp + 1) * bp;
+      continue;
+    } else if ( ++ run == n ) {
+      i = i + 1 - n;
+      ptr = tm.heap_base + i * tm_page_SIZE;
+
+      if ( mprotect(ptr, n * tm_page_SIZE, PROT_READ | PROT_WRITE) ) {
+	perror("tm: mprotect() commit failed");
+	return 0;
+      }
+
+      tm.heap_next = i + n;
+      while ( n -- > 0 ) {
+	bitset_set(tm.heap_committed, i);
+	++ i;
+      }
+
+      return ptr;
+    }
+    ++ i;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Decommit pages in the reserved heap address range.
+ *
+ * The pages are discarded and remain reserved.
+ */
+static
+void _tm_heap_decommit(char *ptr, size_t size)
+{
+  size_t i = tm_page_index(ptr), n = (size + tm_page_SIZE - 1) / tm_page_SIZE;
+
+  if ( mmap(ptr, n * tm_page_SIZE, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, (off_t) 0) == MAP_FAILED ) {
+    perror("tm: mmap() decommit failed");
+  }
+
+  while ( n -- > 0 ) {
+    tm_assert_test(bitset_get(tm.heap_committed, i));
+    bitset_clr(tm.heap_committed, i);
+    ++ i;
+  }
+}
+
+#endif /* tm_USE_MMAP */
+
+
 /**
  * Allocate memory from the OS.
  *
+ * - If a heap address range was reserved, commit pages inside it.
  * - If tm_USE_MMAP is true, use mmap().
  * - If tm_USE_SBRK is true, use sbrk().
  * .
@@ -31,6 +163,14 @@ void *_tm_os_alloc_(long size)
   tm_assert_test(size > 0);
 
 #if tm_USE_MMAP
+  /*! If a heap address range was reserved, all memory must come from it. */
+  if ( tm.heap_base ) {
+    if ( ! (ptr = _tm_heap_commit(size)) ) {
+      tm_msg("A r 0 %lu\n", (unsigned long) size);
+    }
+    return ptr;
+  }
+
 #ifdef MAP_ANONYMOUS
   tm.mmap_fd = -1;
 #endif
@@ -94,7 +234,11 @@ void *_tm_os_free_(void *ptr, long size)
   tm_assert_test(size > 0);
 
 #if tm_USE_MMAP
-  munmap(ptr, size);
+  if ( tm.heap_base ) {
+    _tm_heap_decommit(ptr, size);
+  } else {
+    munmap(ptr, size);
+  }
 
   /*! Return next allocation ptr as "unknown" (0). */
   return 0;
@@ -203,6 +347,184 @@ void *_tm_os_free(void *ptr, long size)
 }
 
 
+/*@}*/
+
+/**************************************************/
+/* \defgroup allocation_arena  Allocation: Arenas */
+/*@{*/
+
+#if tm_USE_ARENA
+
+/**
+ * Allocate a new tm_arena from the OS.
+ *
+ * Maps twice tm_arena_SIZE and returns the unaligned head and tail
+ * back to the OS.
+ */
+static
+tm_arena *_tm_arena_alloc_os()
+{
+  char *ptr;
+  tm_arena *a;
+  size_t head;
+
+  /*! Return 0 if the OS would not allocate room for alignment. */
+  if ( ! (ptr = _tm_os_alloc(tm_arena_SIZE * 2)) )
+    return 0;
+
+  /*! Return the unaligned head and tail to the OS. */
+  head = ((tm_ptr_word) ptr) % tm_arena_SIZE;
+  if ( head ) {
+    head = tm_arena_SIZE - head;
+    _tm_os_free(ptr, head);
+  }
+  a = (tm_arena*) (ptr + head);
+  _tm_os_free((char*) a + tm_arena_SIZE, tm_arena_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+  /*! Ask the OS to back the arena with a huge page. */
+  madvise(a, tm_arena_SIZE, MADV_HUGEPAGE);
+#endif
+
+  /*! Initialize the arena; its first tm_block holds the header. */
+  tm_list_init(&a->list);
+  tm_list_insert(&tm.arenas, a);
+  ++ tm.arenas_n;
+  bitset_set(tm.arena_map, tm_arena_index(a));
+
+  a->n_used = 0;
+  memset(a->in_use, 0, sizeof(a->in_use));
+  bitset_set(a->in_use, 0);
+
+  tm_msg("A aa %p #%d\n", (void*) a, tm.arenas_n);
+
+  return a;
+}
+
+
+/**
+ * Carve n contiguous tm_blocks from a tm_arena.
+ *
+ * Returns 0 if the tm_arena does not have n contiguous free tm_blocks.
+ */
+static
+void *_tm_arena_carve(tm_arena *a, size_t n)
+{
+  size_t i, run = 0;
+
+  if ( a->n_used + 1 + n > tm_arena_BLOCKS )
+    return 0;
+
+  for ( i = 1; i < tm_arena_BLOCKS; ++ i ) {
+    if ( bitset_get(a->in_use, i) ) {
+      run = 0;
+    } else if ( ++ run == n ) {
+      /*! Mark the tm_blocks as carved. */
+      for ( i = i + 1 - n, run = 0; run < n; ++ run ) {
+	bitset_set(a->in_use, i + run);
+      }
+      a->n_used += n;
+
+      /*! Move a full tm_arena behind the tm_arenas with free tm_blocks. */
+      if ( tm_arena_full(a) ) {
+	tm_list_remove_and_append(&tm.arenas, a);
+      }
+
+      return (char*) a + i * tm_block_SIZE;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Allocate tm_blocks from a tm_arena.
+ *
+ * Returns 0 if size does not fit in a tm_arena or a new tm_arena could not be allocated.
+ */
+static
+void *_tm_arena_alloc(size_t size)
+{
+  size_t n = size / tm_block_SIZE;
+  tm_arena *a;
+  void *ptr = 0;
+
+  if ( n >= tm_arena_BLOCKS )
+    return 0;
+
+  /*! Carve from an existing tm_arena with free tm_blocks, */
+  tm_list_LOOP(&tm.arenas, a);
+  {
+    if ( tm_arena_full(a) )
+      break;
+    if ( (ptr = _tm_arena_carve(a, n)) )
+      break;
+  }
+  tm_list_LOOP_END;
+
+  /*! Or from a new tm_arena. */
+  if ( ! ptr && (a = _tm_arena_alloc_os()) ) {
+    ptr = _tm_arena_carve(a, n);
+  }
+
+  return ptr;
+}
+
+
+/**
+ * Return tm_blocks to their tm_arena.
+ *
+ * A tm_arena is returned to the OS, as a whole huge page, when all of its tm_blocks are free.
+ * Otherwise the pages of the tm_blocks are released with MADV_DONTNEED.
+ * Returns 0 if ptr was not carved from a tm_arena.
+ */
+static
+int _tm_arena_free(void *ptr, size_t size)
+{
+  tm_arena *a = (tm_arena*) (((tm_ptr_word) ptr) & ~ ((tm_ptr_word) tm_arena_SIZE - 1));
+  size_t i, n;
+
+  /*! Find the tm_arena without touching memory that may not be an arena. */
+  if ( ! bitset_get(tm.arena_map, tm_arena_index(ptr)) )
+    return 0;
+
+  /*! Move a full tm_arena in front of the full tm_arenas. */
+  if ( tm_arena_full(a) ) {
+    tm_list_remove_and_insert(&tm.arenas, a);
+  }
+
+  i = ((char*) ptr - (char*) a) / tm_block_SIZE;
+  n = size / tm_block_SIZE;
+  tm_assert_test(i > 0 && i + n <= tm_arena_BLOCKS);
+  tm_assert_test(a->n_used >= n);
+
+  a->n_used -= n;
+  while ( n -- > 0 ) {
+    tm_assert_test(bitset_get(a->in_use, i));
+    bitset_clr(a->in_use, i);
+    ++ i;
+  }
+
+  /*! Return the tm_arena to the OS if it is empty, */
+  if ( ! a->n_used ) {
+    tm_list_remove(a);
+    -- tm.arenas_n;
+    bitset_clr(tm.arena_map, tm_arena_index(a));
+
+    tm_msg("A ad %p #%d\n", (void*) a, tm.arenas_n);
+
+    _tm_os_free(a, tm_arena_SIZE);
+  } else {
+    /*! Or release the pages of the tm_blocks. */
+    madvise(ptr, size, MADV_DONTNEED);
+  }
+
+  return 1;
+}
+
+#endif /* tm_USE_ARENA */
+
 /*@}*/
 
 /**************************************************/
@@ -219,72 +541,56 @@ void *_tm_os_alloc_aligned(size_t size)
 
   tm_assert(tm_ptr_is_aligned_to_block(size));
 
-  ptr = _tm_os_alloc(size);
+#if tm_USE_ARENA
+  /*! Carve from a tm_arena, if size fits in one. */
+  if ( (ptr = _tm_arena_alloc(size)) )
+    return ptr;
+#endif
+
+  /*! Pages committed in a reserved heap address range are already aligned; see _tm_heap_commit(). */
+  if ( tm.heap_base )
+    return _tm_os_alloc(size);
+
+  /*! Allocate one extra tm_block of room, so ptr can be aligned without allocating again. */
+  ptr = _tm_os_alloc(size + tm_block_SIZE);
 
   /*! Return 0 if OS could not allocate a buffer. */
   if ( ! ptr )
     return 0;
 
   /**
-   * Check alignment:
+   * Align:
+   *
+   * Return the unaligned head and the unused tail back to the OS.
+   *
+   * <pre>
    *
-   * If pointer to OS block is not aligned to tm_block_SIZE,
+   * |<--- tm_BLOCK_SIZE --->|<--- size ... --->|<--- tm_BLOCK_SIZE -->|
+   * +---------------------------------------------------------------...
+   * |<--- offset --->|<-hd->|<--- size ... --->|<-- tl -->|
+   * +---------------------------------------------------------------...
+   *                  ^      ^                  
+   *                  |      |                 
+   *                  ptr    aligned ptr
+   *
+   * </pre>
    */
-  if ( ! tm_ptr_is_aligned_to_block(ptr) ) {
+  {
     size_t offset = ((tm_ptr_word) ptr) % tm_block_SIZE;
-    size_t left_over = tm_block_SIZE - offset;
-    size_t new_size = size + left_over;
-
-    /**
-     *
-     * Compute a new size to allow for alignment.
-     *
-     * <pre>
-     *
-     * |<--- tm_BLOCK_SIZE --->|<--- tm_BLOCK_SIZE -->|
-     * +----------------------------------------------...
-     * |<--- offset --->|<--- size      --->|
-     * |                |<-lo->|<--- sh --->|
-     * +----------------------------------------------...
-     *                  ^      ^
-     *                  |      |
-     *                  ptr    nb
-     *
-     * </pre>
-     *
-     */
-    tm_msg("A al %p[%lu] %lu %ld\n", (void *) ptr, (unsigned long) size, (unsigned long) tm_block_SIZE, (long) offset);
-
-    // THREAD-RACE on mmap()? {{{
-
-    /*! Give the block back to the OS. */
-    _tm_os_free(ptr, size);
-
-    /*! Try again with more room for realignment. */
-    ptr = _tm_os_alloc(new_size);
-
-    // THREAD-RACE on mmap()? }}}
-
-    /*! Return 0 if OS would not allocate a bigger buffer. */
-    if ( ! ptr )
-      return 0;
-
-    /*! Realign to tm_block_SIZE. */
-    offset = ((unsigned long) ptr) % tm_block_SIZE;
-
-    tm_msg("A alr %p[%lu] %ld\n", (void *) ptr, (unsigned long) new_size, (long) offset);
-
-    if ( offset ) {
-      left_over = tm_block_SIZE - offset;
-      
-      ptr += left_over;
-      new_size -= left_over;
-
-      /*! Assert that alignment is correct. */
-      tm_assert(size == new_size);
-      tm_assert(tm_ptr_is_aligned_to_block(ptr));
-      tm_assert(tm_ptr_is_aligned_to_block(new_size));
+    size_t head = offset ? tm_block_SIZE - offset : 0;
+    size_t tail = tm_block_SIZE - head;
+
+    if ( head ) {
+      tm_msg("A al %p[%lu] %lu %ld\n", (void *) ptr, (unsigned long) size, (unsigned long) tm_block_SIZE, (long) offset);
+      _tm_os_free(ptr, head);
+      ptr = (char*) ptr + head;
     }
+    if ( tail ) {
+      _tm_os_free((char*) ptr + size, tail);
+    }
+
+    /*! Assert that alignment is correct. */
+    tm_assert(tm_ptr_is_aligned_to_block(ptr));
   }
 
   /*! Return aligned ptr. */
@@ -300,6 +606,14 @@ void _tm_os_free_aligned(void *ptr, size_t size)
   tm_assert_test(tm_ptr_is_aligned_to_block(ptr));
   tm_assert_test(tm_ptr_is_aligned_to_block(size));
  
+#if tm_USE_ARENA
+  /*! Return to its tm_arena, if it was carved from one. */
+  if ( _tm_arena_free(ptr, size) ) {
+    _tm_page_mark_unused_range(ptr, size);
+    return;
+  }
+#endif
+
   _tm_os_free(ptr, size);
 }
 
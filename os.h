@@ -14,6 +14,47 @@
 #define tm_USE_SBRK 0
 #endif
 
+#ifndef tm_USE_ARENA
+/*! If true, carve tm_blocks from huge page arenas.  Requires tm_USE_MMAP. */
+#define tm_USE_ARENA tm_USE_MMAP
+#endif
+
+#if ! tm_USE_MMAP
+#undef tm_USE_ARENA
+#define tm_USE_ARENA 0
+#endif
+
+/**
+ * An arena allocated from the OS.
+ *
+ * Arenas are tm_arena_SIZE bytes and aligned to tm_arena_SIZE,
+ * so the OS can back each arena with a single huge page.
+ * tm_blocks are carved from arenas.
+ *
+ * The arena header occupies the first tm_block of the arena.
+ *
+ * tm.arenas lists arenas with free tm_blocks before full arenas.
+ */
+typedef struct tm_arena {
+  /*! tm.arenas list. */
+  tm_list list;
+
+  /*! Number of tm_blocks carved from the arena. */
+  size_t n_used;
+
+  /*! A bit map of carved tm_blocks, indexed by tm_block offset in the arena. */
+  bitset_t in_use[bitset_ELEM_LEN(tm_arena_BLOCKS)];
+} tm_arena;
+
+/*! The index of the tm_arena containing address X into tm.arena_map. */
+#define tm_arena_index(X) (((tm_ptr_word) (X)) / tm_arena_SIZE)
+
+/*! True if the tm_arena has no free tm_blocks. */
+#define tm_arena_full(a) ((a)->n_used + 1 == tm_arena_BLOCKS)
+
+#if tm_USE_MMAP
+int _tm_os_reserve(size_t size);
+#endif
 void *_tm_os_alloc_aligned(size_t size);
 void _tm_os_free_aligned(void *ptr, size_t size);
 
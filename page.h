@@ -18,8 +18,11 @@
 /***************************************************************************/
 
 
-/*! Returns the index of a ptr into page-orientated bit map */ 
-#define tm_page_index(X) (((tm_ptr_word) X) / tm_page_SIZE)
+/*! True if ptr is in the heap address range.  One compare: ptrs below tm.heap_base wrap around. */
+#define tm_ptr_in_heap(X) (((tm_ptr_word) (X)) - (tm_ptr_word) tm.heap_base < tm.heap_size)
+
+/*! Returns the index of a ptr into page-orientated bit map, relative to the heap address range. */ 
+#define tm_page_index(X) ((((tm_ptr_word) (X)) - (tm_ptr_word) tm.heap_base) / tm_page_SIZE)
 
 
 /**
@@ -29,7 +32,7 @@ static __inline
 int _tm_page_in_use(void *ptr)
 {
   size_t i = tm_page_index(ptr);
-  return bitset_get(tm.page_in_use, i);
+  return tm_ptr_in_heap(ptr) && bitset_get(tm.page_in_use, i);
 }
 
 /**
@@ -106,8 +106,13 @@ tm_block *tm_ptr_to_block(char *p)
 static __inline 
 tm_node *tm_pure_ptr_to_node(void *_p)
 {
+#if tm_node_SIDE_TABLE
+  tm_block *b = tm_ptr_to_block(_p);
+  return tm_block_node_at(b, _p);
+#else
   // return (tm_node*) (((char*) _p) - tm_node_HDR_SIZE);
   return ((tm_node*) _p) - 1;
+#endif
 }
 
 
@@ -115,11 +120,18 @@ tm_node *tm_pure_ptr_to_node(void *_p)
  * Returns the data pointer of a tm_node.
  *
  * Adds the tm_node header size to the tm_node address.
+ * If tm_node_SIDE_TABLE is true, scales the tm_node's index in its tm_block's side table.
  */
 static __inline 
 void *tm_node_to_ptr(tm_node *n)
 {
+#if tm_node_SIDE_TABLE
+  /*! The side table is in the first tm_block_SIZE of its tm_block. */
+  tm_block *b = (tm_block*) ((tm_ptr_word) n & tm_block_SIZE_MASK);
+  return tm_block_node_data(b, n);
+#else
   return (void*) (n + 1);
+#endif
 }
 
 
@@ -129,7 +141,11 @@ void *tm_node_to_ptr(tm_node *n)
 static __inline 
 tm_block *tm_node_to_block(tm_node *n)
 {
+#if tm_node_SIDE_TABLE
+  return (tm_block*) ((tm_ptr_word) n & tm_block_SIZE_MASK);
+#else
   return tm_ptr_to_block(tm_node_to_ptr(n));
+#endif
 }
 
 
@@ -160,15 +176,13 @@ tm_node *tm_ptr_to_node(void *p)
   }
 #endif
 
-#if 1
-  /*! Avoid pointers into pages not marked in use. */
-  if ( ! _tm_page_in_use(p) ) 
+  /*! Avoid pointers outside the heap address range. */
+  if ( ! tm_ptr_in_heap(p) )
     return 0;
-#else
-  /*! Avoid out of range pointers. */
-  if ( ! (tm_ptr_l <= p && p <= tm_ptr_h) )
+
+  /*! Avoid pointers into pages not marked in use. */
+  if ( ! bitset_get(tm.page_in_use, tm_page_index(p)) ) 
     return 0;
-#endif
 
   /*! Get the block and type. */
   b = tm_ptr_to_block(p);
@@ -195,7 +209,7 @@ tm_node *tm_ptr_to_node(void *p)
     /*
     ** Translate away the block header.
     */
-    pp -= (tm_ptr_word) b + tm_block_HDR_SIZE;
+    pp -= (tm_ptr_word) tm_block_node_begin(b);
 
 
     {
@@ -223,7 +237,7 @@ tm_node *tm_ptr_to_node(void *p)
 #if tm_ptr_AT_END_IS_VALID
       if ( node_off == 0 && pp ) {
 	pp -= node_size;
-	pp += (tm_ptr_word) b + tm_block_HDR_SIZE;
+	pp += (tm_ptr_word) tm_block_node_begin(b);
 
 #if 0	
  	tm_msg("P nb p%p p0%p\n", (void*) p, (void*) pp);
@@ -272,12 +286,12 @@ tm_node *tm_ptr_to_node(void *p)
 	/**
 	 * Translate back to block header.
 	 */
-	pp += (tm_ptr_word) b + tm_block_HDR_SIZE;
+	pp += (tm_ptr_word) tm_block_node_begin(b);
       }
     }
 
     /*! It's a node. */
-    n = (tm_node*) pp;
+    n = tm_block_node_at(b, pp);
 
     /*! Avoid references to free nodes. */
     if ( tm_node_color(n) == WHITE )
@@ -295,7 +309,7 @@ tm_node *tm_ptr_to_node(void *p)
 static __inline
 tm_type *tm_node_to_type(tm_node *n)
 {
-  tm_block *b = tm_ptr_to_block((char*) n);
+  tm_block *b = tm_node_to_block(n);
   _tm_block_validate(b);
   return b->type;
 }
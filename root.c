@@ -1,55 +1,17 @@
 /** \file root.c
  * \brief Root Sets
  */
+#ifdef __linux__
+#define _GNU_SOURCE /* dl_iterate_phdr() */
+#include <link.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "internal.h"
 
 /****************************************************************************/
 
-/**
- * Add a single root set.
- */
-static 
-int _tm_root_add_1(tm_root *a)
-{
-  int i;
-#define MAX_ROOTS (sizeof(tm.roots)/sizeof(tm.roots[0]))
-
-  if ( a->l >= a->h )
-    return -1;
-
-  /* Scan for empty slot. */
-  for ( i = 0; i < MAX_ROOTS; ++ i ) {
-    if ( tm.roots[i].name == 0 || tm.roots[i].l == tm.roots[i].h ) {
-      break;
-    }
-  }
-
-  if ( tm.nroots <= i ) {
-    tm.nroots = i + 1;
-  }
-
-  tm_assert_test(i < MAX_ROOTS);
-  tm_assert_test(i >= tm.root_datai);
-
-  if ( tm.root_newi == -1 ) {
-    tm.root_newi = i;
-  }
-
-  tm.roots[i] = *a;
-
-  tm_msg("R a [%p,%p] %p(%p) %s %d\n", 
-	 tm.roots[i].l, 
-	 tm.roots[i].h,
-	 tm.roots[i].callback,
-	 tm.roots[i].callback_data,
-	 tm.roots[i].name,
-	 i);
-
-  return i;
-}
-#undef MAX_ROOTS
-
-
 /**
  * Subtract b from a, returning result in c.
  *
@@ -167,41 +129,376 @@ int tm_root_subtract(tm_root *a, tm_root *b, tm_root *c)
 }
 
 
+/****************************************************************************/
+/*! \defgroup root_set_index Root Set: Index */
+/*@{*/
+
 /**
- * Add a root set, while splitting it by anti-roots.
+ * Initialize a root set.
  */
-static 
-void _tm_root_add(tm_root *a)
+void _tm_root_set_init(tm_root_set *s)
+{
+  s->r = 0;
+  s->n = s->max = 0;
+  s->size = 0;
+
+  s->cards = 0;
+  s->cards_n = s->cards_size = 0;
+  s->cards_valid = 0;
+  s->cards_dirty = 0;
+}
+
+
+/**
+ * Make sure root set s can hold n roots.
+ *
+ * Root sets are allocated from the OS, outside of any root.
+ *
+ * Returns 0 if the root set could not be grown.
+ */
+static
+int _tm_root_set_reserve(tm_root_set *s, int n)
+{
+  if ( n > s->max ) {
+    size_t new_size = (size_t) n * 2 * sizeof(s->r[0]);
+    tm_root *r;
+
+    new_size += tm_block_SIZE - new_size % tm_block_SIZE;
+    if ( ! (r = _tm_os_alloc_aligned(new_size)) )
+      return 0;
+
+    if ( s->r ) {
+      memcpy(r, s->r, s->n * sizeof(s->r[0]));
+      _tm_os_free_aligned(s->r, s->size);
+    }
+
+    s->r = r;
+    s->size = new_size;
+    s->max = new_size / sizeof(s->r[0]);
+  }
+
+  return 1;
+}
+
+
+/**
+ * Returns the index of the first root in s whose high address is above ptr,
+ * or s->n if there is none.
+ *
+ * Since the roots in s do not overlap,
+ * they are sorted by both low and high addresses.
+ */
+int _tm_root_set_search(const tm_root_set *s, const void *ptr)
+{
+  int lo = 0, hi = s->n;
+
+  while ( lo < hi ) {
+    int mid = lo + (hi - lo) / 2;
+
+    if ( s->r[mid].h <= ptr ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+
+/**
+ * Returns the index of the root in s containing ptr, or -1.
+ */
+static
+int _tm_root_set_find(const tm_root_set *s, const void *ptr)
+{
+  int i = _tm_root_set_search(s, ptr);
+
+  return i < s->n && s->r[i].l <= ptr ? i : -1;
+}
+
+
+/**
+ * Insert root a into s, merging it with the roots it overlaps.
+ *
+ * Returns the index of the root, or -1.
+ */
+static
+int _tm_root_set_insert(tm_root_set *s, const tm_root *a)
+{
+  int i, j;
+
+  if ( a->l >= a->h )
+    return -1;
+
+  /*! A new root must be scanned before the next flip. */
+  s->cards_valid = 0;
+  ++ s->cards_dirty;
+
+  /*! Find the roots [i, j) a overlaps. */
+  i = _tm_root_set_search(s, a->l);
+  j = _tm_root_set_search(s, a->h);
+  if ( j < s->n && s->r[j].l < a->h )
+    ++ j;
+
+  /*! Merge them into r[i]. */
+  if ( i < j ) {
+    if ( a->l < s->r[i].l )
+      s->r[i].l = a->l;
+    s->r[i].h = s->r[j - 1].h > a->h ? s->r[j - 1].h : a->h;
+
+    memmove(&s->r[i + 1], &s->r[j], (s->n - j) * sizeof(s->r[0]));
+    s->n -= j - i - 1;
+
+    return i;
+  }
+
+  /*! Otherwise, insert a before r[i]. */
+  if ( ! _tm_root_set_reserve(s, s->n + 1) ) {
+    tm_msg("R WARNING: cannot grow root set for %s\n", a->name);
+    return -1;
+  }
+
+  memmove(&s->r[i + 1], &s->r[i], (s->n - i) * sizeof(s->r[0]));
+  s->r[i] = *a;
+  ++ s->n;
+
+  return i;
+}
+
+
+/**
+ * Remove addresses [l, h) from the roots in s.
+ *
+ * Roots are clipped, split or deleted.
+ */
+static
+void _tm_root_set_subtract(tm_root_set *s, const void *l, const void *h)
+{
+  int i, j;
+
+  i = _tm_root_set_search(s, l);
+  if ( i >= s->n || s->r[i].l >= h )
+    return;
+
+  s->cards_valid = 0;
+
+  /*! Split a root containing [l, h). */
+  if ( s->r[i].l < l && h < s->r[i].h ) {
+    tm_root c = s->r[i];
+
+    c.l = h;
+    s->r[i].h = l;
+
+    if ( ! _tm_root_set_reserve(s, s->n + 1) ) {
+      tm_msg("R WARNING: cannot grow root set for %s\n", c.name);
+      tm_abort();
+    }
+
+    memmove(&s->r[i + 2], &s->r[i + 1], (s->n - i - 1) * sizeof(s->r[0]));
+    s->r[i + 1] = c;
+    ++ s->n;
+
+    return;
+  }
+
+  /*! Clip the high end of a root below l. */
+  if ( s->r[i].l < l ) {
+    s->r[i].h = l;
+    ++ i;
+  }
+
+  /*! Delete the roots within [l, h): those before the first root whose high address is above h. */
+  j = _tm_root_set_search(s, h);
+
+  /*! Clip the low end of a root above h. */
+  if ( j < s->n && s->r[j].l < h )
+    s->r[j].l = h;
+
+  if ( i < j ) {
+    memmove(&s->r[i], &s->r[j], (s->n - j) * sizeof(s->r[0]));
+    s->n -= j - i;
+  }
+}
+
+
+/**
+ * Clear the card table of root set s.
+ *
+ * Called when the roots in s are scanned, after a flip.
+ * The card table is rebuilt if roots were added or removed.
+ */
+void _tm_root_set_cards_clear(tm_root_set *s)
+{
+  if ( ! s->cards_valid ) {
+    size_t n = 0;
+    int i;
+
+    /*! Assign each root a range of cards. */
+    for ( i = 0; i < s->n; ++ i ) {
+      s->r[i].card = n;
+      n += tm_root_card((const char*) s->r[i].h - 1) - tm_root_card(s->r[i].l) + 1;
+    }
+
+    if ( n > s->cards_size ) {
+      size_t new_size = n * 2;
+      unsigned char *cards;
+
+      new_size += tm_block_SIZE - new_size % tm_block_SIZE;
+      if ( ! (cards = _tm_os_alloc_aligned(new_size)) ) {
+	/*! If the card table cannot be grown, any root mutation rescans all roots. */
+	tm_msg("R WARNING: cannot grow card table\n");
+	s->cards_dirty = 0;
+	return;
+      }
+
+      if ( s->cards ) {
+	_tm_os_free_aligned(s->cards, s->cards_size);
+      }
+
+      s->cards = cards;
+      s->cards_size = new_size;
+    }
+
+    s->cards_n = n;
+    s->cards_valid = 1;
+  }
+
+  if ( s->cards_n ) 
+    memset(s->cards, 0, s->cards_n);
+  s->cards_dirty = 0;
+}
+
+
+/**
+ * Mark the card for ptr dirty, if ptr is in root set s.
+ *
+ * Returns true if ptr is in s.
+ */
+static
+int _tm_root_set_card_mark(tm_root_set *s, const void *ptr)
+{
+  int i = _tm_root_set_find(s, ptr);
+
+  if ( i < 0 )
+    return 0;
+
+  if ( s->cards_valid ) {
+    s->cards[s->r[i].card + tm_root_card(ptr) - tm_root_card(s->r[i].l)] = 1;
+  }
+  ++ s->cards_dirty;
+
+  return 1;
+}
+
+
+/**
+ * Mark the root card containing ptr dirty.
+ *
+ * Called by root write barriers.
+ */
+void _tm_root_card_mark(const void *ptr)
+{
+  if ( ! _tm_root_set_card_mark(&tm.roots, ptr) )
+    _tm_root_set_card_mark(&tm.dl_roots, ptr);
+}
+
+
+/**
+ * Rescan the dirty cards of root set s, and clear them.
+ *
+ * Consecutive dirty cards are scanned as one range.
+ * If the cards are not valid, because roots were added or removed
+ * since they were cleared, all roots in s are rescanned.
+ */
+void _tm_root_set_scan_dirty(tm_root_set *s)
 {
   int i;
-  tm_root c[2];
-
-  /* Scan anti-roots for possible splitting */
-  for ( i = 0; i < tm.naroots; ++ i ) {
-    switch ( tm_root_subtract(a, &tm.aroots[i], c) ) {
-    case -1: /* deleted */
-      return;
-      break;
-      
-    case 0: /* OK */
-      break;
-      
-    case 1: /* clipped */
-      *a = c[0];
-      break;
-      
-    case 2: /* split */
-      _tm_root_add(&c[0]);
-      *a = c[1];
-      break;
+
+  if ( ! s->cards_dirty )
+    return;
+
+  for ( i = 0; i < s->n; ++ i ) {
+    tm_root *r = &s->r[i];
+
+    if ( s->cards_valid ) {
+      unsigned char *c = s->cards + r->card;
+      size_t card_l = tm_root_card(r->l);
+      size_t n = tm_root_card((const char*) r->h - 1) - card_l + 1;
+      size_t k = 0;
+
+      while ( k < n ) {
+	unsigned char *d = memchr(c + k, 1, n - k);
+	const char *l, *h;
+	size_t e;
+
+	if ( ! d )
+	  break;
+
+	k = d - c;
+	for ( e = k; e < n && c[e]; ++ e ) {
+	  c[e] = 0;
+	}
+
+	l = (const char*) ((card_l + k) * tm_root_CARD_SIZE);
+	h = (const char*) ((card_l + e) * tm_root_CARD_SIZE);
+	if ( l < (const char*) r->l )
+	  l = r->l;
+	if ( h > (const char*) r->h )
+	  h = r->h;
+
+	tm_msg("r c [%p,%p] %s\n", l, h, r->name);
+	_tm_range_scan(l, h);
+
+	k = e;
+      }
+    } else {
+      tm_msg("r C [%p,%p] %s\n", r->l, r->h, r->name);
+      _tm_range_scan(r->l, r->h);
     }
   }
 
-  _tm_root_add_1(a);
+  s->cards_dirty = 0;
+}
+
+
+/**
+ * Add a root to s, while splitting it by anti-roots.
+ *
+ * Returns the index of the last part of the root added,
+ * or -1 if it is entirely within anti-roots.
+ */
+static
+int _tm_root_set_add(tm_root_set *s, const tm_root *a)
+{
+  tm_root c = *a;
+  int i, result = -1, r;
+
+  for ( i = _tm_root_set_search(&tm.aroots, a->l); i < tm.aroots.n && tm.aroots.r[i].l < a->h; ++ i ) {
+    c.h = tm.aroots.r[i].l;
+    if ( (r = _tm_root_set_insert(s, &c)) >= 0 )
+      result = r;
+    c.l = tm.aroots.r[i].h;
+  }
+
+  c.h = a->h;
+  if ( (r = _tm_root_set_insert(s, &c)) >= 0 )
+    result = r;
+
+  return result;
 }
 
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup root_set_api Root Set: API */
+/*@{*/
+
 /**
  * API: Add a root set.
+ *
+ * Returns the index of the root in the data root set, or -1.
  */
 int tm_root_add(const char *name, const void *l, const void *h)
 {
@@ -211,65 +508,67 @@ int tm_root_add(const char *name, const void *l, const void *h)
   a.l = l;
   a.h = h;
   a.callback = 0;
+  a.callback_data = 0;
 
-  tm.root_newi = -1;
+  if ( a.l > a.h ) {
+    a.l = h; a.h = l;
+  }
 
   tm_msg("R A [%p,%p] %s PRE\n", 
 	 a.l, 
 	 a.h,
 	 a.name);
 
-  _tm_root_add(&a);
-
-  return tm.root_newi;
+  return _tm_root_set_add(&tm.roots, &a);
 }
 
 
 /**
  * API: Add a root callback.
+ *
+ * callback(callback_data) is called whenever roots are scanned.
  */
 int tm_root_add_callback(const char *name, void (*callback)(void*), void *callback_data)
 {
-  tm_root a;
-
-  a.name = name;
-  a.l = a.h = 0;
-  a.callback = callback;
-  a.callback_data = callback_data;
+  tm_root_set *s = &tm.root_callbacks;
+  tm_root *r;
 
-  tm.root_newi = -1;
+  if ( ! _tm_root_set_reserve(s, s->n + 1) ) 
+    return -1;
 
-  tm_msg("R A %p(%p) %s PRE\n", 
-	 a.callback,
-	 a.callback_data,
-	 a.name);
+  r = &s->r[s->n];
+  r->name = name;
+  r->l = r->h = 0;
+  r->callback = callback;
+  r->callback_data = callback_data;
 
-  _tm_root_add(&a);
+  tm_msg("R a %p(%p) %s %d\n", 
+	 r->callback,
+	 r->callback_data,
+	 r->name,
+	 s->n);
 
-  return tm.root_newi;
+  return s->n ++;
 }
 
 
 /**
- * API: Add a root set.
+ * API: Remove a root callback, by name or by callback and callback_data.
  *
  * Returns true if a root was removed.
  */
 int tm_root_remove_callback(const char *name, void (*callback)(void*), void *callback_data)
 {
+  tm_root_set *s = &tm.root_callbacks;
   int i;
-  for ( i = 0; i < tm.root_newi; ++ i ) {
-    tm_root *r = &tm.roots[i];
+
+  for ( i = 0; i < s->n; ++ i ) {
+    tm_root *r = &s->r[i];
     if ( (name && strcmp(name, r->name) == 0) ||
 	 (callback && callback == r->callback && callback_data == r->callback_data) ) {
-      -- tm.root_newi;
-      while ( i < tm.root_newi ) {
-	r[0] = r[1];
-	++ r;
-	++ i;
-      }
+      memmove(r, r + 1, (s->n - i - 1) * sizeof(*r));
+      -- s->n;
       return 1;
-      break;
     }
   }
 
@@ -277,68 +576,429 @@ int tm_root_remove_callback(const char *name, void (*callback)(void*), void *cal
 }
 
 
+/**
+ * API: Remove a root set: add an anti-root.
+ *
+ * Addresses within anti-roots are never scanned,
+ * even if they are added as roots later.
+ */
 void tm_root_remove(const char * name, const void *l, const void *h)
 {
-  int i;
-  tm_root *a, *b, c[2];
+  tm_root b;
 
-  /* Add to anti-roots list. */
-  b = &tm.aroots[i = tm.naroots ++];
-  b->name = name;
-  b->l = l;
-  b->h = h;
+  b.name = name;
+  b.l = l;
+  b.h = h;
+  b.callback = 0;
+  b.callback_data = 0;
+
+  if ( b.l > b.h ) {
+    b.l = h; b.h = l;
+  }
 
   tm_msg("R A [%p,%p] %s ANTI-ROOT %d\n", 
-	 tm.aroots[i].l, 
-	 tm.aroots[i].h,
-	 tm.aroots[i].name,
-	 i);
-
-  /* Adding an anti-root may require splitting existing roots. */
-  /* Do not split tm.root[0], it's the machine register set! */
-
-  for ( i = tm.root_datai; i < tm.nroots; ++ i ) {
-    int j;
-     
-    for ( j = 0; j < tm.naroots; ++ j ) {
-      a = &tm.roots[i];
-      b = &tm.aroots[j];
-      
-      switch ( tm_root_subtract(a, b, c) ) {
-      case -1: /* deleted */
-	a->l = a->h = 0;
-	j = tm.naroots;
+	 b.l, 
+	 b.h,
+	 b.name,
+	 tm.aroots.n);
+
+  /*! Add to anti-roots. */
+  _tm_root_set_insert(&tm.aroots, &b);
+
+  /*! Adding an anti-root may require splitting existing roots. */
+  _tm_root_set_subtract(&tm.roots, b.l, b.h);
+  _tm_root_set_subtract(&tm.dl_roots, b.l, b.h);
+}
+
+
+/**
+ * Returns true if a pointer is in any root set.
+ */
+int tm_ptr_is_in_root_set(const void *ptr)
+{
+  int i;
+
+  if ( tm.root_register.l <= ptr && ptr < tm.root_register.h ) 
+    return 1;
+
+  if ( tm.root_stack.l <= ptr && ptr < tm.root_stack.h ) 
+    return 2;
+
+  if ( (i = _tm_root_set_find(&tm.roots, ptr)) >= 0 ) 
+    return i + 3;
+
+  if ( (i = _tm_root_set_find(&tm.dl_roots, ptr)) >= 0 ) 
+    return tm.roots.n + i + 3;
+
+  return 0;
+}
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup root_set_dl Root Set: Shared Libraries */
+/*@{*/
+
+#ifdef __linux__
+
+/**
+ * Add a shared library root, while splitting it by anti-roots.
+ */
+static
+int _tm_root_dl_add(tm_root *a)
+{
+  tm_msg("R a [%p,%p] %s DL\n", a->l, a->h, a->name);
+
+  return _tm_root_set_add(&tm.dl_roots, a);
+}
+
+
+/**
+ * dl_iterate_phdr() callback: add the roots of a loaded object.
+ *
+ * - Writable PT_LOAD segments, except PT_GNU_RELRO,
+ *   which is read-only after relocation.
+ * - The calling thread's PT_TLS block.
+ * .
+ *
+ * The main program's data segments are already roots; see tm_init().
+ */
+static
+int _tm_root_dl_phdr(struct dl_phdr_info *info, size_t size, void *data)
+{
+  int *mainp = data;
+  tm_root a, relro, c[2];
+  int i;
+
+  a.name = info->dlpi_name && info->dlpi_name[0] ? info->dlpi_name : "main program";
+  a.callback = 0;
+  a.callback_data = 0;
+  relro.l = relro.h = 0;
+
+  for ( i = 0; i < info->dlpi_phnum; ++ i ) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+    if ( ph->p_type == PT_GNU_RELRO ) {
+      relro.l = (const char*) info->dlpi_addr + ph->p_vaddr;
+      relro.h = (const char*) relro.l + ph->p_memsz;
+    }
+  }
+
+  for ( i = 0; i < info->dlpi_phnum; ++ i ) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+    if ( ph->p_type == PT_LOAD && (ph->p_flags & PF_W) && ! *mainp ) {
+      a.l = (const char*) info->dlpi_addr + ph->p_vaddr;
+      a.h = (const char*) a.l + ph->p_memsz;
+
+      switch ( tm_root_subtract(&a, &relro, c) ) {
+      case -1:
+	continue;
+      case 0:
 	break;
-	
-      case 1: /* clipped */
-	*a = *c;
+      case 1:
+	a = c[0];
 	break;
-	
-      case 2: /* split */
-	*a = *c;
-	_tm_root_add(&c[1]);
-	i = 1; j = -1; /* restart */
+      case 2:
+	_tm_root_dl_add(&c[0]);
+	a = c[1];
 	break;
       }
+
+      _tm_root_dl_add(&a);
+    }
+
+    if ( ph->p_type == PT_TLS && 
+	 size >= offsetof(struct dl_phdr_info, dlpi_tls_data) + sizeof(info->dlpi_tls_data) &&
+	 info->dlpi_tls_data ) {
+      a.l = info->dlpi_tls_data;
+      a.h = (const char*) a.l + ph->p_memsz;
+
+      _tm_root_dl_add(&a);
     }
   }
+
+  /* The first object is the main program. */
+  *mainp = 0;
+
+  return 0;
 }
 
 
 /**
- * Returns true if a pointer is in any root set.
+ * dl_iterate_phdr() callback: get the counts of loaded and unloaded objects.
  */
-int tm_ptr_is_in_root_set(const void *ptr)
+static
+int _tm_root_dl_counts(struct dl_phdr_info *info, size_t size, void *data)
+{
+  unsigned long long *counts = data;
+
+  if ( size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs) ) {
+    counts[0] = info->dlpi_adds;
+    counts[1] = info->dlpi_subs;
+  } else {
+    counts[0] = counts[1] = ~ 0ULL;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Rebuild the shared library roots, if any shared library was loaded or unloaded since they were built.
+ *
+ * Thread-local storage of a dlopen()ed library that is allocated lazily
+ * is found at the next dlopen() or dlclose().
+ */
+static
+void _tm_root_dl_update()
+{
+  unsigned long long counts[2];
+
+  dl_iterate_phdr(_tm_root_dl_counts, counts);
+
+  if ( ! tm.dl_roots_valid || counts[0] != tm.dl_adds || counts[1] != tm.dl_subs || counts[0] == ~ 0ULL ) {
+    int main_program = 1;
+
+    tm_msg("R dl %llu %llu\n", counts[0], counts[1]);
+
+    tm.dl_roots.n = 0;
+    dl_iterate_phdr(_tm_root_dl_phdr, &main_program);
+
+    tm.dl_adds = counts[0];
+    tm.dl_subs = counts[1];
+    tm.dl_roots_valid = 1;
+  }
+}
+
+
+/**
+ * Root callback: scan the shared library roots.
+ */
+static
+void _tm_root_dl_scan(void *data)
 {
   int i;
 
-  for ( i = 0; i < tm.nroots; ++ i ) {
-    if ( tm.roots[i].l <= ptr && ptr < tm.roots[i].h ) {
-      return i + 1;
+  _tm_root_dl_update();
+  _tm_root_set_cards_clear(&tm.dl_roots);
+
+  for ( i = 0; i < tm.dl_roots.n; ++ i ) {
+    _tm_range_scan(tm.dl_roots.r[i].l, tm.dl_roots.r[i].h);
+  }
+}
+
+
+/**
+ * Add the writable data segments and thread-local storage
+ * of all loaded objects as roots.
+ *
+ * Objects loaded by dlopen() or unloaded by dlclose() are tracked
+ * each time roots are scanned.
+ */
+int _tm_root_dl_init()
+{
+  tm.dl_roots_valid = 0;
+  _tm_root_dl_update();
+
+  return tm_root_add_callback("shared libraries", _tm_root_dl_scan, 0);
+}
+
+#else
+
+int _tm_root_dl_init()
+{
+  return -1;
+}
+
+#endif
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup root_set_soft_dirty Root Set: Soft-Dirty Pages */
+/*@{*/
+
+#ifdef __linux__
+
+/*! The soft-dirty bit of a /proc/self/pagemap entry. */
+#define tm_root_PAGEMAP_SOFT_DIRTY (1ULL << 55)
+
+/*! The number of /proc/self/pagemap entries read at once. */
+#define tm_root_PAGEMAP_BUF_N 512
+
+
+/**
+ * Clear the soft-dirty bits of all pages.
+ *
+ * Called before the roots are scanned, after a flip.
+ * If the bits cannot be cleared, all roots are rescanned at the end of marking.
+ */
+void _tm_root_soft_dirty_clear()
+{
+  int fd;
+
+  tm.root_soft_dirty_valid = 0;
+
+  if ( (fd = open("/proc/self/clear_refs", O_WRONLY)) < 0 )
+    return;
+  if ( write(fd, "4", 1) == 1 )
+    tm.root_soft_dirty_valid = 1;
+  close(fd);
+}
+
+
+/**
+ * Mark the cards of root set s dirty on pages written since _tm_root_soft_dirty_clear().
+ *
+ * Returns 0 if /proc/self/pagemap could not be read.
+ */
+static
+int _tm_root_set_soft_dirty(tm_root_set *s)
+{
+  unsigned long long buf[tm_root_PAGEMAP_BUF_N];
+  size_t page_size = tm.root_os_page_size;
+  int i;
+
+  for ( i = 0; i < s->n; ++ i ) {
+    tm_root *r = &s->r[i];
+    size_t page = (tm_ptr_word) r->l / page_size;
+    size_t page_h = ((tm_ptr_word) r->h + page_size - 1) / page_size;
+
+    while ( page < page_h ) {
+      size_t n = page_h - page;
+      ssize_t bytes;
+      size_t j;
+
+      if ( n > tm_root_PAGEMAP_BUF_N )
+	n = tm_root_PAGEMAP_BUF_N;
+
+      bytes = pread(tm.root_pagemap_fd, buf, n * sizeof(buf[0]), (off_t) page * sizeof(buf[0]));
+      if ( bytes <= 0 )
+	return 0;
+      n = bytes / sizeof(buf[0]);
+
+      for ( j = 0; j < n; ++ j ) {
+	const char *l, *h;
+
+	if ( ! (buf[j] & tm_root_PAGEMAP_SOFT_DIRTY) )
+	  continue;
+
+	/*! Mark the cards of the root within the written page. */
+	l = (const char*) ((page + j) * page_size);
+	h = l + page_size;
+	if ( l < (const char*) r->l )
+	  l = r->l;
+	if ( h > (const char*) r->h )
+	  h = r->h;
+
+	if ( s->cards_valid ) {
+	  memset(s->cards + r->card + tm_root_card(l) - tm_root_card(r->l),
+		 1,
+		 tm_root_card(h - 1) - tm_root_card(l) + 1);
+	}
+	++ s->cards_dirty;
+      }
+
+      page += n;
     }
   }
 
+  return 1;
+}
+
+
+/**
+ * Mark the root cards on pages written since the roots were scanned.
+ *
+ * Called atomically at the end of marking, before _tm_root_set_scan_dirty(),
+ * so roots written without tm_write_barrier_root() are rescanned.
+ */
+void _tm_root_soft_dirty_mark()
+{
+  if ( ! (tm.root_soft_dirty_valid &&
+	  _tm_root_set_soft_dirty(&tm.roots) &&
+	  _tm_root_set_soft_dirty(&tm.dl_roots)) ) {
+    /*! Without soft-dirty bits, rescan all roots. */
+    tm_msg("R WARNING: soft-dirty bits unavailable\n");
+    tm.roots.cards_valid = tm.dl_roots.cards_valid = 0;
+    tm.roots.cards_dirty = tm.dl_roots.cards_dirty = 1;
+  }
+}
+
+
+/**
+ * Track root mutations with soft-dirty page bits; see tm_root_soft_dirty.
+ *
+ * Returns 0 if the kernel does not support soft-dirty bits.
+ */
+int _tm_root_soft_dirty_init()
+{
+  tm.root_os_page_size = sysconf(_SC_PAGESIZE);
+
+  if ( (tm.root_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC)) < 0 )
+    return 0;
+
+  /*! Some kernels accept clear_refs without tracking soft-dirty bits: check that a write is seen. */
+  _tm_root_soft_dirty_clear();
+  if ( tm.root_soft_dirty_valid ) {
+    static volatile int probe;
+    unsigned long long e = 0;
+
+    probe = 1;
+    if ( pread(tm.root_pagemap_fd, &e, sizeof(e), (off_t) ((tm_ptr_word) &probe / tm.root_os_page_size) * sizeof(e)) != sizeof(e) ||
+	 ! (e & tm_root_PAGEMAP_SOFT_DIRTY) )
+      tm.root_soft_dirty_valid = 0;
+  }
+
+  if ( ! tm.root_soft_dirty_valid ) {
+    close(tm.root_pagemap_fd);
+    tm.root_pagemap_fd = -1;
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/**
+ * In the child process after fork(): reopen /proc/self/pagemap,
+ * which still refers to the parent.
+ *
+ * The soft-dirty bits are not trusted until they are next cleared:
+ * all roots are rescanned at the end of marking.
+ */
+void _tm_root_soft_dirty_atfork_child()
+{
+  if ( tm.root_pagemap_fd >= 0 ) {
+    close(tm.root_pagemap_fd);
+    tm.root_pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  }
+  tm.root_soft_dirty_valid = 0;
+}
+
+#else
+
+void _tm_root_soft_dirty_clear()
+{
+}
+
+void _tm_root_soft_dirty_atfork_child()
+{
+}
+
+void _tm_root_soft_dirty_mark()
+{
+}
+
+int _tm_root_soft_dirty_init()
+{
   return 0;
 }
 
+#endif
+
+/*@}*/
 
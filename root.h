@@ -31,9 +31,47 @@ typedef struct tm_root {
 
   /*! Callback data */
   void *callback_data;
+
+  /*! The index of the root's first card in its tm_root_set's cards. */
+  size_t card;
 } tm_root;
 
 
+/**
+ * A growable set of roots.
+ *
+ * Address range roots in a set do not overlap and are sorted by address,
+ * so membership tests, adds and removes are binary searches.
+ */
+typedef struct tm_root_set {
+  /*! The roots. */
+  tm_root *r;
+
+  /*! The number of roots. */
+  int n;
+
+  /*! The number of roots allocated. */
+  int max;
+
+  /*! The size of the allocation, in bytes. */
+  size_t size;
+
+  /*! Card table: one byte per tm_root_CARD_SIZE bytes of each root, non-zero if dirty. */
+  unsigned char *cards;
+  /*! The number of cards. */
+  size_t cards_n;
+  /*! The size of the cards allocation, in bytes. */
+  size_t cards_size;
+  /*! If true, cards match the roots; roots added or removed since invalidate them. */
+  int cards_valid;
+  /*! The number of card marks since the cards were cleared. */
+  unsigned long cards_dirty;
+} tm_root_set;
+
+/*! The card number of address P. */
+#define tm_root_card(P) ((tm_ptr_word) (P) / tm_root_CARD_SIZE)
+
+
 
 int tm_root_add(const char *name, const void *l, const void *h);
 void tm_root_remove(const char * name, const void *l, const void *h);
@@ -43,6 +81,19 @@ int tm_root_remove_callback(const char *name, void (*callback)(void*), void *cal
 
 int tm_ptr_is_in_root_set(const void *ptr);
 
+void _tm_root_set_init(tm_root_set *s);
+int _tm_root_set_search(const tm_root_set *s, const void *ptr);
+void _tm_root_set_cards_clear(tm_root_set *s);
+void _tm_root_set_scan_dirty(tm_root_set *s);
+void _tm_root_card_mark(const void *ptr);
+
+int _tm_root_dl_init();
+
+int _tm_root_soft_dirty_init();
+void _tm_root_soft_dirty_clear();
+void _tm_root_soft_dirty_mark();
+void _tm_root_soft_dirty_atfork_child();
+
 /*@}*/
 
 #endif
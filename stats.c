@@ -1,30 +1,59 @@
 /** \file stats.c
  * \brief Statistics.
  */
-#include <sys/time.h> /* struct timeval */
+#include <time.h> /* clock_gettime() */
 #include "internal.h"
 
 /***************************************************************************/
 
-#ifndef tm_USE_times
-/*! If true, use times() to collect timing statistics. */
-#define tm_USE_times 0
+#ifndef tm_USE_rdtsc
+/*! If true, use the CPU timestamp counter, calibrated by tm_time_stat_init(), to collect timing statistics. */
+#define tm_USE_rdtsc 0
 #endif
 
-#if tm_USE_times
+#if tm_USE_rdtsc && ! (defined(__i386__) || defined(__x86_64__))
+#undef tm_USE_rdtsc
+#define tm_USE_rdtsc 0
+#endif
 
-#include <sys/times.h>
+#if tm_USE_rdtsc
+#include <x86intrin.h> /* __rdtsc() */
+#endif
 
-#else
+#if tm_USE_rdtsc
+/*! Nanoseconds per tm_time_ticks. */
+static double tm_time_ns_per_tick = 1.0;
+#endif
+
+/*! Seconds per nanosecond. */
+#define tm_time_NS 1e-9
 
-#include <sys/time.h>
-#include <unistd.h>
 
-static __inline double tv_2_double(struct timeval *t)
+/**
+ * Read CLOCK_MONOTONIC, in nanoseconds.
+ */
+static __inline
+tm_time_ticks _tm_time_monotonic()
 {
-  return (double) t->tv_sec + (double) t->tv_usec / 1000000.0;
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (tm_time_ticks) t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
+
+
+/**
+ * Read the clock.
+ */
+static __inline
+tm_time_ticks _tm_time_ticks()
+{
+#if tm_USE_rdtsc
+  return __rdtsc();
+#else
+  return _tm_time_monotonic();
 #endif
+}
 
 
 /**
@@ -288,71 +317,108 @@ void tm_print_block_stats()
 void tm_time_stat_print_(tm_time_stat *ts, int flags, size_t *alloc_count_p);
 
 
+/**
+ * Initialize timing stats collection.
+ *
+ * With tm_USE_rdtsc, calibrates the timestamp counter against CLOCK_MONOTONIC.
+ */
+void tm_time_stat_init()
+{
+#if tm_USE_rdtsc
+  struct timespec d = { 0, 10000000 };
+  tm_time_ticks n0, n1, c0, c1;
+
+  n0 = _tm_time_monotonic();
+  c0 = __rdtsc();
+  nanosleep(&d, 0);
+  n1 = _tm_time_monotonic();
+  c1 = __rdtsc();
+
+  if ( c1 > c0 ) {
+    tm_time_ns_per_tick = (double) (n1 - n0) / (double) (c1 - c0);
+  }
+#endif
+}
+
+
 /**
  * Begin timing stats collection.
  */
 void tm_time_stat_begin(tm_time_stat *ts)
 {
-#if tm_USE_times
-  struct tms t0;
-  times(&t0);
-  ts->t0 = (double) t0.tms_utime / (double) CLOCKS_PER_SEC;
-  ts->t01 = (double) t0.tms_stime / (double) CLOCKS_PER_SEC;
-#else
-  struct timeval t0;
-  gettimeofday(&t0, 0);
-  ts->t0 = tv_2_double(&t0);
-#endif
+  ts->t0 = _tm_time_ticks();
 }
 
 
 /**
  * End timing stats collection.
+ *
+ * Cheap enough to leave enabled: one clock read, and no division.
  */
 void tm_time_stat_end(tm_time_stat *ts)
 {
-#if tm_USE_times
-  {
-    struct tms t1;
-    times(&t1);
-    ts->t1 = (double) t1.tms_utime / (double) CLOCKS_PER_SEC;
-    ts->t11 = (double) t1.tms_stime / (double) CLOCKS_PER_SEC;
-  }
-#else
-  {
-    struct timeval t1;
-    gettimeofday(&t1, 0);
-    ts->t1 = tv_2_double(&t1);
-  }
+  tm_time_ticks dt = _tm_time_ticks() - ts->t0;
+
+#if tm_USE_rdtsc
+  dt = (tm_time_ticks) (dt * tm_time_ns_per_tick);
 #endif
 
   ++ ts->count;
 
   /* Compute dt. */
-  ts->td = ts->t1 - ts->t0;
-#if tm_USE_times
-  ts->td += ts->t11 - ts->t01;
-#endif
+  ts->td = dt * tm_time_NS;
 
   /* Compute sum of dt. */
   ts->ts += ts->td;
 
-  /* Compute avg time. */
-  ts->ta = ts->ts / (double) ts->count;
-
   /* Compute worst time. */
   if ( (ts->tw_changed = ts->tw < ts->td) ) {
     ts->tw = ts->td;
   }
 
+  /* Count dt in its bucket. */
+  ++ ts->hist[tm_time_stat_hist_index(dt)];
+
 #if 0
   /* Print stats. */
   tm_time_stat_print_(ts, ts->tw_changed ? 1 : 0, 0);
 #endif
 }
 
+/**
+ * Returns the time, in seconds, below which fraction p of the times fall.
+ *
+ * Interpolates within the histogram bucket; never more than the worst time.
+ */
+double tm_time_stat_percentile(const tm_time_stat *ts, double p)
+{
+  double rank = p * ts->count, n = 0, t;
+  int i;
+
+  if ( ! ts->count )
+    return 0;
+
+  for ( i = 0; i < tm_time_stat_HIST_N - 1; ++ i ) {
+    if ( n + ts->hist[i] >= rank )
+      break;
+    n += ts->hist[i];
+  }
+
+  /* Bucket i covers [tm_time_stat_hist_lower(i), tm_time_stat_hist_lower(i + 1)) nanoseconds. */
+  t = (double) tm_time_stat_hist_lower(i);
+  if ( ts->hist[i] ) {
+    t += (tm_time_stat_hist_lower(i + 1) - t) * (rank - n) / ts->hist[i];
+  }
+  t *= tm_time_NS;
+
+  return t < ts->tw ? t : ts->tw;
+}
+
+
 /**
  * Print timing stats component.
+ *
+ * flags: 1 worst time, 2 count, 4 average time, 8 percentiles.
  */
 void tm_time_stat_print_(tm_time_stat *ts, int flags, size_t *alloc_count_p)
 {
@@ -395,6 +461,7 @@ void tm_time_stat_print_(tm_time_stat *ts, int flags, size_t *alloc_count_p)
   }
 
   if ( flags & 4 ) {
+    ts->ta = ts->count ? ts->ts / (double) ts->count : 0;
     tm_msg1(
 	    " at %.7f"
 	    ,
@@ -402,6 +469,16 @@ void tm_time_stat_print_(tm_time_stat *ts, int flags, size_t *alloc_count_p)
 	    );
   }
 
+  if ( flags & 8 ) {
+    tm_msg1(
+	    " p50 " tv_fmt " p99 " tv_fmt " p999 " tv_fmt
+	    ,
+	    tv_fmt_args(tm_time_stat_percentile(ts, 0.50)),
+	    tv_fmt_args(tm_time_stat_percentile(ts, 0.99)),
+	    tv_fmt_args(tm_time_stat_percentile(ts, 0.999))
+	    );
+  }
+
   if ( alloc_count_p ) {
     tm_msg1(
 	    " A %8lu"
@@ -430,6 +507,7 @@ void tm_print_time_stats()
   tm_time_stat_print_(&tm.ts_alloc, ~0, 0);
   tm_time_stat_print_(&tm.ts_free, ~0, 0);
   tm_time_stat_print_(&tm.ts_gc, ~0, 0);
+  tm_time_stat_print_(&tm.ts_flip, ~0, 0);
   tm_time_stat_print_(&tm.ts_barrier, ~0, 0);
   tm_time_stat_print_(&tm.ts_barrier_pure, ~0, 0);
   tm_time_stat_print_(&tm.ts_barrier_root, ~0, 0);
@@ -449,3 +527,255 @@ void tm_print_time_stats()
 }
 
 
+/**
+ * Print the non-empty buckets of a timing stats histogram.
+ */
+static
+void tm_time_stat_print_hist(tm_time_stat *ts)
+{
+  int i;
+
+  if ( ! ts->count )
+    return;
+
+  tm_msg("H   %-12s c %8lu\n", ts->name, (unsigned long) ts->count);
+  for ( i = 0; i < tm_time_stat_HIST_N; ++ i ) {
+    if ( ts->hist[i] ) {
+      tm_msg("H     >= %12llu ns %10lu\n", tm_time_stat_hist_lower(i), (unsigned long) ts->hist[i]);
+    }
+  }
+}
+
+
+/**
+ * API: Print timing stats histograms.
+ */
+void tm_print_time_histograms()
+{
+  tm_msg_enable("H", 1);
+
+  tm_msg("H {\n");
+
+  tm_time_stat_print_hist(&tm.ts_alloc);
+  tm_time_stat_print_hist(&tm.ts_free);
+  tm_time_stat_print_hist(&tm.ts_gc);
+  tm_time_stat_print_hist(&tm.ts_flip);
+  tm_time_stat_print_hist(&tm.ts_barrier);
+  tm_time_stat_print_hist(&tm.ts_barrier_pure);
+  tm_time_stat_print_hist(&tm.ts_barrier_root);
+  tm_time_stat_print_hist(&tm.ts_barrier_black);
+
+  tm_msg("H }\n");
+
+  tm_msg_enable("H", 0);
+}
+
+
+/***************************************************************************/
+/* Machine-readable stats. */
+
+/**
+ * API: Copy the statistics into s.
+ *
+ * Copies counters only: no tm_block or node is visited,
+ * so it is cheap enough to call periodically.
+ */
+void tm_stats_snapshot(tm_stats *s)
+{
+  tm_type *t;
+  int j;
+
+  _tm_wb_enter();
+
+  s->flip_id = tm.colors.flip_id;
+  s->alloc_since_flip = tm.alloc_since_flip;
+
+  for ( j = 0; j < tm__LAST3; ++ j ) {
+    s->n[j] = tm.n[j <= tm_BLACK ? tm.colors.c[j] : j];
+  }
+  s->n[tm_NU] = s->n[tm_TOTAL] - s->n[tm_WHITE];
+  s->free_blocks = tm.free_blocks_n;
+  memcpy(s->n_color_transitions, tm.n_color_transitions, sizeof(s->n_color_transitions));
+
+  s->types_n = s->types_total = 0;
+  tm_list_LOOP(&tm.types, t) {
+    if ( s->types_n < tm_stats_TYPE_MAX ) {
+      tm_stats_type *st = &s->types[s->types_n ++];
+
+      st->id = t->id;
+      st->size = t->size;
+      for ( j = 0; j < tm__LAST2; ++ j ) {
+	st->n[j] = t->n[j <= tm_BLACK ? tm.colors.c[j] : j];
+      }
+      st->n[tm_NU] = st->n[tm_TOTAL] - st->n[tm_WHITE];
+      st->n[tm_b] = st->n[tm_NU] * t->size;
+      st->n[tm_b_NU] = st->n[tm_NU] ? st->n[tm_b] / st->n[tm_NU] : 0;
+    }
+    ++ s->types_total;
+  }
+  tm_list_LOOP_END;
+
+  s->ts_alloc = tm.ts_alloc;
+  s->ts_free = tm.ts_free;
+  s->ts_gc = tm.ts_gc;
+  s->ts_flip = tm.ts_flip;
+  s->ts_os_alloc = tm.ts_os_alloc;
+  s->ts_os_free = tm.ts_os_free;
+  s->ts_barrier = tm.ts_barrier;
+  s->ts_barrier_pure = tm.ts_barrier_pure;
+  s->ts_barrier_root = tm.ts_barrier_root;
+  s->ts_barrier_black = tm.ts_barrier_black;
+
+  s->wb_faults = tm.wb_faults;
+  s->wb_mprotects = tm.wb_mprotects;
+  s->finalize_queued = tm.finalize_queued;
+  s->finalize_run = tm.finalize_run;
+  s->weak_cleared = tm.weak_cleared;
+
+  _tm_wb_leave();
+}
+
+
+/*! JSON keys for tm_stats.n[]. */
+static const char *tm_stats_n_name[] = {
+  "WHITE", "ECRU", "GREY", "BLACK", "TOTAL",
+  "B", "NU", "b", "b_NU",
+  "B_OS", "b_OS", "B_OS_M", "b_OS_M",
+};
+
+
+/**
+ * JSON output buffer: like snprintf(), counts what does not fit.
+ */
+typedef struct tm_stats_out {
+  char *buf;
+  size_t size;
+  size_t len;
+} tm_stats_out;
+
+
+static
+void tm_stats_printf(tm_stats_out *o, const char *format, ...)
+{
+  va_list vap;
+  int n;
+
+  va_start(vap, format);
+  n = vsnprintf(o->len < o->size ? o->buf + o->len : 0,
+		o->len < o->size ? o->size - o->len : 0,
+		format, vap);
+  va_end(vap);
+
+  if ( n > 0 )
+    o->len += n;
+}
+
+
+static
+void tm_stats_json_n(tm_stats_out *o, const size_t *n, int nn)
+{
+  int j;
+
+  tm_stats_printf(o, "{");
+  for ( j = 0; j < nn; ++ j ) {
+    tm_stats_printf(o, "%s\"%s\":%lu", j ? "," : "", tm_stats_n_name[j], (unsigned long) n[j]);
+  }
+  tm_stats_printf(o, "}");
+}
+
+
+static
+void tm_stats_json_time(tm_stats_out *o, const tm_time_stat *ts, const char *sep)
+{
+  int i, h;
+
+  tm_stats_printf(o, "%s\"%s\":{\"count\":%lu,\"total\":%.9f,\"worst\":%.9f,\"p50\":%.9f,\"p99\":%.9f,\"p999\":%.9f,\"hist\":[",
+		  sep,
+		  ts->name ? ts->name : "",
+		  (unsigned long) ts->count,
+		  ts->ts,
+		  ts->tw,
+		  tm_time_stat_percentile(ts, 0.50),
+		  tm_time_stat_percentile(ts, 0.99),
+		  tm_time_stat_percentile(ts, 0.999));
+
+  /* Trailing empty buckets are omitted. */
+  for ( h = tm_time_stat_HIST_N; h > 0 && ! ts->hist[h - 1]; -- h )
+    ;
+  for ( i = 0; i < h; ++ i ) {
+    tm_stats_printf(o, "%s%lu", i ? "," : "", (unsigned long) ts->hist[i]);
+  }
+
+  tm_stats_printf(o, "]}");
+}
+
+
+/**
+ * API: Write s as a JSON object into buf, of size bytes, with a terminating nul.
+ *
+ * Time histogram bucket i counts times in [tm_time_stat_hist_lower(i), tm_time_stat_hist_lower(i + 1)) nanoseconds;
+ * times are in seconds.
+ *
+ * Returns the length of the JSON object, like snprintf():
+ * if it is not less than size, the object was truncated.
+ */
+size_t tm_stats_json(const tm_stats *s, char *buf, size_t size)
+{
+  tm_stats_out o;
+  int i, j;
+
+  o.buf = buf;
+  o.size = size;
+  o.len = 0;
+
+  tm_stats_printf(&o, "{\"flip_id\":%lu,\"alloc_since_flip\":%lu,\"free_blocks\":%lu,\"n\":",
+		  (unsigned long) s->flip_id,
+		  (unsigned long) s->alloc_since_flip,
+		  (unsigned long) s->free_blocks);
+  tm_stats_json_n(&o, s->n, tm__LAST3);
+
+  tm_stats_printf(&o, ",\"color_transitions\":[");
+  for ( i = 0; i <= tm_TOTAL; ++ i ) {
+    tm_stats_printf(&o, "%s[", i ? "," : "");
+    for ( j = 0; j <= tm_TOTAL; ++ j ) {
+      tm_stats_printf(&o, "%s%lu", j ? "," : "", (unsigned long) s->n_color_transitions[i][j]);
+    }
+    tm_stats_printf(&o, "]");
+  }
+
+  tm_stats_printf(&o, "],\"types_total\":%d,\"types\":[", s->types_total);
+  for ( i = 0; i < s->types_n; ++ i ) {
+    tm_stats_printf(&o, "%s{\"id\":%d,\"size\":%lu,\"n\":",
+		    i ? "," : "",
+		    s->types[i].id,
+		    (unsigned long) s->types[i].size);
+    tm_stats_json_n(&o, s->types[i].n, tm__LAST2);
+    tm_stats_printf(&o, "}");
+  }
+
+  tm_stats_printf(&o, "],\"time\":{");
+  tm_stats_json_time(&o, &s->ts_alloc, "");
+  tm_stats_json_time(&o, &s->ts_free, ",");
+  tm_stats_json_time(&o, &s->ts_gc, ",");
+  tm_stats_json_time(&o, &s->ts_flip, ",");
+  tm_stats_json_time(&o, &s->ts_os_alloc, ",");
+  tm_stats_json_time(&o, &s->ts_os_free, ",");
+  tm_stats_json_time(&o, &s->ts_barrier, ",");
+  tm_stats_json_time(&o, &s->ts_barrier_pure, ",");
+  tm_stats_json_time(&o, &s->ts_barrier_root, ",");
+  tm_stats_json_time(&o, &s->ts_barrier_black, ",");
+
+  tm_stats_printf(&o, "},\"wb_faults\":%lu,\"wb_mprotects\":%lu,\"finalize_queued\":%lu,\"finalize_run\":%lu,\"weak_cleared\":%lu}",
+		  (unsigned long) s->wb_faults,
+		  (unsigned long) s->wb_mprotects,
+		  (unsigned long) s->finalize_queued,
+		  (unsigned long) s->finalize_run,
+		  (unsigned long) s->weak_cleared);
+
+  if ( size ) {
+    buf[o.len < size ? o.len : size - 1] = 0;
+  }
+
+  return o.len;
+}
+
@@ -4,8 +4,22 @@
 #ifndef tm_STATS_H
 #define tm_STATS_H
 
+#include "tredmill/color.h"
+
 /****************************************************************************/
 
+/*! A clock reading; see tm_time_stat_begin(). */
+typedef unsigned long long tm_time_ticks;
+
+/*! Each power of 2 nanoseconds is split into 2^tm_time_stat_HIST_SUB_BITS linear sub-buckets. */
+#define tm_time_stat_HIST_SUB_BITS 3
+
+/*! The number of sub-buckets per power of 2. */
+#define tm_time_stat_HIST_SUB (1 << tm_time_stat_HIST_SUB_BITS)
+
+/*! The number of buckets in a tm_time_stat histogram: up to 2^40 nanoseconds. */
+#define tm_time_stat_HIST_N ((40 - tm_time_stat_HIST_SUB_BITS + 1) * tm_time_stat_HIST_SUB)
+
 /**
  * Timing statstics.
  */
@@ -14,21 +28,119 @@ typedef struct tm_time_stat {
   double td;          /*!< Last time in seconds. */
   double ts;          /*!< Total time in seconds. */
   double tw;          /*!< Worst time in seconds. */
-  double ta;          /*!< Average time in seconds. */
-  double t0;          /*!< Absolute time at tm_time_stat_begin(). */
-  double t1;          /*!< Absolute time at tm_time_stat_end(). */ 
-  double t01;         /*!< Aux time at tm_time_stat_begin(). */
-  double t11;         /*!< Aux time at tm_time_stat_end(). */
+  double ta;          /*!< Average time in seconds: computed when printed. */
+  tm_time_ticks t0;   /*!< Clock at tm_time_stat_begin(). */
   short tw_changed;   /*!< Time worst changed? */
   unsigned int count; /*!< Total calls to tm_time_stat_end(). */
+  /*! Histogram of times: hist[i] counts times in [tm_time_stat_hist_lower(i), tm_time_stat_hist_lower(i + 1)) nanoseconds. */
+  unsigned long hist[tm_time_stat_HIST_N];
 } tm_time_stat;
 
+
+/**
+ * Returns the histogram bucket of dt nanoseconds.
+ *
+ * Times under tm_time_stat_HIST_SUB nanoseconds have a bucket each;
+ * above, each power of 2 has tm_time_stat_HIST_SUB buckets of equal width,
+ * so a bucket is never wider than 1/tm_time_stat_HIST_SUB of its lower bound.
+ */
+static __inline
+int tm_time_stat_hist_index(unsigned long long dt)
+{
+  int e, i;
+
+  if ( dt < tm_time_stat_HIST_SUB )
+    return (int) dt;
+
+  e = 63 - __builtin_clzll(dt);
+  i = (e - tm_time_stat_HIST_SUB_BITS + 1) * tm_time_stat_HIST_SUB
+    + (int) ((dt >> (e - tm_time_stat_HIST_SUB_BITS)) & (tm_time_stat_HIST_SUB - 1));
+
+  return i < tm_time_stat_HIST_N ? i : tm_time_stat_HIST_N - 1;
+}
+
+
+/**
+ * Returns the lowest time, in nanoseconds, counted by histogram bucket i.
+ */
+static __inline
+unsigned long long tm_time_stat_hist_lower(int i)
+{
+  int e = i / tm_time_stat_HIST_SUB;
+
+  if ( ! e )
+    return i;
+
+  return (unsigned long long) (tm_time_stat_HIST_SUB + i % tm_time_stat_HIST_SUB) << (e - 1);
+}
+
+
+
+/*! The maximum number of tm_types in a tm_stats snapshot. */
+#define tm_stats_TYPE_MAX 256
+
+/**
+ * Statistics of a tm_type, in a tm_stats snapshot.
+ */
+typedef struct tm_stats_type {
+  /*! The tm_type id. */
+  int id;
+  /*! The node size. */
+  size_t size;
+  /*! Node counts: WHITE, ECRU, GREY, BLACK, tm_TOTAL, then tm_B, tm_NU, tm_b, tm_b_NU. */
+  size_t n[tm__LAST2];
+} tm_stats_type;
+
+
+/**
+ * A statistics snapshot; see tm_stats_snapshot().
+ *
+ * Counts indexed by tm_color use WHITE, ECRU, GREY and BLACK as currently mapped:
+ * n[tm_WHITE] is the number of free nodes.
+ */
+struct tm_stats {
+  /*! Number of flips since tm_init(). */
+  unsigned long flip_id;
+  /*! Allocations since the last flip. */
+  size_t alloc_since_flip;
+  /*! Global counts: node colors, then tm_B .. tm_b_OS_M. */
+  size_t n[tm__LAST3];
+  /*! Number of tm_blocks on the free lists. */
+  size_t free_blocks;
+  /*! Number of transitions from one tm_node_color() to another, as stored in nodes. */
+  size_t n_color_transitions[tm_TOTAL + 1][tm_TOTAL + 1];
+
+  /*! Number of tm_types in types[]. */
+  int types_n;
+  /*! Number of tm_types: more than types_n if tm_stats_TYPE_MAX were exceeded. */
+  int types_total;
+  /*! The tm_types. */
+  tm_stats_type types[tm_stats_TYPE_MAX];
+
+  /*! Timing statistics, with histograms. */
+  tm_time_stat ts_alloc, ts_free, ts_gc, ts_flip, ts_os_alloc, ts_os_free;
+  tm_time_stat ts_barrier, ts_barrier_pure, ts_barrier_root, ts_barrier_black;
+
+  /*! Write barrier faults and mprotect() calls. */
+  size_t wb_faults, wb_mprotects;
+  /*! Finalizers queued and run. */
+  size_t finalize_queued, finalize_run;
+  /*! Weak pointers cleared. */
+  size_t weak_cleared;
+};
+
+void tm_time_stat_init();
 void tm_time_stat_begin(tm_time_stat *ts);
 void tm_time_stat_end(tm_time_stat *ts);
+double tm_time_stat_percentile(const tm_time_stat *ts, double p);
 
 void tm_print_stats();
 void tm_print_block_stats();
 void tm_print_time_stats();
+void tm_print_time_histograms();
+
+void tm_stats_snapshot(struct tm_stats *s);
+size_t tm_stats_json(const struct tm_stats *s, char *buf, size_t size);
 
 void tm_print_color_transition_stats();
 void tm_print_phase_transition_stats();
@@ -812,7 +812,7 @@ void *_tm_alloc_type_inner(tm_type *t)
   tm_time_stat_end(ts);
 #endif
 
-  tm_alloc_log(ptr);
+  tm_alloc_log(ptr, t->size);
 
 #if 0
   tm_msg("a %p[%lu]\n", ptr, (unsigned long) t->size);
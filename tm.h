@@ -98,6 +98,44 @@ void tm_free(void *ptr);
 /*@}*/
 
 
+/*******************************************************************************/
+/*! \defgroup finalization Finalization */
+/*@{*/
+
+/*! A finalizer: called with the node's pure pointer, and the data given to tm_register_finalizer(). */
+typedef void (*tm_finalizer)(void *ptr, void *data);
+
+int tm_register_finalizer(void *ptr, tm_finalizer fn, void *data);
+size_t tm_run_finalizers();
+
+
+/*@}*/
+
+
+/*******************************************************************************/
+/*! \defgroup weak_reference Weak References */
+/*@{*/
+
+/*! A weak reference: does not keep its target alive. */
+typedef struct tm_weak_ref tm_weak_ref;
+
+tm_weak_ref *tm_weak_ref_new(void *target);
+void *tm_weak_ref_get(tm_weak_ref *w);
+void tm_weak_ref_set(tm_weak_ref *w, void *target);
+
+/*! A hash table whose keys are weak references. */
+typedef struct tm_weak_table tm_weak_table;
+
+tm_weak_table *tm_weak_table_new(size_t nbuckets);
+void *tm_weak_table_get(tm_weak_table *t, void *key);
+int tm_weak_table_put(tm_weak_table *t, void *key, void *value);
+int tm_weak_table_remove(tm_weak_table *t, void *key);
+size_t tm_weak_table_count(tm_weak_table *t);
+
+
+/*@}*/
+
+
 /*******************************************************************************/
 /*! \defgroup gc GC */
 /*@{*/
@@ -109,6 +147,25 @@ void tm_free(void *ptr);
  */
 void tm_gc_full();
 
+/**
+ * Do some collector work while the mutator is idle.
+ *
+ * Sweeps tm_blocks of types that are no longer allocating.
+ * Returns the number of tm_blocks released.
+ */
+int tm_gc_idle();
+
+
+/*@}*/
+
+
+/*******************************************************************************/
+/*! \defgroup fork Fork */
+/*@{*/
+
+void tm_atfork_prepare();
+void tm_atfork_parent();
+void tm_atfork_child();
 
 /*@}*/
 
@@ -127,6 +184,16 @@ void tm_msg1(const char *format, ...);
 void tm_print_stats();
 void tm_print_block_stats();
 void tm_print_time_stats();
+void tm_print_time_histograms();
+
+/*! A statistics snapshot: see stats.h. */
+typedef struct tm_stats tm_stats;
+
+void tm_stats_snapshot(tm_stats *s);
+size_t tm_stats_json(const tm_stats *s, char *buf, size_t size);
+
+void tm_trace_flush();
+long long tm_heap_dump(int fd);
 
 
 /*@}*/
@@ -142,8 +209,30 @@ extern long tm_node_sweep_some_size;
 extern long tm_node_unmark_some_size;
 extern long tm_block_sweep_some_size;
 extern int tm_block_min_free;
+extern int tm_block_scavenge_enable;
+extern int tm_block_alloc_batch;
 extern size_t tm_os_alloc_max;
+extern size_t tm_heap_reserve_size;
 extern int tm_root_scan_full;
+extern int tm_stack_scan_incremental;
+extern int tm_root_scan_shared_libraries;
+extern int tm_root_soft_dirty;
+extern int tm_atfork_handlers;
+extern long tm_fork_child_delay;
+
+/*! Write barrier modes: see tm_write_barrier_mode. */
+enum tm_barrier_mode {
+  /*! Mutators call tm_write_barrier(). */
+  tm_BARRIER_SOFTWARE,
+  /*! Mutated pages are found by write-protecting heap pages with mprotect(); see wb.c.  System calls that write into heap nodes may fail with EFAULT; see wb.h. */
+  tm_BARRIER_MPROTECT,
+  /*! Mutated pages are found by write-protecting heap pages with userfaultfd; see wb_uffd.c.  Falls back to tm_BARRIER_SOFTWARE if only user mode faults can be handled; see tm_wb_uffd_user_mode_only. */
+  tm_BARRIER_UFFD
+};
+
+extern int tm_write_barrier_mode;
+extern int tm_wb_protect_percent;
+extern int tm_wb_uffd_user_mode_only;
 
 /*@}*/
 
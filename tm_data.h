@@ -3,6 +3,7 @@
 
 #include <setjmp.h>
 
+#include "tredmill/tm.h" /* tm_adesc, tm_finalizer */
 #include "tredmill/config.h"
 
 #include "util/bitset.h" /* bitset_t */
@@ -13,6 +14,8 @@
 #include "tredmill/block.h"
 #include "tredmill/root.h"
 #include "tredmill/node.h"
+#include "tredmill/finalize.h"
+#include "tredmill/weak.h"
 
 
 /****************************************************************************/
@@ -86,9 +89,14 @@ struct tm_data {
   /*! The last block allocated. */
   tm_block *block_last;
 
-  /*! A list of free tm_blocks not returned to the OS. */
-  tm_list free_blocks;
-  /*! Number of tm_blocks in the free_blocks list. */
+#ifndef tm_free_blocks_LEN
+#define tm_free_blocks_LEN 32
+#endif
+  /*! Lists of free tm_blocks not returned to the OS, indexed by size in tm_block_SIZE units.  The last list holds all larger tm_blocks. */
+  tm_list free_blocks[tm_free_blocks_LEN];
+  /*! Bit mask of non-empty free_blocks lists. */
+  unsigned long free_blocks_mask;
+  /*! Number of tm_blocks in all free_blocks lists. */
   int free_blocks_n;
 
   /*! Block sweeping iterators. */
@@ -100,6 +108,17 @@ struct tm_data {
 
   /*! OS-level allocation: */
 
+  /*! List of tm_arenas allocated from the OS. */
+  tm_list arenas;
+  /*! Number of tm_arenas allocated from the OS. */
+  int arenas_n;
+
+  /*! The size of a tm_arena-indexed bit map. */
+#define tm_ARENA_BITMAP_SIZE (tm_address_range_k / (tm_arena_SIZE / 1024) / bitset_ELEM_BSIZE)
+
+  /*! A bit map of tm_arenas allocated from the OS; see tm_arena_index(). */
+  bitset_t arena_map[tm_ARENA_BITMAP_SIZE];
+
   /*! The address of the last allocation from the operating system. */
   void * os_alloc_last;
   /*! The size of the last allocation from the operating system. */
@@ -113,6 +132,15 @@ struct tm_data {
   /*! Valid pointer range. */
   void *ptr_range[2];
 
+  /*! The reserved heap address range, or 0; see tm_heap_reserve_size. */
+  char *heap_base;
+  /*! The size of the heap address range; all addresses, if no range was reserved. */
+  size_t heap_size;
+  /*! The page index to start searching for uncommitted pages in the reserved heap range. */
+  size_t heap_next;
+  /*! A bit map of committed pages in the reserved heap range. */
+  bitset_t heap_committed[tm_BITMAP_SIZE];
+
   /*! A bit map of pages with nodes in use. */
   bitset_t page_in_use[tm_BITMAP_SIZE];
 
@@ -136,18 +164,66 @@ struct tm_data {
 
   /*! Roots: */
 
-  /*! List of root regions for scanning. */
-  tm_root roots[16];
-  /*! Number of roots regions registered. */
-  short nroots;
-
-  /*! List of roots to avoid during scanning: anti-roots. */
-  tm_root aroots[16]; 
-  /*! Number of anti-roots registered. */
-  short naroots;
-
-  /*! Huh? */
-  short root_datai, root_newi;
+  /*! The register set root: see tm.jb. */
+  tm_root root_register;
+  /*! The stack root. */
+  tm_root root_stack;
+
+  /*! Data root regions for scanning. */
+  tm_root_set roots;
+
+  /*! Roots to avoid during scanning: anti-roots. */
+  tm_root_set aroots;
+
+  /*! Root callbacks. */
+  tm_root_set root_callbacks;
+
+  /*! Writable segments and thread-local storage of shared libraries; see _tm_root_dl_scan(). */
+  tm_root_set dl_roots;
+  /*! If true, dl_roots is up-to-date with dl_adds and dl_subs. */
+  short dl_roots_valid;
+  /*! Counts of shared libraries loaded and unloaded when dl_roots was built. */
+  unsigned long long dl_adds, dl_subs;
+
+  /*! Soft-dirty root tracking: see tm_root_soft_dirty. */
+
+  /*! The /proc/self/pagemap file descriptor, or -1. */
+  int root_pagemap_fd;
+  /*! If true, soft-dirty bits were cleared when the roots were scanned. */
+  int root_soft_dirty_valid;
+  /*! The size of an OS page, as indexed by /proc/self/pagemap. */
+  size_t root_os_page_size;
+
+  /*! Finalization: see finalize.c. */
+
+  /*! Finalizers registered for nodes, sorted by node. */
+  tm_finalizer_set finalizers;
+  /*! Finalizers of unreachable nodes, to be run by tm_run_finalizers(). */
+  tm_finalizer_set finalize_queue;
+  /*! If true, tm_run_finalizers() is running. */
+  int finalizing;
+  /*! Number of finalizers queued. */
+  size_t finalize_queued;
+  /*! Number of finalizers run. */
+  size_t finalize_run;
+
+  /*! Weak references: see weak.c. */
+
+  /*! Nodes with a weak first word: tm_weak_ref and tm_weak_entry. */
+  tm_weak_set weak_nodes;
+  /*! Allocation descriptors for tm_weak_ref and tm_weak_entry. */
+  tm_adesc weak_ref_desc, weak_entry_desc;
+  /*! Number of flips that cleared weak pointers. */
+  size_t weak_epoch;
+  /*! Number of weak pointers cleared. */
+  size_t weak_cleared;
+
+  /*! Fork: see fork.c. */
+
+  /*! Number of allocations left before the collector resumes in a child process. */
+  long fork_delay;
+  /*! Number of child processes forked. */
+  size_t forks;
 
   /*! Direction of C stack growth. */
   short stack_grows;
@@ -155,9 +231,18 @@ struct tm_data {
   /*! Pointer to a stack allocated variable.  See user.c. */
   void **stack_ptrp;
 
-  /*! Root being marked. */
-  short rooti;
-  /*! Current address in root being marked. */
+  /*! Incremental stack scanning: see _tm_stack_scan(). */
+
+  /*! The shallowest stack pointer seen since the stack scan began: the stack watermark. */
+  char *stack_watermark;
+  /*! The lowest stack address scanned since the stack scan began, or 0 if the stack must be scanned fully. */
+  char *stack_scan_l;
+  /*! A copy of the stack as it was scanned, aligned to the high end of the stack. */
+  char *stack_copy;
+  /*! The size of stack_copy. */
+  size_t stack_copy_size;
+
+  /*! Current address in data roots being marked. */
   const char *rp;
 
   /*! How many root mutations happened since root scan. */
@@ -165,6 +250,40 @@ struct tm_data {
   /*! How many stack mutations happened since root scan. */
   unsigned long stack_mutations;
 
+  /*! mprotect() write barrier: see wb.c. */
+
+  /*! If true, the mprotect() write barrier is active. */
+  int wb_active;
+  /*! The userfaultfd file descriptor, or -1 if write faults are handled by SIGSEGV; see wb_uffd.c. */
+  int wb_uffd;
+  /*! Depth of calls into tm: write faults from within tm are not mutations. */
+  volatile int wb_in_tm;
+  /*! A bit map of tm_blocks write-protected at the last flip. */
+  bitset_t wb_block_protected[tm_BITMAP_SIZE];
+  /*! A bit map of pages currently write-protected. */
+  bitset_t wb_protected[tm_BITMAP_SIZE];
+#ifndef tm_wb_FAULTS_MAX
+#define tm_wb_FAULTS_MAX 1024
+#endif
+  /*! Pages write-faulted by the mutator since tm returned. */
+  void *wb_dirty[tm_wb_FAULTS_MAX];
+  /*! Number of wb_dirty pages. */
+  volatile int wb_dirty_n;
+  /*! Pages unprotected within tm, to be write-protected again when tm returns. */
+  void *wb_reprotect[tm_wb_FAULTS_MAX];
+  /*! Number of wb_reprotect pages. */
+  volatile int wb_reprotect_n;
+  /*! If true, write faults were not recorded: all write-protected tm_blocks must be checked. */
+  volatile int wb_overflow;
+  /*! A buffer of tm_block addresses used at flip. */
+  void **wb_pages;
+  /*! The size of wb_pages, in bytes. */
+  size_t wb_pages_size;
+  /*! Number of write faults handled. */
+  size_t wb_faults;
+  /*! Number of calls to mprotect(). */
+  size_t wb_mprotects;
+
   /*! Time Stats: */
 
   /*! Time spent in tm_alloc_os(). */
@@ -179,6 +298,8 @@ struct tm_data {
   tm_time_stat   ts_gc;                  
   /*! Time spent in tm_gc_full_inner().  */
   tm_time_stat   ts_gc_inner;                  
+  /*! Time spent in the atomic pass that ends marking and flips colors. */
+  tm_time_stat   ts_flip;
   /*! Time spent in tm_write_barrier(). */
   tm_time_stat   ts_barrier;             
   /*! Time spent in tm_write_barrier_root(). */
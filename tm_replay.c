@@ -0,0 +1,401 @@
+/** \file tm_replay.c
+ * \brief Allocation trace replay benchmark.
+ *
+ * Usage:
+ *
+ *   tm_replay trace
+ *
+ * Replays a trace recorded with TM_TRACE=trace; see trace.c:
+ *
+ * - Allocations and reallocations are replayed with the same sizes.
+ * - Each traced node is kept alive by a root table until it is freed,
+ *   or the traced collector found it unreachable:
+ *   node lifetimes are those seen by the traced collector.
+ * - Pointer stores are replayed between the replayed nodes, followed by
+ *   the same write barriers, so the collector marks the same pointer graph.
+ * .
+ *
+ * Then reports throughput, pause distributions and peak RSS.
+ * The trace is memory-mapped, not read, in windows of TRACE_WINDOW bytes:
+ * tm_replay links libtredmill, so it has a 32-bit address space when libtredmill does.
+ */
+#include "tm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "internal.h" /* tm_write_barrier(), tm_stats, tm_trace_record */
+
+
+/****************************************************************************/
+/* Traced node table. */
+
+/*! Traced node addresses: 0 is empty, 1 is deleted.  Not a root: the addresses are of the traced process. */
+static unsigned long long *keys;
+
+/*! Replayed nodes: scanned by table_scan(), a root callback. */
+static void **ptrs;
+
+/*! Replayed node sizes. */
+static size_t *sizes;
+
+/*! The table size: a power of 2. */
+static size_t table_cap;
+
+/*! The number of keys, including deleted keys. */
+static size_t table_used;
+
+/*! The number of replayed nodes in the table. */
+static size_t table_n;
+
+/*! The target of replayed root write barriers. */
+static void *replay_root;
+
+
+/**
+ * Allocate a zeroed array.
+ *
+ * Not calloc(): calling malloc() or free() links malloc.c, which maps them to tm_alloc() and tm_free().
+ */
+static void *table_alloc(size_t n, size_t size)
+{
+  void *p = mmap(0, n * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED ) {
+    fprintf(stderr, "tm_replay: out of memory\n");
+    exit(2);
+  }
+
+  return p;
+}
+
+
+static size_t table_hash(unsigned long long key)
+{
+  return (size_t) ((key >> 3) * 0x9e3779b97f4a7c15ULL) & (table_cap - 1);
+}
+
+
+/**
+ * Returns the index of key, or of the empty slot where it would be inserted.
+ */
+static size_t table_find(unsigned long long key)
+{
+  size_t i = table_hash(key);
+
+  while ( keys[i] && keys[i] != key ) {
+    i = (i + 1) & (table_cap - 1);
+  }
+
+  return i;
+}
+
+
+/**
+ * Root callback: mark the replayed nodes.
+ *
+ * A callback, not tm_root_add(): the table moves when resized,
+ * and tm_root_remove() would leave an anti-root over its old address.
+ */
+static void table_scan(void *data)
+{
+  _tm_range_scan(ptrs, ptrs + table_cap);
+}
+
+
+static void table_resize(size_t cap)
+{
+  unsigned long long *old_keys = keys;
+  void **old_ptrs = ptrs;
+  size_t *old_sizes = sizes;
+  size_t old_cap = table_cap, i;
+
+  keys = table_alloc(cap, sizeof(keys[0]));
+  ptrs = table_alloc(cap, sizeof(ptrs[0]));
+  sizes = table_alloc(cap, sizeof(sizes[0]));
+  table_cap = cap;
+  table_used = table_n;
+
+  for ( i = 0; i < old_cap; ++ i ) {
+    if ( old_keys[i] > 1 ) {
+      size_t j = table_find(old_keys[i]);
+
+      keys[j] = old_keys[i];
+      ptrs[j] = old_ptrs[i];
+      sizes[j] = old_sizes[i];
+    }
+  }
+
+  if ( old_ptrs ) {
+    munmap(old_keys, old_cap * sizeof(keys[0]));
+    munmap(old_ptrs, old_cap * sizeof(ptrs[0]));
+    munmap(old_sizes, old_cap * sizeof(sizes[0]));
+  }
+}
+
+
+static void table_put(unsigned long long key, void *ptr, size_t size)
+{
+  size_t i;
+
+  if ( (table_used + 1) * 2 > table_cap ) {
+    table_resize(table_n * 4 > table_cap ? table_cap * 2 : table_cap);
+  }
+
+  i = table_find(key);
+  if ( ! keys[i] ) {
+    keys[i] = key;
+    ++ table_used;
+    ++ table_n;
+  }
+  /* No root write barrier: ptr was just allocated BLACK, or is already in the table. */
+  ptrs[i] = ptr;
+  sizes[i] = size;
+}
+
+
+/**
+ * Returns the index of key, or -1.
+ */
+static long table_get(unsigned long long key)
+{
+  size_t i;
+
+  if ( ! key )
+    return -1;
+
+  i = table_find(key);
+  return keys[i] ? (long) i : -1;
+}
+
+
+static void table_remove(unsigned long long key)
+{
+  long i = table_get(key);
+
+  if ( i >= 0 ) {
+    keys[i] = 1;
+    ptrs[i] = 0;
+    -- table_n;
+  }
+}
+
+
+/****************************************************************************/
+/* Trace windows. */
+
+/*! The number of trace bytes mapped at a time. */
+#define TRACE_WINDOW (64UL << 20)
+
+/*! A trace file, mapped a window at a time. */
+typedef struct trace_window {
+  int fd;
+  /*! The trace file size. */
+  off_t size;
+  /*! The file offset of the record after the window. */
+  off_t off;
+  char *map;
+  size_t map_size;
+  /*! The next record, and the end of the window. */
+  const tm_trace_record *r, *end;
+} trace_window;
+
+
+/**
+ * Returns the next record, mapping the next window as needed, or 0 at the end of the trace.
+ */
+static const tm_trace_record *trace_next(trace_window *w)
+{
+  if ( w->r == w->end ) {
+    off_t base;
+    size_t n;
+
+    if ( w->map ) {
+      munmap(w->map, w->map_size);
+      w->map = 0;
+    }
+
+    if ( (w->size - w->off) / sizeof(*w->r) == 0 )
+      return 0;
+    n = TRACE_WINDOW / sizeof(*w->r);
+    if ( n > (w->size - w->off) / sizeof(*w->r) )
+      n = (w->size - w->off) / sizeof(*w->r);
+
+    /*! Map from the page containing the record. */
+    base = w->off & ~ (off_t) (sysconf(_SC_PAGESIZE) - 1);
+    w->map_size = (w->off - base) + n * sizeof(*w->r);
+    if ( (w->map = mmap(0, w->map_size, PROT_READ, MAP_PRIVATE, w->fd, base)) == MAP_FAILED ) {
+      fprintf(stderr, "tm_replay: cannot map trace\n");
+      exit(1);
+    }
+    madvise(w->map, w->map_size, MADV_SEQUENTIAL);
+
+    w->r = (const tm_trace_record*) (w->map + (w->off - base));
+    w->end = w->r + n;
+    w->off += n * sizeof(*w->r);
+  }
+
+  return w->r ++;
+}
+
+
+/****************************************************************************/
+/* Replay. */
+
+static double now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static void print_time(const tm_time_stat *ts)
+{
+  printf("  %-14s %10lu %12.3f %10.3f %10.3f %10.3f %10.3f\n",
+	 ts->name,
+	 (unsigned long) ts->count,
+	 ts->ts * 1e3,
+	 tm_time_stat_percentile(ts, 0.50) * 1e6,
+	 tm_time_stat_percentile(ts, 0.99) * 1e6,
+	 tm_time_stat_percentile(ts, 0.999) * 1e6,
+	 ts->tw * 1e6);
+}
+
+
+int main(int argc, char **argv, char **envp)
+{
+  tm_trace_header hdr, *h = &hdr;
+  trace_window w;
+  const tm_trace_record *r;
+  unsigned long n_alloc = 0, n_store = 0, n_death = 0, n_flip = 0, n_miss = 0;
+  unsigned long long bytes = 0;
+  static tm_stats s;
+  struct rusage ru;
+  struct stat st;
+  double t0, t1;
+  void *p;
+
+  if ( argc != 2 ) {
+    fprintf(stderr, "usage: %s trace\n", argv[0]);
+    return 1;
+  }
+
+  memset(&w, 0, sizeof(w));
+  if ( (w.fd = open(argv[1], O_RDONLY)) < 0 || fstat(w.fd, &st) ) {
+    perror(argv[1]);
+    return 1;
+  }
+  if ( pread(w.fd, h, sizeof(*h), 0) != sizeof(*h) ) {
+    fprintf(stderr, "tm_replay: %s: not a trace\n", argv[1]);
+    return 1;
+  }
+  w.size = st.st_size;
+  w.off = sizeof(*h);
+
+  if ( memcmp(h->magic, tm_trace_MAGIC, sizeof(h->magic)) || h->record_size != sizeof(*r) ) {
+    fprintf(stderr, "tm_replay: %s: not a trace\n", argv[1]);
+    return 1;
+  }
+  if ( h->ptr_size != sizeof(void*) ) {
+    fprintf(stderr, "tm_replay: %s: traced with %u-byte pointers\n", argv[1], h->ptr_size);
+    return 1;
+  }
+
+  tm_init(&argc, &argv, &envp);
+  table_resize(1024);
+  tm_root_add_callback("replay", table_scan, 0);
+
+  t0 = now();
+
+  while ( (r = trace_next(&w)) ) {
+    long i, j;
+
+    switch ( r->op ) {
+    case tm_trace_ALLOC:
+      if ( r->a && (p = tm_alloc(r->size)) ) {
+	table_put(r->a, p, r->size);
+	++ n_alloc;
+	bytes += r->size;
+      }
+      break;
+
+    case tm_trace_REALLOC:
+      i = table_get(r->b);
+      p = tm_realloc(i >= 0 ? ptrs[i] : 0, r->size);
+      table_remove(r->b);
+      if ( r->a && p ) {
+	table_put(r->a, p, r->size);
+	++ n_alloc;
+	bytes += r->size;
+      }
+      break;
+
+    case tm_trace_FREE:
+      /* Explicitly freed nodes are only dropped: they become garbage. */
+      table_remove(r->a);
+      break;
+
+    case tm_trace_STORE:
+      if ( (i = table_get(r->a)) >= 0 && r->size % sizeof(void*) == 0 && r->size + sizeof(void*) <= sizes[i] ) {
+	void **slot = (void**) ((char*) ptrs[i] + r->size);
+
+	j = table_get(r->b);
+	*slot = j >= 0 && r->offset < sizes[j] ? (char*) ptrs[j] + r->offset : 0;
+	tm_write_barrier(slot);
+	++ n_store;
+      } else {
+	++ n_miss;
+      }
+      break;
+
+    case tm_trace_ROOT:
+      tm_write_barrier_root(&replay_root);
+      break;
+
+    case tm_trace_DEATH:
+      table_remove(r->a);
+      ++ n_death;
+      break;
+
+    case tm_trace_FLIP:
+      ++ n_flip;
+      break;
+    }
+  }
+
+  t1 = now();
+
+  tm_stats_snapshot(&s);
+  getrusage(RUSAGE_SELF, &ru);
+
+  printf("%s: %lu records\n", argv[1], (unsigned long) ((w.size - sizeof(*h)) / sizeof(*r)));
+  printf("  allocs %lu, bytes %llu, stores %lu (%lu not replayed), deaths %lu, traced flips %lu, replayed flips %lu\n",
+	 n_alloc, bytes, n_store, n_miss, n_death, n_flip, s.flip_id);
+  printf("  elapsed %.3f s, %.0f allocs/s, %.1f MB/s\n",
+	 t1 - t0,
+	 n_alloc / (t1 - t0),
+	 bytes / (t1 - t0) / (1024 * 1024));
+  printf("  peak RSS %ld KB, OS bytes %lu (peak %lu), live at end %lu\n",
+	 (long) ru.ru_maxrss,
+	 (unsigned long) s.n[tm_b_OS],
+	 (unsigned long) s.n[tm_b_OS_M],
+	 (unsigned long) table_n);
+
+  printf("\n  %-14s %10s %12s %10s %10s %10s %10s\n", "pause", "count", "total ms", "p50 us", "p99 us", "p999 us", "worst us");
+  print_time(&s.ts_alloc);
+  print_time(&s.ts_flip);
+  print_time(&s.ts_barrier);
+  print_time(&s.ts_barrier_pure);
+  print_time(&s.ts_barrier_root);
+
+  return 0;
+}
+
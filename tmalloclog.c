@@ -0,0 +1,89 @@
+/** \file tmalloclog.c
+ * \brief Allocation log converter.
+ *
+ * Usage:
+ *
+ *   tmalloclog log > text
+ *
+ * Prints the records of a binary allocation log, oldest first,
+ * as the text columns plotted by alloc_log.gp, followed by the size class.
+ * See log.h for the log format, and log.c.
+ */
+#include "tredmill/log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+int main(int argc, char **argv)
+{
+  const tm_alloc_log_header *h;
+  const tm_alloc_log_record *ring;
+  unsigned long long i, head;
+  struct stat st;
+  void *p;
+  int fd;
+
+  if ( argc != 2 ) {
+    fprintf(stderr, "usage: %s log\n", argv[0]);
+    return 1;
+  }
+
+  if ( (fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) ) {
+    perror(argv[1]);
+    return 1;
+  }
+  if ( st.st_size < sizeof(*h) ||
+       (p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ) {
+    fprintf(stderr, "tmalloclog: %s: cannot map\n", argv[1]);
+    return 1;
+  }
+  close(fd);
+
+  h = p;
+  ring = (const tm_alloc_log_record*) (h + 1);
+  if ( memcmp(h->magic, tm_alloc_log_MAGIC, sizeof(h->magic)) ||
+       h->record_size != sizeof(*ring) ||
+       st.st_size < sizeof(*h) + h->capacity * sizeof(*ring) ) {
+    fprintf(stderr, "tmalloclog: %s: not an allocation log\n", argv[1]);
+    return 1;
+  }
+
+  printf("%6s %12s %6s %6s %6s %6s %6s %6s %6s %6s %6s\n",
+	 "#ID",
+	 "PTR",
+	 "WHITE",
+	 "ECRU",
+	 "GREY",
+	 "BLACK",
+	 "TOTAL",
+	 "BLOCKS",
+	 "FREE_BLOCKS",
+	 "FLIP",
+	 "SIZE");
+
+  head = h->head;
+  for ( i = head > h->capacity ? head - h->capacity : 0; i < head; ++ i ) {
+    const tm_alloc_log_record *r = &ring[i % h->capacity];
+
+    printf("%6llu %24llu %6u %6u %6u %6u %6u %6u %6u %6u %6u\n",
+	   r->id,
+	   r->ptr,
+	   r->n[0],
+	   r->n[1],
+	   r->n[2],
+	   r->n[3],
+	   r->n[4],
+	   r->blocks,
+	   r->free_blocks,
+	   r->flip,
+	   r->size);
+  }
+
+  return 0;
+}
@@ -0,0 +1,687 @@
+/** \file tmbench.c
+ * \brief Allocator benchmarks.
+ *
+ * Usage:
+ *
+ *   tmbench [-n scale] [-s seed] [-a tm|malloc] [workload ...]
+ *
+ * Runs each workload with tredmill and with the C library malloc(),
+ * each run in its own child process, so that RSS and heap state
+ * are not shared between runs.
+ *
+ * Workloads:
+ *
+ * - binary-trees: trees of depth 4 .. 10 + 2 * scale built, checked and dropped, beside one long-lived tree.
+ * - lru: a steady-state LRU cache of 2048 * scale entries with variable-size values and skewed keys.
+ * - queue: a producer-consumer queue of variable-size messages, produced and consumed in bursts.
+ * - parse: lines of key=value fields split into strings and lists; keys are interned, the last lines are kept.
+ * - arrays: a few slots of large arrays, replaced at random;
+ *   sizes are drawn from tm_block_SIZE_MAX / 8 .. tm_block_SIZE_MAX / 2, the largest size class that fits a tm_block.
+ * .
+ *
+ * Each run reports:
+ *
+ * - allocations per second and MB allocated per second, over elapsed time.
+ * - allocation pause percentiles and worst pause, in microseconds:
+ *   tredmill collects incrementally in tm_alloc(), so these are its GC pauses.
+ * - peak RSS, and steady RSS: the mean RSS sampled over the second half of the run.
+ * - mm%: the share of CPU time spent in allocation, free and write barrier calls,
+ *   which for tredmill includes all collector work.
+ * .
+ *
+ * The same seed gives the same sequence of requests to each allocator.
+ * With tredmill, free() only drops the reference, and pointer stores into
+ * nodes and roots are followed by tm_write_barrier().
+ */
+#include "tm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "internal.h" /* tm_write_barrier(), tm_time_stat, tm_block_SIZE_MAX */
+
+
+/****************************************************************************/
+/* Allocators. */
+
+/**
+ * An allocator under test.
+ */
+typedef struct bench_allocator {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void (*free)(void *ptr);
+  /*! If true, free only drops references, and stores need write barriers. */
+  int gc;
+} bench_allocator;
+
+/**
+ * The C library malloc() and free().
+ *
+ * Calling malloc() or free() links malloc.c, which maps them to tm_alloc() and tm_free().
+ */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+
+static const bench_allocator bench_allocators[] = {
+  { "tm", tm_alloc, 0, 1 },
+  { "malloc", __libc_malloc, __libc_free, 0 },
+  { 0 }
+};
+
+/*! The allocator of this run. */
+static const bench_allocator *A;
+
+
+/****************************************************************************/
+/* Measurement. */
+
+static tm_time_stat ts_alloc = { "alloc" };
+static tm_time_stat ts_free = { "free" };
+static tm_time_stat ts_barrier = { "barrier" };
+
+static unsigned long n_alloc;
+static unsigned long long n_bytes;
+static unsigned long check;
+
+/*! The RSS samples over the second half of the run, in KB. */
+static unsigned long long rss_sum;
+static unsigned long rss_n;
+static long rss_max;
+
+
+/**
+ * Allocate size bytes; not zeroed.
+ */
+static void *b_alloc(size_t size)
+{
+  void *p;
+
+  tm_time_stat_begin(&ts_alloc);
+  p = A->alloc(size);
+  tm_time_stat_end(&ts_alloc);
+
+  if ( ! p ) {
+    fprintf(stderr, "tmbench: %s: out of memory after %lu allocations\n", A->name, n_alloc);
+    exit(2);
+  }
+
+  ++ n_alloc;
+  n_bytes += size;
+
+  return p;
+}
+
+
+/**
+ * Free ptr; with a collector, the caller only drops its references.
+ */
+static void b_free(void *ptr)
+{
+  if ( ! ptr || A->gc )
+    return;
+
+  tm_time_stat_begin(&ts_free);
+  A->free(ptr);
+  tm_time_stat_end(&ts_free);
+}
+
+
+/**
+ * Called after a pointer is stored at slot, in a node or root.
+ */
+static void b_barrier(void *slot)
+{
+  if ( ! A->gc )
+    return;
+
+  tm_time_stat_begin(&ts_barrier);
+  tm_write_barrier(slot);
+  tm_time_stat_end(&ts_barrier);
+}
+
+/*! Store a pointer at slot, followed by its write barrier: SLOT is evaluated twice. */
+#define b_store(SLOT, V) (*(SLOT) = (V), b_barrier(SLOT))
+
+
+/**
+ * Map a zeroed array of n pointers, outside the heap under test.
+ *
+ * With a collector, it is a root.
+ */
+static void *b_table(size_t n)
+{
+  void **p = mmap(0, n * sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED ) {
+    fprintf(stderr, "tmbench: out of memory\n");
+    exit(2);
+  }
+  if ( A->gc ) {
+    tm_root_add("tmbench", p, p + n);
+  }
+
+  return p;
+}
+
+
+/**
+ * Returns the resident set size, in KB.
+ *
+ * Not fopen(): stdio would allocate from the heap under test.
+ */
+static long rss_kb()
+{
+  unsigned long size = 0, resident = 0;
+  char buf[128];
+  ssize_t n;
+  int fd = open("/proc/self/statm", O_RDONLY);
+
+  if ( fd >= 0 ) {
+    if ( (n = read(fd, buf, sizeof(buf) - 1)) > 0 ) {
+      buf[n] = 0;
+      if ( sscanf(buf, "%lu %lu", &size, &resident) != 2 )
+	resident = 0;
+    }
+    close(fd);
+  }
+
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/**
+ * Called after iteration i of n: samples steady RSS over the second half of the run.
+ */
+static void bench_progress(unsigned long i, unsigned long n)
+{
+  unsigned long every = n / 32 ? n / 32 : 1;
+
+  if ( i >= n / 2 && i % every == 0 ) {
+    long kb = rss_kb();
+
+    rss_sum += kb;
+    ++ rss_n;
+    if ( rss_max < kb )
+      rss_max = kb;
+  }
+}
+
+
+/*! The state of a reproducible random number generator: xorshift64. */
+static unsigned long long rnd_state;
+
+/**
+ * Returns a random number in [0, n).
+ */
+static unsigned long rnd(unsigned long n)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return n ? (unsigned long) (rnd_state % n) : 0;
+}
+
+
+/****************************************************************************/
+/* Workloads. */
+
+/*! The workload size multiplier. */
+static int scale = 1;
+
+
+typedef struct tree {
+  struct tree *l, *r;
+} tree;
+
+static tree *tree_make(int depth)
+{
+  tree *t = b_alloc(sizeof(*t));
+
+  t->l = t->r = 0;
+  if ( depth > 0 ) {
+    b_store(&t->l, tree_make(depth - 1));
+    b_store(&t->r, tree_make(depth - 1));
+  }
+
+  return t;
+}
+
+static unsigned long tree_check(tree *t)
+{
+  return t->l ? 1 + tree_check(t->l) + tree_check(t->r) : 1;
+}
+
+static void tree_free(tree *t)
+{
+  if ( t->l ) {
+    tree_free(t->l);
+    tree_free(t->r);
+  }
+  b_free(t);
+}
+
+static void bench_binary_trees()
+{
+  int max_depth = 10 + 2 * scale, depth;
+  unsigned long i, n, done = 0, total = 0;
+  tree *long_lived = tree_make(max_depth);
+
+  for ( depth = 4; depth <= max_depth; depth += 2 ) {
+    total += 1UL << (max_depth - depth + 4);
+  }
+
+  for ( depth = 4; depth <= max_depth; depth += 2 ) {
+    n = 1UL << (max_depth - depth + 4);
+
+    for ( i = 0; i < n; ++ i ) {
+      tree *t = tree_make(depth);
+
+      check += tree_check(t);
+      tree_free(t);
+      bench_progress(done ++, total);
+    }
+  }
+
+  check += tree_check(long_lived);
+  tree_free(long_lived);
+}
+
+
+typedef struct lru_entry {
+  unsigned long key;
+  /*! The next entry in the hash bucket. */
+  struct lru_entry *chain;
+  /*! The LRU list: most recently used first. */
+  struct lru_entry *prev, *next;
+  char *value;
+  size_t size;
+} lru_entry;
+
+static lru_entry *lru_head, *lru_tail;
+
+static void lru_unlink(lru_entry *e)
+{
+  if ( e->prev ) b_store(&e->prev->next, e->next); else b_store(&lru_head, e->next);
+  if ( e->next ) b_store(&e->next->prev, e->prev); else b_store(&lru_tail, e->prev);
+}
+
+static void lru_push(lru_entry *e)
+{
+  b_store(&e->prev, (lru_entry*) 0);
+  b_store(&e->next, lru_head);
+  if ( lru_head ) b_store(&lru_head->prev, e); else b_store(&lru_tail, e);
+  b_store(&lru_head, e);
+}
+
+static void bench_lru()
+{
+  unsigned long capacity = 2048 * scale, nbuckets = capacity * 2;
+  unsigned long i, n = 200000UL * scale, count = 0;
+  lru_entry **buckets = b_table(nbuckets);
+
+  lru_head = lru_tail = 0;
+
+  for ( i = 0; i < n; ++ i ) {
+    /* Skewed: small keys are hot. */
+    unsigned long key = rnd(rnd(capacity * 4) + 1);
+    lru_entry **bp = &buckets[key % nbuckets], *e;
+
+    for ( e = *bp; e && e->key != key; e = e->chain )
+      ;
+
+    if ( e ) {
+      check += e->value[e->size - 1];
+      lru_unlink(e);
+      lru_push(e);
+    } else {
+      e = b_alloc(sizeof(*e));
+      e->key = key;
+      e->size = 16 + rnd(240);
+      e->prev = e->next = 0;
+      e->chain = 0;
+      e->value = 0;
+      b_store(&e->value, (char*) b_alloc(e->size));
+      memset(e->value, (int) key, e->size);
+      b_store(&e->chain, *bp);
+      b_store(bp, e);
+      lru_push(e);
+
+      if ( ++ count > capacity ) {
+	lru_entry *victim = lru_tail, **vp = &buckets[victim->key % nbuckets];
+
+	while ( *vp != victim )
+	  vp = &(*vp)->chain;
+	b_store(vp, victim->chain);
+	lru_unlink(victim);
+	b_free(victim->value);
+	b_free(victim);
+	-- count;
+      }
+    }
+
+    bench_progress(i, n);
+  }
+}
+
+
+typedef struct message {
+  size_t len;
+  unsigned long seq;
+  unsigned char data[1];
+} message;
+
+static void bench_queue()
+{
+  unsigned long qsize = 1024, head = 0, tail = 0;
+  unsigned long i = 0, n = 500000UL * scale, seq = 0;
+  message **q = b_table(qsize);
+
+  while ( i < n ) {
+    unsigned long k;
+
+    /* Produce a burst. */
+    for ( k = rnd(64) + 1; k && head - tail < qsize && i < n; -- k, ++ i ) {
+      size_t len = 32 + rnd(480);
+      message *m = b_alloc(offsetof(message, data) + len);
+
+      m->len = len;
+      m->seq = seq ++;
+      memset(m->data, (int) m->seq, len);
+      b_store(&q[head % qsize], m);
+      ++ head;
+
+      bench_progress(i, n);
+    }
+
+    /* Consume a burst. */
+    for ( k = rnd(64) + 1; k && tail < head; -- k ) {
+      message **mp = &q[tail ++ % qsize];
+      message *m = *mp;
+
+      check += m->seq + m->data[m->len - 1];
+      b_store(mp, (message*) 0);
+      b_free(m);
+    }
+  }
+
+  while ( tail < head ) {
+    b_free(q[tail ++ % qsize]);
+  }
+}
+
+
+typedef struct field {
+  struct field *next;
+  char *key, *value;
+} field;
+
+/*! The number of distinct keys. */
+#define PARSE_KEYS 64
+
+/*! The number of parsed lines kept. */
+#define PARSE_KEEP 64
+
+static char *b_strndup(const char *s, size_t len)
+{
+  char *p = b_alloc(len + 1);
+
+  memcpy(p, s, len);
+  p[len] = 0;
+
+  return p;
+}
+
+static void parse_free(field *f)
+{
+  while ( f ) {
+    field *next = f->next;
+
+    b_free(f->value);
+    b_free(f);
+    f = next;
+  }
+}
+
+static void bench_parse()
+{
+  unsigned long i, n = 20000UL * scale;
+  char **interned = b_table(PARSE_KEYS);
+  field **kept = b_table(PARSE_KEEP);
+  char line[2048];
+
+  for ( i = 0; i < n; ++ i ) {
+    field *list = 0, **fp;
+    char *s, *e;
+    int j, len = 0;
+
+    /* Generate a line. */
+    for ( j = rnd(24) + 4; j; -- j ) {
+      unsigned long k = rnd(PARSE_KEYS);
+
+      len += snprintf(line + len, sizeof(line) - len, "key%lu=%lu%s;",
+		      k, rnd(1000000000), rnd(4) ? "" : "-some-longer-value-text");
+    }
+
+    /* Split it into a list of fields. */
+    for ( s = line; (e = strchr(s, ';')); s = e + 1 ) {
+      char *eq = memchr(s, '=', e - s), *key;
+      field *f;
+      int k;
+
+      f = b_alloc(sizeof(*f));
+      f->next = 0;
+      f->key = f->value = 0;
+      b_store(&f->next, list);
+      b_store(&list, f);
+
+      /* Intern the key. */
+      k = atoi(s + 3);
+      if ( ! interned[k] ) {
+	key = b_strndup(s, eq - s);
+	b_store(&interned[k], key);
+      }
+      b_store(&f->key, interned[k]);
+      b_store(&f->value, b_strndup(eq + 1, e - eq - 1));
+    }
+
+    /* Use it. */
+    for ( fp = &list; *fp; fp = &(*fp)->next ) {
+      check += strlen((*fp)->key) + strlen((*fp)->value);
+    }
+
+    /* Keep it for a while. */
+    parse_free(kept[i % PARSE_KEEP]);
+    b_store(&kept[i % PARSE_KEEP], list);
+
+    bench_progress(i, n);
+  }
+
+  for ( i = 0; i < PARSE_KEEP; ++ i ) {
+    parse_free(kept[i]);
+  }
+  for ( i = 0; i < PARSE_KEYS; ++ i ) {
+    b_free(interned[i]);
+  }
+}
+
+
+/*! The number of large array slots. */
+#define ARRAY_SLOTS 64
+
+static void bench_arrays()
+{
+  /* tredmill rounds sizes above tm_block_SIZE_MAX / 2 up to a power of two larger than a tm_block. */
+  size_t size_max = tm_block_SIZE_MAX / 2, size_min = size_max / 4;
+  unsigned long i, n = 20000UL * scale;
+  char **slots = b_table(ARRAY_SLOTS);
+
+  for ( i = 0; i < n; ++ i ) {
+    char **sp = &slots[rnd(ARRAY_SLOTS)];
+    size_t size = size_min + rnd(size_max - size_min + 1);
+
+    b_free(*sp);
+    b_store(sp, (char*) b_alloc(size));
+    memset(*sp, (int) i & 0x7f, size);
+    check += (*sp)[size - 1];
+
+    bench_progress(i, n);
+  }
+
+  for ( i = 0; i < ARRAY_SLOTS; ++ i ) {
+    b_free(slots[i]);
+  }
+}
+
+
+static const struct bench_workload {
+  const char *name;
+  void (*run)();
+} bench_workloads[] = {
+  { "binary-trees", bench_binary_trees },
+  { "lru", bench_lru },
+  { "queue", bench_queue },
+  { "parse", bench_parse },
+  { "arrays", bench_arrays },
+  { 0 }
+};
+
+
+/****************************************************************************/
+/* Runs. */
+
+static double now()
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static double cpu_time(const struct rusage *ru)
+{
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec * 1e-6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec * 1e-6;
+}
+
+
+/**
+ * Run a workload with an allocator, in this process.
+ */
+static void bench_run(const struct bench_workload *w, const bench_allocator *a, unsigned long long seed,
+		      int *argcp, char ***argvp, char ***envpp)
+{
+  struct rusage ru0, ru1;
+  double t0, t1, mm;
+  long peak;
+
+  A = a;
+  rnd_state = seed ? seed : 1;
+
+  if ( A->gc ) {
+    tm_init(argcp, argvp, envpp);
+  } else {
+    tm_time_stat_init();
+  }
+
+  getrusage(RUSAGE_SELF, &ru0);
+  t0 = now();
+
+  w->run();
+
+  t1 = now();
+  getrusage(RUSAGE_SELF, &ru1);
+
+  mm = ts_alloc.ts + ts_free.ts + ts_barrier.ts;
+
+  /* ru_maxrss is only updated from time to time. */
+  peak = rss_kb();
+  if ( peak < ru1.ru_maxrss )
+    peak = ru1.ru_maxrss;
+  if ( rss_n && peak < rss_max )
+    peak = rss_max;
+
+  printf("%-13s %-7s %10lu %12.0f %9.1f %8.2f %8.2f %8.2f %10.2f %10ld %10lu %6.1f %6lu %10lu\n",
+	 w->name,
+	 A->name,
+	 n_alloc,
+	 n_alloc / (t1 - t0),
+	 n_bytes / (t1 - t0) / (1024 * 1024),
+	 tm_time_stat_percentile(&ts_alloc, 0.50) * 1e6,
+	 tm_time_stat_percentile(&ts_alloc, 0.99) * 1e6,
+	 tm_time_stat_percentile(&ts_alloc, 0.999) * 1e6,
+	 ts_alloc.tw * 1e6,
+	 peak,
+	 rss_n ? (unsigned long) (rss_sum / rss_n) : 0UL,
+	 100.0 * mm / (cpu_time(&ru1) - cpu_time(&ru0)),
+	 A->gc ? (unsigned long) tm.colors.flip_id : 0UL,
+	 check);
+  fflush(stdout);
+}
+
+
+int main(int argc, char **argv, char **envp)
+{
+  const struct bench_workload *w;
+  const bench_allocator *a;
+  const char *only = 0;
+  unsigned long long seed = 1;
+  int c, status = 0;
+
+  while ( (c = getopt(argc, argv, "n:s:a:")) != -1 ) {
+    switch ( c ) {
+    case 'n': scale = atoi(optarg); break;
+    case 's': seed = strtoull(optarg, 0, 0); break;
+    case 'a': only = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-n scale] [-s seed] [-a tm|malloc] [workload ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if ( scale < 1 )
+    scale = 1;
+
+  printf("# tmbench: scale %d, seed %llu\n", scale, seed);
+  printf("%-13s %-7s %10s %12s %9s %8s %8s %8s %10s %10s %10s %6s %6s %10s\n",
+	 "workload", "alloc", "allocs", "allocs/s", "MB/s",
+	 "p50us", "p99us", "p999us", "worstus",
+	 "peakKB", "steadyKB", "mm%", "flips", "check");
+  fflush(stdout);
+
+  for ( w = bench_workloads; w->name; ++ w ) {
+    if ( optind < argc ) {
+      int i;
+
+      for ( i = optind; i < argc && strcmp(argv[i], w->name); ++ i )
+	;
+      if ( i == argc )
+	continue;
+    }
+
+    for ( a = bench_allocators; a->name; ++ a ) {
+      pid_t pid;
+      int s;
+
+      if ( only && strcmp(only, a->name) )
+	continue;
+
+      /* Each run in a fresh process. */
+      if ( (pid = fork()) == 0 ) {
+	bench_run(w, a, seed, &argc, &argv, &envp);
+	_exit(0);
+      }
+      if ( pid < 0 || waitpid(pid, &s, 0) != pid || ! WIFEXITED(s) || WEXITSTATUS(s) ) {
+	fprintf(stderr, "tmbench: %s %s: failed\n", w->name, a->name);
+	status = 1;
+      }
+    }
+  }
+
+  return status;
+}
+
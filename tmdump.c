@@ -0,0 +1,634 @@
+/** \file tmdump.c
+ * \brief Heap dump analyzer.
+ *
+ * Usage:
+ *
+ *   tmdump [-n N] dump
+ *
+ * Reports, for each tm_type, the number and bytes of allocated nodes,
+ * and the bytes they retain: the bytes of the nodes they dominate,
+ * not counting nodes dominated by another node of the same tm_type.
+ * Then reports the N nodes retaining the most bytes (default 20).
+ *
+ * Node A dominates node B if every path from the roots to B goes through A.
+ * Nodes not reachable from the dumped roots are only reachable from root callbacks,
+ * or are garbage not yet collected: they are treated as roots.
+ *
+ *   tmdump [-n N] dump1 dump2
+ *
+ * Reports the growth of each tm_type from dump1 to dump2,
+ * which must be dumped by the same process.
+ *
+ * Dumps are memory-mapped, not read: tmdump is built 64-bit to map multi-gigabyte dumps.
+ * See dump.h for the dump format, and dump.c.
+ */
+#include "tredmill/dump.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/****************************************************************************/
+/* Dumps. */
+
+/*! A tm_type in a dump. */
+typedef struct dump_type {
+  /*! The tm_type id. */
+  int id;
+  /*! The node size. */
+  tm_dump_word size;
+  /*! The number of allocated nodes. */
+  tm_dump_word nodes;
+  /*! The bytes of allocated nodes. */
+  tm_dump_word bytes;
+  /*! The bytes retained by nodes of this tm_type. */
+  tm_dump_word retained;
+} dump_type;
+
+
+/*! A memory-mapped dump. */
+typedef struct dump {
+  const char *path;
+  const char *p;
+  size_t size;
+  const tm_dump_header *h;
+
+  /*! The tm_types, indexed by tm_type id. */
+  dump_type *types;
+  int types_n;
+
+  /*! The nodes: vertex 0 is the virtual root; nodes are vertices 1 .. nodes_n. */
+  size_t nodes_n;
+  tm_dump_word *addr;
+  tm_dump_word *node_size;
+  int *node_type;
+  const tm_dump_record **node_r;
+
+  /*! The nodes, sorted by address. */
+  unsigned int *by_addr;
+
+  /*! The root records. */
+  const tm_dump_record **roots;
+  size_t roots_n;
+} dump;
+
+
+static void *xmalloc(size_t size)
+{
+  void *p = malloc(size ? size : 1);
+
+  if ( ! p ) {
+    fprintf(stderr, "tmdump: out of memory\n");
+    exit(2);
+  }
+
+  return p;
+}
+
+#define xnew(T, N) ((T*) xmalloc(sizeof(T) * (N)))
+
+
+/*! The edges following a record. */
+#define dump_edges(r) ((const tm_dump_word*) ((r) + 1))
+
+/*! The record after r. */
+#define dump_next(r) ((const tm_dump_record*) (dump_edges(r) + (r)->n))
+
+
+static const tm_dump_word *by_addr_addr;
+
+static int by_addr_cmp(const void *a, const void *b)
+{
+  tm_dump_word x = by_addr_addr[* (const unsigned int*) a];
+  tm_dump_word y = by_addr_addr[* (const unsigned int*) b];
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/**
+ * Returns the vertex of the node at address a, or 0.
+ */
+static unsigned int dump_vertex(const dump *d, tm_dump_word a)
+{
+  size_t lo = 0, hi = d->nodes_n;
+
+  while ( lo < hi ) {
+    size_t mid = lo + (hi - lo) / 2;
+    tm_dump_word x = d->addr[d->by_addr[mid]];
+
+    if ( x == a )
+      return d->by_addr[mid];
+    if ( x < a ) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * Map and index a dump.
+ */
+static void dump_open(dump *d, const char *path)
+{
+  const tm_dump_record *r, *end;
+  struct stat st;
+  size_t n_roots = 0, i;
+  int fd, max_id = -1;
+
+  memset(d, 0, sizeof(*d));
+  d->path = path;
+
+  if ( (fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) ) {
+    perror(path);
+    exit(1);
+  }
+  d->size = st.st_size;
+  if ( d->size != st.st_size ) {
+    fprintf(stderr, "tmdump: %s: too large to map\n", path);
+    exit(1);
+  }
+  if ( d->size < sizeof(tm_dump_header) ||
+       (d->p = mmap(0, d->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ) {
+    fprintf(stderr, "tmdump: %s: cannot map\n", path);
+    exit(1);
+  }
+  close(fd);
+
+  d->h = (const tm_dump_header*) d->p;
+  if ( memcmp(d->h->magic, tm_dump_MAGIC, sizeof(d->h->magic)) || d->h->version != tm_dump_VERSION ) {
+    fprintf(stderr, "tmdump: %s: not a heap dump\n", path);
+    exit(1);
+  }
+
+  /* Count: every record and its edges must be within the dump. */
+  end = (const tm_dump_record*) (d->p + d->size);
+  for ( r = (const tm_dump_record*) (d->h + 1); r + 1 <= end && r->tag != tm_dump_END; r = dump_next(r) ) {
+    if ( r->n > (size_t) ((const tm_dump_word*) end - dump_edges(r)) )
+      break;
+    switch ( r->tag ) {
+    case tm_dump_TYPE:
+      if ( (int) r->a > max_id )
+	max_id = r->a;
+      break;
+    case tm_dump_NODE:
+      ++ d->nodes_n;
+      break;
+    case tm_dump_ROOT:
+      ++ n_roots;
+      break;
+    }
+  }
+  if ( r + 1 > end || r->tag != tm_dump_END ) {
+    fprintf(stderr, "tmdump: %s: truncated\n", path);
+    exit(1);
+  }
+
+  d->types_n = max_id + 1;
+  d->types = xnew(dump_type, d->types_n);
+  memset(d->types, 0, sizeof(d->types[0]) * d->types_n);
+  for ( i = 0; i < d->types_n; ++ i )
+    d->types[i].id = -1;
+
+  d->addr = xnew(tm_dump_word, d->nodes_n + 1);
+  d->node_size = xnew(tm_dump_word, d->nodes_n + 1);
+  d->node_type = xnew(int, d->nodes_n + 1);
+  d->node_r = xnew(const tm_dump_record*, d->nodes_n + 1);
+  d->roots = xnew(const tm_dump_record*, n_roots);
+  d->addr[0] = d->node_size[0] = 0;
+  d->node_type[0] = -1;
+  d->node_r[0] = 0;
+
+  /* Index. */
+  d->nodes_n = 0;
+  for ( r = (const tm_dump_record*) (d->h + 1); r + 1 <= end && r->tag != tm_dump_END; r = dump_next(r) ) {
+    switch ( r->tag ) {
+    case tm_dump_TYPE:
+      d->types[r->a].id = r->a;
+      d->types[r->a].size = r->b;
+      break;
+    case tm_dump_NODE: {
+      size_t v = ++ d->nodes_n;
+      dump_type *t = &d->types[r->c];
+
+      d->addr[v] = r->a;
+      d->node_size[v] = r->b;
+      d->node_type[v] = r->c;
+      d->node_r[v] = r;
+      ++ t->nodes;
+      t->bytes += r->b;
+    }
+      break;
+    case tm_dump_ROOT:
+      d->roots[d->roots_n ++] = r;
+      break;
+    }
+  }
+
+  d->by_addr = xnew(unsigned int, d->nodes_n);
+  for ( i = 0; i < d->nodes_n; ++ i )
+    d->by_addr[i] = i + 1;
+  by_addr_addr = d->addr;
+  qsort(d->by_addr, d->nodes_n, sizeof(d->by_addr[0]), by_addr_cmp);
+}
+
+
+/****************************************************************************/
+/* Dominators. */
+
+/*! A graph in compressed sparse row form. */
+typedef struct graph {
+  size_t *begin;
+  unsigned int *v;
+} graph;
+
+
+/**
+ * Returns the successor graph of a dump's nodes.
+ * The virtual root's successors are the nodes referenced by roots.
+ */
+static void dump_succ(const dump *d, graph *g)
+{
+  size_t n = d->nodes_n + 1, e = 0, v, i;
+
+  g->begin = xnew(size_t, n + 1);
+
+  for ( i = 0; i < d->roots_n; ++ i )
+    e += d->roots[i]->n;
+  for ( v = 1; v < n; ++ v )
+    e += d->node_r[v]->n;
+  g->v = xnew(unsigned int, e);
+
+  e = 0;
+  for ( v = 0; v < n; ++ v ) {
+    g->begin[v] = e;
+    if ( v == 0 ) {
+      for ( i = 0; i < d->roots_n; ++ i ) {
+	const tm_dump_word *w = dump_edges(d->roots[i]);
+	unsigned int j, x;
+
+	for ( j = 0; j < d->roots[i]->n; ++ j )
+	  if ( (x = dump_vertex(d, w[j])) )
+	    g->v[e ++] = x;
+      }
+    } else {
+      const tm_dump_word *w = dump_edges(d->node_r[v]);
+      unsigned int j, x;
+
+      for ( j = 0; j < d->node_r[v]->n; ++ j )
+	if ( (x = dump_vertex(d, w[j])) )
+	  g->v[e ++] = x;
+    }
+  }
+  g->begin[n] = e;
+}
+
+
+/**
+ * Depth-first search from v, numbering vertices in postorder.
+ */
+static void dfs(const graph *g, unsigned int v, unsigned int *po, unsigned int *post, size_t *post_n,
+		unsigned int *stack, size_t *pos)
+{
+  size_t sp = 0;
+
+  po[v] = (unsigned int) -2;
+  stack[sp] = v;
+  pos[sp] = g->begin[v];
+  ++ sp;
+
+  while ( sp ) {
+    unsigned int u = stack[sp - 1];
+
+    if ( pos[sp - 1] < g->begin[u + 1] ) {
+      unsigned int x = g->v[pos[sp - 1] ++];
+
+      if ( po[x] == (unsigned int) -1 ) {
+	po[x] = (unsigned int) -2;
+	stack[sp] = x;
+	pos[sp] = g->begin[x];
+	++ sp;
+      }
+    } else {
+      po[u] = *post_n;
+      post[(*post_n) ++] = u;
+      -- sp;
+    }
+  }
+}
+
+
+/**
+ * Compute the immediate dominators of a dump's nodes,
+ * with the Cooper, Harvey and Kennedy iterative algorithm.
+ *
+ * Unreached nodes become successors of the virtual root.
+ * Returns the postorder in post; idom[0] == 0.
+ */
+static void dump_dominators(const dump *d, unsigned int *idom, unsigned int *post)
+{
+  size_t n = d->nodes_n + 1, post_n = 0, v, i, e;
+  unsigned int *po = xnew(unsigned int, n);
+  unsigned int *stack = xnew(unsigned int, n);
+  size_t *pos = xnew(size_t, n);
+  size_t *pred_begin;
+  unsigned int *pred, *unreached;
+  size_t unreached_n = 0;
+  graph g;
+  int changed;
+
+  dump_succ(d, &g);
+
+  for ( v = 0; v < n; ++ v )
+    po[v] = (unsigned int) -1;
+  dfs(&g, 0, po, post, &post_n, stack, pos);
+
+  /* Unreached nodes are successors of the virtual root: search each, and renumber the root last. */
+  unreached = xnew(unsigned int, n);
+  for ( v = 1; v < n; ++ v ) {
+    if ( po[v] == (unsigned int) -1 ) {
+      unreached[unreached_n ++] = v;
+      dfs(&g, v, po, post, &post_n, stack, pos);
+    }
+  }
+  for ( i = po[0]; i + 1 < post_n; ++ i ) {
+    post[i] = post[i + 1];
+    po[post[i]] = i;
+  }
+  post[post_n - 1] = 0;
+  po[0] = post_n - 1;
+
+  /* Predecessors. */
+  pred_begin = xnew(size_t, n + 1);
+  memset(pred_begin, 0, sizeof(pred_begin[0]) * (n + 1));
+  for ( e = 0; e < g.begin[n]; ++ e )
+    ++ pred_begin[g.v[e] + 1];
+  for ( i = 0; i < unreached_n; ++ i )
+    ++ pred_begin[unreached[i] + 1];
+  for ( v = 0; v < n; ++ v )
+    pred_begin[v + 1] += pred_begin[v];
+  pred = xnew(unsigned int, pred_begin[n]);
+  memcpy(pos, pred_begin, sizeof(pos[0]) * n);
+  for ( v = 0; v < n; ++ v )
+    for ( e = g.begin[v]; e < g.begin[v + 1]; ++ e )
+      pred[pos[g.v[e]] ++] = v;
+  for ( i = 0; i < unreached_n; ++ i )
+    pred[pos[unreached[i]] ++] = 0;
+
+  for ( v = 0; v < n; ++ v )
+    idom[v] = (unsigned int) -1;
+  idom[0] = 0;
+
+  do {
+    changed = 0;
+
+    /* Reverse postorder, skipping the root. */
+    for ( i = post_n - 1; i -- > 0; ) {
+      unsigned int b = post[i], new_idom = (unsigned int) -1;
+
+      for ( e = pred_begin[b]; e < pred_begin[b + 1]; ++ e ) {
+	unsigned int p = pred[e];
+
+	if ( idom[p] == (unsigned int) -1 )
+	  continue;
+
+	if ( new_idom == (unsigned int) -1 ) {
+	  new_idom = p;
+	} else {
+	  unsigned int f1 = p, f2 = new_idom;
+
+	  while ( f1 != f2 ) {
+	    while ( po[f1] < po[f2] )
+	      f1 = idom[f1];
+	    while ( po[f2] < po[f1] )
+	      f2 = idom[f2];
+	  }
+	  new_idom = f1;
+	}
+      }
+
+      if ( idom[b] != new_idom ) {
+	idom[b] = new_idom;
+	changed = 1;
+      }
+    }
+  } while ( changed );
+
+  free(g.begin);
+  free(g.v);
+  free(pred_begin);
+  free(pred);
+  free(unreached);
+  free(po);
+  free(stack);
+  free(pos);
+}
+
+
+/**
+ * Compute the bytes retained by each node, and by each tm_type.
+ */
+static void dump_retained(dump *d, const unsigned int *idom, const unsigned int *post, tm_dump_word *retained)
+{
+  size_t n = d->nodes_n + 1, v, i;
+  size_t *child_begin = xnew(size_t, n + 1);
+  unsigned int *child = xnew(unsigned int, n);
+  unsigned int *stack = xnew(unsigned int, n);
+  size_t *pos = xnew(size_t, n);
+  size_t *active = xnew(size_t, d->types_n);
+  size_t sp = 0;
+
+  /* Postorder visits dominated nodes first. */
+  for ( v = 0; v < n; ++ v )
+    retained[v] = d->node_size[v];
+  for ( i = 0; i < n; ++ i ) {
+    v = post[i];
+    if ( v )
+      retained[idom[v]] += retained[v];
+  }
+
+  /* The dominator tree. */
+  memset(child_begin, 0, sizeof(child_begin[0]) * (n + 1));
+  for ( v = 1; v < n; ++ v )
+    ++ child_begin[idom[v] + 1];
+  for ( v = 0; v < n; ++ v )
+    child_begin[v + 1] += child_begin[v];
+  memcpy(pos, child_begin, sizeof(pos[0]) * n);
+  for ( v = 1; v < n; ++ v )
+    child[pos[idom[v]] ++] = v;
+
+  /* A node retains for its tm_type unless dominated by a node of the same tm_type. */
+  memset(active, 0, sizeof(active[0]) * d->types_n);
+  stack[sp] = 0;
+  pos[sp] = child_begin[0];
+  ++ sp;
+  while ( sp ) {
+    unsigned int u = stack[sp - 1];
+
+    if ( pos[sp - 1] < child_begin[u + 1] ) {
+      unsigned int x = child[pos[sp - 1] ++];
+      int t = d->node_type[x];
+
+      if ( ! active[t] ++ )
+	d->types[t].retained += retained[x];
+      stack[sp] = x;
+      pos[sp] = child_begin[x];
+      ++ sp;
+    } else {
+      if ( u )
+	-- active[d->node_type[u]];
+      -- sp;
+    }
+  }
+
+  free(child_begin);
+  free(child);
+  free(stack);
+  free(pos);
+  free(active);
+}
+
+
+/****************************************************************************/
+/* Reports. */
+
+static const tm_dump_word *retained_by;
+
+static int retained_cmp(const void *a, const void *b)
+{
+  tm_dump_word x = retained_by[* (const unsigned int*) a];
+  tm_dump_word y = retained_by[* (const unsigned int*) b];
+
+  return x > y ? -1 : x < y ? 1 : 0;
+}
+
+
+static int growth_cmp(const void *a, const void *b)
+{
+  const long long *x = a, *y = b;
+
+  return x[1] > y[1] ? -1 : x[1] < y[1] ? 1 : 0;
+}
+
+
+static void report(dump *d, int top)
+{
+  size_t n = d->nodes_n + 1, i;
+  unsigned int *idom = xnew(unsigned int, n);
+  unsigned int *post = xnew(unsigned int, n);
+  unsigned int *order = xnew(unsigned int, n);
+  tm_dump_word *retained = xnew(tm_dump_word, n);
+  const char *colors = "WEGB";
+  int t;
+
+  dump_dominators(d, idom, post);
+  dump_retained(d, idom, post, retained);
+
+  printf("%s: flip %llu, %lu nodes, %lu roots\n",
+	 d->path, d->h->flip_id, (unsigned long) d->nodes_n, (unsigned long) d->roots_n);
+
+  printf("%6s %10s %12s %14s %14s\n", "type", "size", "nodes", "bytes", "retained");
+  for ( t = 0; t < d->types_n; ++ t ) {
+    if ( d->types[t].id < 0 || ! d->types[t].nodes )
+      continue;
+    printf("%6d %10llu %12llu %14llu %14llu\n",
+	   t, d->types[t].size, d->types[t].nodes, d->types[t].bytes, d->types[t].retained);
+  }
+  printf("%6s %10s %12lu %14llu\n", "total", "", (unsigned long) d->nodes_n, retained[0]);
+
+  for ( i = 1; i < n; ++ i )
+    order[i - 1] = i;
+  retained_by = retained;
+  qsort(order, n - 1, sizeof(order[0]), retained_cmp);
+
+  printf("\n%-18s %6s %5s %10s %14s %-18s\n", "dominator", "type", "color", "size", "retained", "idom");
+  for ( i = 0; i < n - 1 && i < top; ++ i ) {
+    unsigned int v = order[i];
+
+    printf("0x%016llx %6d %5c %10llu %14llu ",
+	   d->addr[v], d->node_type[v], colors[d->node_r[v]->color & 3], d->node_size[v], retained[v]);
+    if ( idom[v] ) {
+      printf("0x%016llx\n", d->addr[idom[v]]);
+    } else {
+      printf("root\n");
+    }
+  }
+
+  free(idom);
+  free(post);
+  free(order);
+  free(retained);
+}
+
+
+static void report_growth(dump *a, dump *b, int top)
+{
+  int n = a->types_n > b->types_n ? a->types_n : b->types_n;
+  long long (*g)[4] = xmalloc(sizeof(g[0]) * n);
+  int i, m = 0;
+
+  for ( i = 0; i < n; ++ i ) {
+    const dump_type *x = i < a->types_n && a->types[i].id >= 0 ? &a->types[i] : 0;
+    const dump_type *y = i < b->types_n && b->types[i].id >= 0 ? &b->types[i] : 0;
+
+    if ( ! x && ! y )
+      continue;
+    g[m][0] = i;
+    g[m][1] = (long long) (y ? y->bytes : 0) - (long long) (x ? x->bytes : 0);
+    g[m][2] = (long long) (y ? y->nodes : 0) - (long long) (x ? x->nodes : 0);
+    g[m][3] = y ? y->bytes : 0;
+    ++ m;
+  }
+
+  qsort(g, m, sizeof(g[0]), growth_cmp);
+
+  printf("%s -> %s: flip %llu -> %llu\n", a->path, b->path, a->h->flip_id, b->h->flip_id);
+  printf("%6s %14s %12s %14s\n", "type", "+bytes", "+nodes", "bytes");
+  for ( i = 0; i < m && i < top; ++ i ) {
+    printf("%6lld %+14lld %+12lld %14lld\n", g[i][0], g[i][1], g[i][2], g[i][3]);
+  }
+
+  free(g);
+}
+
+
+int main(int argc, char **argv)
+{
+  int argi = 1;
+  int top = 20;
+  dump a, b;
+
+  if ( argi + 1 < argc && ! strcmp(argv[argi], "-n") ) {
+    top = atoi(argv[argi + 1]);
+    argi += 2;
+  }
+
+  switch ( argc - argi ) {
+  case 1:
+    dump_open(&a, argv[argi]);
+    report(&a, top);
+    break;
+
+  case 2:
+    dump_open(&a, argv[argi]);
+    dump_open(&b, argv[argi + 1]);
+    report_growth(&a, &b, top);
+    break;
+
+  default:
+    fprintf(stderr, "usage: %s [-n N] dump [dump2]\n", argv[0]);
+    return 1;
+  }
+
+  return 0;
+}
+
@@ -7,6 +7,11 @@
 
 #include "internal.h" /* tm_abort() */
 
+#include <unistd.h> /* fork() */
+#include <sys/wait.h> /* waitpid() */
+
+#include "dump.h" /* tm_dump_header */
+
 
 static int nalloc = 1000;
 static int nsize = 100;
@@ -566,6 +571,322 @@ static void test10()
 
 
 
+
+static int my_finalized = 0;
+
+static void my_finalizer(void *ptr, void *data)
+{
+  my_cons *c = ptr;
+
+  tm_assert(c->cdr == data);
+  ++ my_finalized;
+}
+
+
+/* Finalizers run after nodes become unreachable, outside of tm_alloc(). */
+static void test11()
+{
+  int n = 100;
+  int i, j;
+  size_t queued;
+
+  my_finalized = 0;
+  for ( i = 0; i < n; ++ i ) {
+    my_cons *c = my_cons_(0, 0);
+
+    c->cdr = my_int(i);
+    tm_write_barrier_pure(c);
+    tm_assert(tm_register_finalizer(c, my_finalizer, c->cdr));
+  }
+
+  /* Allocate garbage until all nodes are queued. */
+  for ( j = 0; j < 100 && my_finalized < n; ++ j ) {
+    for ( i = 0; i < nalloc; ++ i ) {
+      my_cons_(0, nsize);
+      /* Finalizers never run within tm_alloc(). */
+      tm_assert(my_finalized == tm.finalize_run);
+    }
+    queued = tm.finalize_queue.n;
+    tm_assert(tm_run_finalizers() == queued);
+  }
+
+  end_test();
+
+  /* Conservative scanning may retain a few nodes. */
+  tm_msg("* test11: %d of %d finalized\n", my_finalized, n);
+  tm_assert(my_finalized > n / 2);
+}
+
+
+
+
+static my_cons *my_strong[100];
+
+/* Weak references and weak-keyed tables are cleared when their targets become unreachable. */
+static void test12()
+{
+  int n = sizeof(my_strong) / sizeof(my_strong[0]);
+  tm_weak_ref *weak[sizeof(my_strong) / sizeof(my_strong[0])];
+  static tm_weak_table *table;
+  int i, j, cleared;
+
+  table = tm_weak_table_new(0);
+  for ( i = 0; i < n; ++ i ) {
+    my_strong[i] = my_cons_(0, 0);
+    weak[i] = tm_weak_ref_new(my_strong[i]);
+    tm_assert(tm_weak_table_put(table, my_strong[i], my_int(i)));
+  }
+  tm_assert(tm_weak_table_count(table) == n);
+
+  /* Drop the odd strong references. */
+  for ( i = 1; i < n; i += 2 ) {
+    my_strong[i] = 0;
+  }
+
+  /* Allocate garbage until weak references are cleared. */
+  for ( j = 0; j < 100 && tm_weak_table_count(table) > n / 2; ++ j ) {
+    for ( i = 0; i < nalloc; ++ i ) {
+      my_cons_(0, nsize);
+    }
+  }
+
+  cleared = 0;
+  for ( i = 0; i < n; ++ i ) {
+    void *p = tm_weak_ref_get(weak[i]);
+
+    if ( i % 2 == 0 ) {
+      /* Strongly referenced targets are never cleared. */
+      tm_assert(p == my_strong[i]);
+      tm_assert(tm_weak_table_get(table, p) == my_int(i));
+    } else if ( ! p ) {
+      ++ cleared;
+    }
+  }
+
+  end_test();
+
+  /* Conservative scanning may retain a few nodes. */
+  tm_msg("* test12: %d of %d cleared, %lu entries\n", cleared, n / 2, (unsigned long) tm_weak_table_count(table));
+  tm_assert(cleared > n / 4);
+  tm_assert(tm_weak_table_count(table) <= n - cleared);
+
+  memset(my_strong, 0, sizeof(my_strong));
+  table = 0;
+}
+
+
+
+/* The collector is suspended in a child process for its first allocations after fork(). */
+static void test13()
+{
+  my_cons *list = 0;
+  int i, status;
+  pid_t pid;
+
+  for ( i = 0; i < nalloc; ++ i ) {
+    list = my_cons_(list, 0);
+  }
+
+  pid = fork();
+  tm_assert(pid >= 0);
+
+  if ( pid == 0 ) {
+    long n = tm_fork_child_delay / 2;
+    my_cons *c;
+
+    /* Nothing is left to mark: tm_atfork_prepare() finished marking. */
+    tm_assert(tm.n[GREY] == 0);
+    tm_assert(tm.fork_delay == tm_fork_child_delay);
+
+    for ( i = 0; i < n; ++ i ) {
+      tm_alloc(nsize);
+      tm_assert(tm.n[GREY] == 0);
+    }
+    tm_assert(tm.fork_delay == tm_fork_child_delay - n);
+
+    for ( i = 0, c = list; c; c = c->cdr ) {
+      ++ i;
+    }
+    tm_assert(i == nalloc);
+
+    _exit(0);
+  }
+
+  tm_assert(waitpid(pid, &status, 0) == pid);
+  tm_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  tm_assert(tm.fork_delay == 0);
+
+  end_test();
+
+  list = 0;
+}
+
+
+
+/* A heap dump records every allocated node. */
+static void test14()
+{
+  my_cons *list = 0;
+  FILE *fp = tmpfile();
+  tm_dump_header h;
+  tm_dump_record end;
+  long long size;
+  size_t allocated = 0;
+  tm_type *t;
+  int i;
+
+  for ( i = 0; i < nalloc; ++ i ) {
+    list = my_cons_(list, 0);
+  }
+
+  tm_assert(fp);
+  size = tm_heap_dump(fileno(fp));
+  tm_assert(size >= (long long) (sizeof(h) + sizeof(end)));
+
+  tm_list_LOOP(&tm.types, t) {
+    allocated += t->n[tm_TOTAL] - t->n[WHITE];
+  }
+  tm_list_LOOP_END;
+
+  tm_assert(pread(fileno(fp), &h, sizeof(h), 0) == sizeof(h));
+  tm_assert(memcmp(h.magic, tm_dump_MAGIC, sizeof(h.magic)) == 0);
+  tm_assert(h.version == tm_dump_VERSION);
+
+  tm_assert(pread(fileno(fp), &end, sizeof(end), size - sizeof(end)) == sizeof(end));
+  tm_assert(end.tag == tm_dump_END);
+  tm_assert(end.c == allocated);
+  tm_assert(end.c >= nalloc);
+
+  fclose(fp);
+
+  end_test();
+
+  list = 0;
+}
+
+
+
+/* Every timed call is counted in its histogram. */
+static void test15()
+{
+  unsigned long n = 0;
+  double p50, p99;
+  int i;
+
+  for ( i = 0; i < nalloc; ++ i ) {
+    my_cons_(0, nsize);
+  }
+
+  for ( i = 0; i < tm_time_stat_HIST_N; ++ i ) {
+    n += tm.ts_alloc.hist[i];
+  }
+  tm_assert(n == tm.ts_alloc.count);
+
+  p50 = tm_time_stat_percentile(&tm.ts_alloc, 0.50);
+  p99 = tm_time_stat_percentile(&tm.ts_alloc, 0.99);
+  tm_assert(0 < p50 && p50 <= p99 && p99 <= tm.ts_alloc.tw);
+
+  end_test();
+
+  tm_print_time_stats();
+  tm_print_time_histograms();
+}
+
+
+
+/* Statistics snapshots serialize to JSON. */
+static void test16()
+{
+  static tm_stats s;
+  static char json[64 * 1024];
+  char small[16];
+  size_t len;
+  int i;
+
+  for ( i = 0; i < nalloc; ++ i ) {
+    my_cons_(0, nsize);
+  }
+
+  tm_stats_snapshot(&s);
+  tm_assert(s.n[tm_TOTAL] == tm.n[tm_TOTAL]);
+  tm_assert(s.n[tm_NU] == tm.n[tm_TOTAL] - tm.n[WHITE]);
+  tm_assert(s.types_n == s.types_total && s.types_n > 0);
+  tm_assert(s.ts_alloc.count == tm.ts_alloc.count);
+
+  len = tm_stats_json(&s, json, sizeof(json));
+  tm_assert(len < sizeof(json) && strlen(json) == len);
+  tm_assert(json[0] == '{' && json[len - 1] == '}');
+
+  /* Like snprintf(), a short buffer is truncated, but the full length is returned. */
+  tm_assert(tm_stats_json(&s, small, sizeof(small)) == len);
+  tm_assert(strlen(small) == sizeof(small) - 1);
+
+  end_test();
+
+  tm_msg("* test16: %lu bytes of JSON\n", (unsigned long) len);
+}
+
+
+
+/* Allocate garbage until the colors flip n times. */
+static void my_flip(int n)
+{
+  int i;
+
+  while ( n -- > 0 ) {
+    unsigned long flip_id = tm.colors.flip_id;
+
+    for ( i = 0; i < 100 * nalloc && tm.colors.flip_id == flip_id; ++ i ) {
+      my_cons_(0, nsize);
+    }
+    tm_assert(tm.colors.flip_id != flip_id);
+  }
+}
+
+
+/* Removing a weak-keyed table entry during marking keeps the rest of its bucket. */
+static void test17()
+{
+  static tm_weak_table *table;
+  my_cons *value;
+  int i, round;
+
+  for ( round = 0; round < 10; ++ round ) {
+    /* One bucket: the entries are chained 2, 1, 0. */
+    table = tm_weak_table_new(1);
+    for ( i = 0; i < 3; ++ i ) {
+      my_strong[i] = my_cons_(0, 0);
+      value = my_cons_(0, 0);
+      value->car = my_int(i);
+      tm_write_barrier_pure(value);
+      tm_assert(tm_weak_table_put(table, my_strong[i], value));
+    }
+
+    /* Remove the middle entry part way through marking. */
+    my_flip(1);
+    for ( i = 0; i < round * nalloc / 10; ++ i ) {
+      my_cons_(0, nsize);
+    }
+    tm_assert(tm_weak_table_remove(table, my_strong[1]));
+
+    my_flip(2);
+
+    for ( i = 0; i < 3; i += 2 ) {
+      value = tm_weak_table_get(table, my_strong[i]);
+      tm_assert(value && value->car == my_int(i));
+    }
+    tm_assert(! tm_weak_table_get(table, my_strong[1]));
+    tm_assert(tm_weak_table_count(table) == 2);
+  }
+
+  end_test();
+
+  memset(my_strong, 0, sizeof(my_strong));
+  table = 0;
+}
+
+
+
 int main(int argc, char **argv, char **envp)
 {
   int argi = 1;
@@ -597,6 +918,13 @@ int main(int argc, char **argv, char **envp)
   run_test(test8);
   run_test(test9);
   run_test(test10);
+  run_test(test11);
+  run_test(test12);
+  run_test(test13);
+  run_test(test14);
+  run_test(test15);
+  run_test(test16);
+  run_test(test17);
 
   tm_msg_prefix = "FINISHED";
   tm_print_stats();
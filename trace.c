@@ -0,0 +1,281 @@
+/** \file trace.c
+ * \brief Allocation trace.
+ *
+ * If TM_TRACE names a file, a binary trace of tm_trace_record is written to it; see trace.h:
+ *
+ * - tm_alloc(), tm_alloc_desc(), tm_realloc() and tm_free() calls.
+ * - Pointer stores reported by write barriers:
+ *   the write barrier hooks are wrapped, and called for every barrier, not only on BLACK nodes.
+ *   tm_write_barrier_pure() records every pointer in the node.
+ *   Stores are only traced if the mutator calls write barriers.
+ * - Nodes found unreachable at each flip, and the flip.
+ * .
+ *
+ * Records are written through a buffer allocated from the OS, so its node addresses are not scanned.
+ * The buffer is flushed when full, by tm_trace_flush() and at exit.
+ * Child processes are not traced; see _tm_trace_atfork_child().
+ *
+ * See tm_replay.c to replay a trace.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+
+/****************************************************************************/
+/*! \defgroup trace Trace */
+/*@{*/
+
+/*! The size of the trace write buffer, in bytes. */
+#define tm_trace_BUF_SIZE (256 * 1024)
+
+int _tm_trace_active = 0;
+
+/*! The trace file. */
+static int trace_fd = -1;
+
+/*! The trace write buffer. */
+static char *trace_buf;
+
+/*! The number of bytes in trace_buf. */
+static size_t trace_n;
+
+/*! The write barrier hooks being traced. */
+static void (*trace_write_barrier)(void *referent);
+static void (*trace_write_barrier_pure)(void *referent);
+static void (*trace_write_barrier_root)(void *referent);
+
+
+/**
+ * API: Write the buffered trace records.
+ */
+void tm_trace_flush()
+{
+  char *p = trace_buf;
+
+  while ( trace_n ) {
+    ssize_t n = write(trace_fd, p, trace_n);
+
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+	continue;
+      perror("tm: trace write() failed");
+      _tm_trace_active = 0;
+      break;
+    }
+
+    p += n;
+    trace_n -= n;
+  }
+
+  trace_n = 0;
+}
+
+
+/**
+ * Append a trace record.
+ */
+static
+void _tm_trace_record(int op, tm_ptr_word a, tm_ptr_word b, size_t size, size_t offset)
+{
+  tm_trace_record *r;
+
+  if ( trace_n + sizeof(*r) > tm_trace_BUF_SIZE ) {
+    tm_trace_flush();
+  }
+
+  r = (tm_trace_record*) (trace_buf + trace_n);
+  memset(r, 0, sizeof(*r));
+  r->op = op;
+  r->size = size;
+  r->offset = offset;
+  r->a = a;
+  r->b = b;
+
+  trace_n += sizeof(*r);
+}
+
+
+/**
+ * Trace an API call: see enum tm_trace_op.
+ */
+void __tm_trace(int op, const void *a, const void *b, size_t size)
+{
+  _tm_trace_record(op, (tm_ptr_word) a, (tm_ptr_word) b, size, 0);
+}
+
+
+/**
+ * Trace the store of the pointer at ptr, within node n.
+ */
+static __inline
+void _tm_trace_store(tm_node *n, void **ptr)
+{
+  char *base = tm_node_ptr(n);
+  void *value = *ptr;
+  tm_node *vn = value ? tm_ptr_to_node(value) : 0;
+  char *vbase = vn ? tm_node_ptr(vn) : 0;
+
+  _tm_trace_record(tm_trace_STORE,
+		   (tm_ptr_word) base,
+		   (tm_ptr_word) vbase,
+		   (char*) ptr - base,
+		   vn ? (char*) value - vbase : 0);
+}
+
+
+/**
+ * Traced tm_write_barrier() hook.
+ */
+static
+void _tm_trace_write_barrier(void *ptr)
+{
+  tm_node *n;
+
+  if ( (n = tm_ptr_to_node(ptr)) ) {
+    _tm_trace_store(n, (void**) ((tm_ptr_word) ptr & ~ (tm_ptr_word) (tm_PTR_ALIGN - 1)));
+  } else {
+    _tm_trace_record(tm_trace_ROOT, 0, 0, 0, 0);
+  }
+
+  trace_write_barrier(ptr);
+}
+
+
+/**
+ * Traced tm_write_barrier_pure() hook: traces every pointer in the node.
+ */
+static
+void _tm_trace_write_barrier_pure(void *ptr)
+{
+  tm_node *n = tm_pure_ptr_to_node(ptr);
+  char *p = ptr, *e = p + tm_node_to_type(n)->size - sizeof(void*);
+
+  for ( ; p <= e; p += tm_PTR_ALIGN ) {
+    void *value = *(void**) p;
+
+    if ( value && tm_ptr_to_node(value) ) {
+      _tm_trace_store(n, (void**) p);
+    }
+  }
+
+  trace_write_barrier_pure(ptr);
+}
+
+
+/**
+ * Traced tm_write_barrier_root() hook.
+ */
+static
+void _tm_trace_write_barrier_root(void *ptr)
+{
+  _tm_trace_record(tm_trace_ROOT, 0, 0, 0, 0);
+
+  trace_write_barrier_root(ptr);
+}
+
+
+/**
+ * Trace the nodes found unreachable, then the flip.
+ *
+ * Called atomically at the end of marking, before colors flip: nodes still ECRU are unreachable.
+ * Visits every parcelled node: tracing is for recording, not production.
+ */
+void _tm_trace_flip()
+{
+  tm_type *t;
+  tm_block *b;
+
+  if ( ! _tm_trace_active )
+    return;
+
+  tm_list_LOOP(&tm.types, t) {
+    tm_list_LOOP(&t->blocks, b) {
+      void *p;
+
+      for ( p = tm_block_node_begin(b); p < tm_block_node_next_parcel(b); p = tm_block_node_next(b, p) ) {
+	tm_node *n = tm_block_node_at(b, p);
+
+	if ( tm_node_color(n) == ECRU ) {
+	  _tm_trace_record(tm_trace_DEATH, (tm_ptr_word) tm_node_ptr(n), 0, 0, 0);
+	}
+      }
+    }
+    tm_list_LOOP_END;
+  }
+  tm_list_LOOP_END;
+
+  _tm_trace_record(tm_trace_FLIP, tm.colors.flip_id + 1, 0, 0, 0);
+}
+
+
+/**
+ * Open the trace named by TM_TRACE, and wrap the write barrier hooks.
+ *
+ * Called by tm_init(), after the write barrier hooks are selected.
+ */
+void _tm_trace_init()
+{
+  const char *name = getenv("TM_TRACE");
+  tm_trace_header h;
+
+  if ( ! (name && name[0]) )
+    return;
+
+  if ( (trace_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+       ! (trace_buf = _tm_os_alloc_aligned(tm_trace_BUF_SIZE)) ) {
+    perror(name);
+    tm_abort();
+  }
+
+  _tm_trace_active = 1;
+  atexit(tm_trace_flush);
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, tm_trace_MAGIC, sizeof(h.magic));
+  h.record_size = sizeof(tm_trace_record);
+  h.ptr_size = sizeof(void*);
+  memcpy(trace_buf, &h, sizeof(h));
+  trace_n = sizeof(h);
+
+  trace_write_barrier = _tm_write_barrier;
+  trace_write_barrier_pure = _tm_write_barrier_pure;
+  trace_write_barrier_root = _tm_write_barrier_root;
+  _tm_write_barrier = _tm_trace_write_barrier;
+  _tm_write_barrier_pure = _tm_trace_write_barrier_pure;
+  _tm_write_barrier_root = _tm_trace_write_barrier_root;
+
+  /*! Call the hooks for every write barrier. */
+  _tm_write_barrier_active = 2;
+}
+
+
+/**
+ * In the child process after fork(): stop tracing.
+ *
+ * The trace file and the buffered records belong to the parent:
+ * the child would append to the same trace,
+ * and write the parent's buffered records again at exit.
+ * Called by tm_atfork_child().
+ */
+void _tm_trace_atfork_child()
+{
+  if ( trace_fd < 0 )
+    return;
+
+  /*! Drop the parent's buffered records: tm_trace_flush() at exit writes nothing. */
+  _tm_trace_active = 0;
+  trace_n = 0;
+  close(trace_fd);
+  trace_fd = -1;
+
+  /*! Unwrap the write barrier hooks. */
+  _tm_write_barrier = trace_write_barrier;
+  _tm_write_barrier_pure = trace_write_barrier_pure;
+  _tm_write_barrier_root = trace_write_barrier_root;
+  _tm_write_barrier_active = ! tm.wb_active;
+}
+
+/*@}*/
+
@@ -0,0 +1,80 @@
+/** \file trace.h
+ * \brief Allocation trace.
+ *
+ * Written when TM_TRACE names a file; read by tm_replay.
+ */
+#ifndef tm_TRACE_H
+#define tm_TRACE_H
+
+/****************************************************************************/
+/*! \defgroup trace Trace */
+/*@{*/
+
+/*! The magic number at the start of a trace. */
+#define tm_trace_MAGIC "TMTRACE\1"
+
+/**
+ * Trace record operations.
+ */
+enum tm_trace_op {
+  /*! tm_alloc(): a = node address, size = size. */
+  tm_trace_ALLOC = 'A',
+  /*! tm_realloc(): a = new node address, b = old node address, size = size. */
+  tm_trace_REALLOC = 'R',
+  /*! tm_free(): a = node address. */
+  tm_trace_FREE = 'F',
+  /*! A pointer store reported by a write barrier:
+   *  a = node address, size = offset of the word in the node,
+   *  b = address of the node pointed to, or 0, offset = offset of the pointer into that node. */
+  tm_trace_STORE = 'S',
+  /*! A root write barrier. */
+  tm_trace_ROOT = 'r',
+  /*! A node found unreachable by the collector: a = node address. */
+  tm_trace_DEATH = 'D',
+  /*! A flip: a = tm_colors.flip_id after the flip. */
+  tm_trace_FLIP = 'P'
+};
+
+
+/**
+ * A trace record.
+ */
+typedef struct tm_trace_record {
+  /*! An enum tm_trace_op. */
+  unsigned char op;
+  unsigned char _pad[3];
+  /*! Record fields: see enum tm_trace_op. */
+  unsigned int size;
+  unsigned int offset;
+  unsigned int _pad2;
+  unsigned long long a, b;
+} tm_trace_record;
+
+
+/**
+ * The trace header.
+ */
+typedef struct tm_trace_header {
+  /*! tm_trace_MAGIC. */
+  char magic[8];
+  /*! sizeof(tm_trace_record). */
+  unsigned int record_size;
+  /*! sizeof(void*) of the traced process. */
+  unsigned int ptr_size;
+} tm_trace_header;
+
+
+/*! If true, API calls and write barriers are traced. */
+extern int _tm_trace_active;
+
+void _tm_trace_init();
+void __tm_trace(int op, const void *a, const void *b, size_t size);
+void _tm_trace_flip();
+void _tm_trace_atfork_child();
+
+/*! Trace an API call. */
+#define _tm_trace(OP, A, B, SIZE) (_tm_trace_active ? __tm_trace(OP, A, B, SIZE) : (void) 0)
+
+/*@}*/
+
+#endif
@@ -5,6 +5,18 @@
 #include "tredmill/tm_data.h"
 #include "tredmill/ptr.h"
 
+#ifdef tm_tread_UNIT_TEST
+#define tm_tread_WRITE(n) ((void) 0)
+#else
+#include "tredmill/wb.h"
+/*! Called before the tread writes the tm_node header of n; see _tm_wb_node_write(). */
+#define tm_tread_WRITE(n) _tm_wb_node_write(n)
+#endif
+
+/*! Called before the tread links or unlinks n: writes n and its neighbors. */
+#define tm_tread_WRITE_LINKS(n) \
+  (tm_tread_WRITE(tm_node_prev(n)), tm_tread_WRITE(n), tm_tread_WRITE(tm_node_next(n)))
+
 
 static __inline
 void tm_tread_flip(tm_tread *t);
@@ -16,11 +28,14 @@ void tm_tread_add_white(tm_tread *t, tm_node *n)
 {
   tm_block *b = tm_node_to_block(n);
 
+  tm_tread_WRITE(n);
   if ( ! t->n[tm_TOTAL] ) {
     tm_list_init(n);
     t->free = t->bottom = t->top = t->scan = n;
   }
   else {
+    tm_tread_WRITE(t->bottom);
+    tm_tread_WRITE(tm_node_prev(t->bottom));
     tm_list_append(t->bottom, n);
     if ( ! t->n[WHITE] ) {
       t->free = n;
@@ -38,6 +53,7 @@ void tm_tread_add_white(tm_tread *t, tm_node *n)
 
   tm_tread_VALIDATE(t);
 
+#if 0
   fprintf(stderr, "add_white %p, %p : %lu %lu %lu %lu %lu\n", 
 	  (void *) t,
 	  (void *) n,
@@ -46,10 +62,45 @@ void tm_tread_add_white(tm_tread *t, tm_node *n)
 	  (unsigned long) t->n[GREY],
 	  (unsigned long) t->n[WHITE],
 	  (unsigned long) t->n[tm_TOTAL]);
+#endif
  
 }
 
 
+/**
+ * Removes a WHITE node from a tread,
+ * when its tm_block is returned to the block free lists.
+ *
+ * Tread pointers at the node are moved to its neighbors;
+ * the caller adjusts the node counts.
+ */
+static __inline
+void tm_tread_remove_white(tm_tread *t, tm_node *n)
+{
+  assert(tm_node_color(n) == WHITE);
+
+  if ( tm_node_next(n) == n ) {
+    t->free = t->bottom = t->top = t->scan = 0;
+  } else {
+    if ( t->free == n ) {
+      t->free = tm_node_next(n);
+    }
+    if ( t->bottom == n ) {
+      t->bottom = tm_node_next(n);
+    }
+    if ( t->top == n ) {
+      t->top = tm_node_prev(n);
+    }
+    if ( t->scan == n ) {
+      t->scan = tm_node_prev(n);
+    }
+  }
+
+  tm_tread_WRITE_LINKS(n);
+  tm_list_remove(n);
+}
+
+
 static __inline
 tm_node *tm_tread_alloc_node_from_free_list(tm_tread *t)
 {
@@ -60,6 +111,7 @@ tm_node *tm_tread_alloc_node_from_free_list(tm_tread *t)
 
   t->free = tm_list_next(t->free);
 
+  tm_tread_WRITE(n);
   tm_list_set_color(n, BLACK);
 
   -- b->n[WHITE];
@@ -109,8 +161,12 @@ void tm_tread_mark_grey(tm_tread *t, tm_node *n)
 
   if ( t->top == n ) {
     t->top = tm_node_prev(n);
+    tm_tread_WRITE(n);
   } else {
+    tm_tread_WRITE_LINKS(n);
     tm_list_remove(n);
+    tm_tread_WRITE(t->top);
+    tm_tread_WRITE(tm_node_next(t->top));
     tm_list_insert(t->top, n);
   }
   
@@ -144,7 +200,7 @@ void tm_tread_mark(tm_tread *t, tm_node *n)
     -- t->n[ECRU];
     -- tm.n[ECRU];
 
-#if 1
+#if 0
     fprintf(stderr, "M");
 #endif
 
@@ -166,6 +222,7 @@ int tm_tread_scan(tm_tread *t)
 
     assert(tm_list_color(n) == GREY);
 
+    tm_tread_WRITE(n);
     tm_list_set_color(n, BLACK);
 
     -- b->n[GREY];
@@ -176,7 +233,7 @@ int tm_tread_scan(tm_tread *t)
     ++ t->n[BLACK];
     ++ tm.n[BLACK];
 
-#if 1
+#if 0
     fprintf(stderr, "S");
 #endif
 
@@ -207,7 +264,9 @@ int tm_tread_mutation(tm_tread *t, tm_node *n)
     -- t->n[BLACK];
     -- tm.n[BLACK];
 
+#if 0
     fprintf(stderr, "*");
+#endif
 
     tm_tread_VALIDATE(t);
     return 1;
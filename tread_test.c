@@ -4,9 +4,19 @@
 #include "tread.h"
 #include "tm_data.h"
 #include "tread_inline.h"
+#include "internal.h" /* tm_ptr_to_node(), _tm_range_scan(), tm_size_to_type() */
 
 
 #include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h> /* __rdtsc() */
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0ULL
+#endif
 
 static 
 void render_dot(tm_tread *t, tm_node *mark, const char *desc);
@@ -18,10 +28,16 @@ static tm_colors colors;
 static tm_node nodes[N];
 static tm_tread _t, *t = &_t;
 
+/*! If true, the callbacks below do nothing; see tread_bench(). */
+static int bench = 0;
+
 void tm_tread_mark_roots(tm_tread *t)
 {
   int j;
 
+  if ( bench )
+    return;
+
   render_dot(t, 0, "flipped");
 
   fprintf(stderr, "  tm_tread_mark_roots(%p)\n", (void*) t);
@@ -41,6 +57,9 @@ void tm_tread_mark_roots(tm_tread *t)
 
 void _tm_node_scan (tm_node *n)
 {
+  if ( bench )
+    return;
+
   if ( (n - nodes) % 2 == 0 ) {
     int i = rand() % nodes_parceled;
     tm_node *r = &nodes[i];
@@ -59,6 +78,9 @@ int tm_tread_more_white(tm_tread *t)
   int result = 0;
   int i;
 
+  if ( bench )
+    return 0;
+
   fprintf(stderr, "  tm_tread_more_white(%p)\n", (void*) t);
   for ( i = 0; i < 4; ++ i ) {
     if ( nodes_parceled < N ) {
@@ -84,6 +106,9 @@ void render_dot(tm_tread *t, tm_node *mark, const char *desc)
   char filename_svg[64];
   char filename_html[64];
 
+  if ( bench )
+    return;
+
   sprintf(filename_dot, "images/tread-%03d.dot", filename_i);
   sprintf(filename_svg, "images/tread-%03d.svg", filename_i);
   sprintf(filename_html, "images/tread-%03d.html", filename_i);
@@ -160,11 +185,550 @@ void render_dot(tm_tread *t, tm_node *mark, const char *desc)
 }
 
 
-int main(int argc, char **argv)
+/****************************************************************************/
+/* Benchmarks */
+
+/**
+ * tread_test -b [-n max_nodes] [-c baseline] [-t percent] [bench ...]
+ *
+ * Times primitives in isolation, at each heap size and pointer density,
+ * and writes one JSON object per line to stdout:
+ *
+ * <pre>
+ * {"bench":"tm_ptr_to_node","nodes":16384,"density":0.50,"ops":65536,"ns_per_op":4.210,"cycles_per_op":12.630}
+ * </pre>
+ *
+ * - tm_ptr_to_node, _tm_range_scan: words of which a density fraction point to live nodes of a real heap.
+ *   Before each _tm_range_scan repetition the heap is unmarked by a flip, untimed.
+ * - tm_size_to_type: random sizes up to 512 bytes.
+ * - __tm_write_barrier, __tm_write_barrier_pure, __tm_write_barrier_root: the hooks, on live nodes and a root.
+ * - tm_write_barrier_pure: the inline fast path that mutators run, on live nodes.
+ * - tm_tread_mark, tm_tread_scan, tm_tread_flip: a tread of allocated nodes in mock tm_blocks is flipped,
+ *   then a density fraction of its nodes is marked, in random order, and scanned;
+ *   scanning a node only does tread bookkeeping.  The tread is rebuilt, untimed, before each cycle.
+ * .
+ *
+ * Heap primitive results are the fastest of BENCH_REPS repetitions;
+ * tread results are averaged over all cycles.
+ * cycles_per_op is 0 without a timestamp counter.
+ * bench arguments select benchmarks by name prefix.
+ *
+ * With -c, results slower than the same benchmark in baseline,
+ * a file of earlier results, by more than percent (default 25) are reported on stderr,
+ * and the exit status is 1.
+ */
+
+/*! The heap sizes benchmarked, in nodes. */
+static const size_t bench_nodes[] = { 1024, 16384, 262144 };
+
+/*! The pointer densities benchmarked. */
+static const double bench_densities[] = { 0.1, 0.5, 0.9 };
+
+/*! The node sizes of the real heap. */
+static const size_t bench_sizes[] = { 8, 16, 24, 32, 48, 64, 96, 128 };
+
+/*! The number of words scanned, sizes looked up and barriers taken, per repetition. */
+#define BENCH_WORDS 65536
+
+/*! The number of repetitions of a benchmark. */
+#define BENCH_REPS 5
+
+/*! The number of nodes marked in the tread benchmarks, over all cycles, at least. */
+#define BENCH_TREAD_OPS (1 << 20)
+
+/*! Benchmark name prefixes to run, or none. */
+static char **bench_only;
+static int bench_only_n;
+
+static volatile unsigned long bench_sink;
+
+
+/**
+ * A benchmark time.
+ */
+typedef struct bench_time {
+  struct timespec t0;
+  unsigned long long c0;
+  /*! Total nanoseconds. */
+  double ns;
+  /*! Total timestamp counter cycles. */
+  unsigned long long cycles;
+} bench_time;
+
+static
+void bench_begin(bench_time *bt)
+{
+  clock_gettime(CLOCK_MONOTONIC, &bt->t0);
+  bt->c0 = bench_cycles();
+}
+
+static
+void bench_end(bench_time *bt)
+{
+  unsigned long long c1 = bench_cycles();
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  bt->cycles += c1 - bt->c0;
+  bt->ns += (t1.tv_sec - bt->t0.tv_sec) * 1e9 + (t1.tv_nsec - bt->t0.tv_nsec);
+}
+
+/*! Keep the fastest repetition in best. */
+static
+void bench_min(bench_time *best, const bench_time *bt)
+{
+  if ( best->ns == 0 || bt->ns < best->ns )
+    *best = *bt;
+}
+
+
+/**
+ * A baseline result.
+ */
+typedef struct bench_result {
+  char bench[64];
+  unsigned long nodes;
+  double density;
+  double ns_per_op;
+} bench_result;
+
+#define BENCH_BASELINE_MAX 1024
+static bench_result bench_baseline[BENCH_BASELINE_MAX];
+static int bench_baseline_n;
+static double bench_threshold = 25;
+static int bench_regressions;
+
+
+static
+int bench_selected(const char *name)
+{
+  int i;
+
+  /* Either may be a prefix of the other: "tm_tread" selects a group. */
+  for ( i = 0; i < bench_only_n; ++ i ) {
+    size_t n = strlen(bench_only[i]);
+
+    if ( n > strlen(name) )
+      n = strlen(name);
+    if ( ! strncmp(name, bench_only[i], n) )
+      return 1;
+  }
+  return ! bench_only_n;
+}
+
+
+static
+int bench_read_baseline(const char *filename)
+{
+  char line[256];
+  FILE *fp = fopen(filename, "r");
+
+  if ( ! fp ) {
+    perror(filename);
+    return 0;
+  }
+
+  while ( bench_baseline_n < BENCH_BASELINE_MAX && fgets(line, sizeof(line), fp) ) {
+    bench_result *r = &bench_baseline[bench_baseline_n];
+
+    if ( sscanf(line, "{\"bench\":\"%63[^\"]\",\"nodes\":%lu,\"density\":%lf,\"ops\":%*u,\"ns_per_op\":%lf",
+		r->bench, &r->nodes, &r->density, &r->ns_per_op) == 4 ) {
+      ++ bench_baseline_n;
+    }
+  }
+  fclose(fp);
+
+  return 1;
+}
+
+
+/**
+ * Write a result, and compare it with the baseline.
+ */
+static
+void bench_report(const char *name, size_t nodes, double density, unsigned long ops, const bench_time *bt)
+{
+  double ns_per_op;
+  int i;
+
+  if ( ! ops )
+    return;
+
+  ns_per_op = bt->ns / ops;
+
+  printf("{\"bench\":\"%s\",\"nodes\":%lu,\"density\":%.2f,\"ops\":%lu,\"ns_per_op\":%.3f,\"cycles_per_op\":%.3f}\n",
+	 name,
+	 (unsigned long) nodes,
+	 density,
+	 ops,
+	 ns_per_op,
+	 (double) bt->cycles / ops);
+  fflush(stdout);
+
+  for ( i = 0; i < bench_baseline_n; ++ i ) {
+    bench_result *r = &bench_baseline[i];
+    double dd = r->density - density;
+
+    if ( strcmp(r->bench, name) || r->nodes != nodes || dd > 0.005 || dd < -0.005 )
+      continue;
+
+    if ( ns_per_op > r->ns_per_op * (1 + bench_threshold / 100) ) {
+      fprintf(stderr, "tread_test: REGRESSION: %s nodes %lu density %.2f: %.3f ns/op, baseline %.3f ns/op\n",
+	      name, (unsigned long) nodes, density, ns_per_op, r->ns_per_op);
+      ++ bench_regressions;
+    }
+    break;
+  }
+}
+
+
+static
+void *bench_map(size_t size)
+{
+  void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED ) {
+    fprintf(stderr, "tread_test: cannot map %lu bytes\n", (unsigned long) size);
+    exit(2);
+  }
+  return p;
+}
+
+
+/*! The real heap: scanned by bench_heap_scan(), a root callback. */
+static void **bench_heap;
+static size_t bench_heap_n;
+
+/*! If true, bench_heap_scan() does not mark the heap. */
+static int bench_heap_unmarking;
+
+/*! The words scanned: not a root. */
+static void **bench_words;
+
+/*! The sizes looked up. */
+static size_t *bench_req;
+
+/*! The root written by __tm_write_barrier_root(). */
+static void *bench_root;
+
+
+/**
+ * Root callback: mark the heap, unless it is being unmarked.
+ */
+static
+void bench_heap_scan(void *data)
+{
+  if ( ! bench_heap_unmarking )
+    _tm_range_scan(bench_heap, bench_heap + bench_heap_n);
+}
+
+
+/**
+ * Leave the heap reachable: mark its nodes.
+ */
+static
+void bench_heap_mark(size_t nodes)
+{
+  _tm_wb_enter();
+  _tm_range_scan(bench_heap, bench_heap + nodes);
+  _tm_wb_leave();
+}
+
+
+/**
+ * Unmark the heap, untimed.
+ *
+ * Marks the heap, then allocates until a flip while bench_heap_scan() skips the heap:
+ * the flip turns its marked nodes ECRU, and its root scan does not mark them again.
+ * The caller must mark the heap again before the next flip; see bench_heap_mark().
+ */
+static
+void bench_heap_unmark(size_t nodes)
+{
+  unsigned long flip_id = tm.colors.flip_id;
+
+  bench_heap_mark(nodes);
+  bench_heap_unmarking = 1;
+  while ( tm.colors.flip_id == flip_id ) {
+    if ( ! tm_alloc(bench_sizes[0]) ) {
+      fprintf(stderr, "tread_test: out of memory before flip\n");
+      exit(2);
+    }
+  }
+  bench_heap_unmarking = 0;
+}
+
+
+/**
+ * Benchmark the heap primitives with a real heap of nodes.
+ */
+static
+void bench_heap_primitives(size_t nodes)
+{
+  bench_time best, bt;
+  size_t i, found = 0;
+  int d, r;
+
+  /* Grow the heap: new nodes are allocated BLACK, and bench_heap_scan() marks them at the next flip. */
+  while ( bench_heap_n < nodes ) {
+    if ( ! (bench_heap[bench_heap_n] = tm_alloc(bench_sizes[bench_heap_n % (sizeof(bench_sizes) / sizeof(bench_sizes[0]))])) ) {
+      fprintf(stderr, "tread_test: out of memory at %lu nodes\n", (unsigned long) bench_heap_n);
+      exit(2);
+    }
+    ++ bench_heap_n;
+  }
+
+  for ( d = 0; d < sizeof(bench_densities) / sizeof(bench_densities[0]); ++ d ) {
+    double density = bench_densities[d];
+
+    for ( i = 0; i < BENCH_WORDS; ++ i ) {
+      bench_words[i] = rand() % 1000 < density * 1000 ?
+	bench_heap[rand() % nodes] :
+	(void*) (tm_ptr_word) rand();
+    }
+
+    if ( bench_selected("tm_ptr_to_node") ) {
+      memset(&best, 0, sizeof(best));
+      for ( r = 0; r < BENCH_REPS; ++ r ) {
+	memset(&bt, 0, sizeof(bt));
+	_tm_wb_enter();
+	bench_begin(&bt);
+	for ( i = 0; i < BENCH_WORDS; ++ i ) {
+	  found += tm_ptr_to_node(bench_words[i]) != 0;
+	}
+	bench_end(&bt);
+	_tm_wb_leave();
+	bench_min(&best, &bt);
+      }
+      bench_report("tm_ptr_to_node", nodes, density, BENCH_WORDS, &best);
+    }
+
+    /* Each repetition marks the nodes found. */
+    if ( bench_selected("_tm_range_scan") ) {
+      memset(&best, 0, sizeof(best));
+      for ( r = 0; r < BENCH_REPS; ++ r ) {
+	bench_heap_unmark(nodes);
+	memset(&bt, 0, sizeof(bt));
+	_tm_wb_enter();
+	bench_begin(&bt);
+	_tm_range_scan(bench_words, bench_words + BENCH_WORDS);
+	bench_end(&bt);
+	_tm_wb_leave();
+	bench_min(&best, &bt);
+      }
+      bench_heap_mark(nodes);
+      bench_report("_tm_range_scan", nodes, density, BENCH_WORDS, &best);
+    }
+  }
+
+  if ( bench_selected("tm_size_to_type") ) {
+    for ( i = 0; i < BENCH_WORDS; ++ i ) {
+      bench_req[i] = rand() % 512 + 1;
+    }
+
+    memset(&best, 0, sizeof(best));
+    /* The first repetition creates the tm_types, untimed. */
+    for ( r = 0; r <= BENCH_REPS; ++ r ) {
+      memset(&bt, 0, sizeof(bt));
+      _tm_wb_enter();
+      bench_begin(&bt);
+      for ( i = 0; i < BENCH_WORDS; ++ i ) {
+	found += tm_size_to_type(bench_req[i]) != 0;
+      }
+      bench_end(&bt);
+      _tm_wb_leave();
+      if ( r )
+	bench_min(&best, &bt);
+    }
+    bench_report("tm_size_to_type", nodes, 0, BENCH_WORDS, &best);
+  }
+
+#define BENCH_BARRIER(NAME, EXPR)				\
+  if ( bench_selected(#NAME) ) {				\
+    memset(&best, 0, sizeof(best));				\
+    for ( r = 0; r < BENCH_REPS; ++ r ) {			\
+      memset(&bt, 0, sizeof(bt));				\
+      bench_begin(&bt);						\
+      for ( i = 0; i < BENCH_WORDS; ++ i ) {			\
+	NAME(EXPR);						\
+      }								\
+      bench_end(&bt);						\
+      bench_min(&best, &bt);					\
+    }								\
+    bench_report(#NAME, nodes, 0, BENCH_WORDS, &best);		\
+  }
+
+  BENCH_BARRIER(__tm_write_barrier, bench_heap[i % nodes]);
+  BENCH_BARRIER(__tm_write_barrier_pure, bench_heap[i % nodes]);
+  BENCH_BARRIER(__tm_write_barrier_root, &bench_root);
+  BENCH_BARRIER(tm_write_barrier_pure, bench_heap[i % nodes]);
+
+#undef BENCH_BARRIER
+
+  bench_sink += found;
+}
+
+
+/**
+ * Benchmark the tread primitives with a tread of nodes in mock tm_blocks.
+ */
+static
+void bench_tread_primitives(size_t nodes, double density)
+{
+  size_t stride = sizeof(tm_node) + tm_ALLOC_ALIGN;
+  size_t hdr = (tm_block_HDR_SIZE + tm_ALLOC_ALIGN - 1) & ~ (tm_ALLOC_ALIGN - 1);
+  /* Leave room at the end of each tm_block: tm_node_to_block() may look past the tm_node. */
+  size_t per_block = (tm_block_SIZE - hdr) / stride - 1;
+  size_t n_blocks = (nodes + per_block - 1) / per_block;
+  size_t map_size = (n_blocks + 1) * tm_block_SIZE;
+  size_t i, j, live = (size_t) (density * nodes), cycles = BENCH_TREAD_OPS / (live ? live : 1);
+  unsigned long n_mark = 0, n_scan = 0, n_flip = 0;
+  bench_time bt_mark, bt_scan, bt_flip;
+  tm_node **order;
+  char *map, *blocks;
+
+  if ( cycles < 4 )
+    cycles = 4;
+
+  map = bench_map(map_size);
+  blocks = (char*) (((tm_ptr_word) map + tm_block_SIZE - 1) & tm_block_SIZE_MASK);
+  order = bench_map(nodes * sizeof(order[0]));
+
+  /* Mark nodes in random order. */
+  for ( i = 0; i < nodes; ++ i ) {
+    order[i] = (tm_node*) (blocks + (i / per_block) * tm_block_SIZE + hdr + (i % per_block) * stride);
+  }
+  for ( i = nodes; i > 1; -- i ) {
+    tm_node *n = order[i - 1];
+
+    j = rand() % i;
+    order[i - 1] = order[j];
+    order[j] = n;
+  }
+
+  memset(&bt_mark, 0, sizeof(bt_mark));
+  memset(&bt_scan, 0, sizeof(bt_scan));
+  memset(&bt_flip, 0, sizeof(bt_flip));
+
+  tm_colors_init(&tm.colors);
+
+  for ( i = 0; i < cycles; ++ i ) {
+    size_t start = rand() % nodes;
+
+    /* Parcel the nodes, in address order, and allocate them all: untimed. */
+    tm_tread_init(t);
+    for ( j = 0; j < nodes; ++ j ) {
+      tm_tread_add_white(t, (tm_node*) (blocks + (j / per_block) * tm_block_SIZE + hdr + (j % per_block) * stride));
+    }
+    while ( t->n[WHITE] ) {
+      tm_tread_alloc_node_from_free_list(t);
+    }
+
+    /* All BLACK: flip. */
+    bench_begin(&bt_flip);
+    tm_tread_flip(t);
+    bench_end(&bt_flip);
+    ++ n_flip;
+
+    /* Mark the live nodes. */
+    bench_begin(&bt_mark);
+    for ( j = 0; j < live; ++ j ) {
+      tm_tread_mark(t, order[(start + j) % nodes]);
+    }
+    bench_end(&bt_mark);
+    n_mark += live;
+
+    /* Scan them. */
+    bench_begin(&bt_scan);
+    while ( tm_tread_scan(t) ) {
+      ++ n_scan;
+    }
+    bench_end(&bt_scan);
+  }
+
+  if ( bench_selected("tm_tread_mark") )
+    bench_report("tm_tread_mark", nodes, density, n_mark, &bt_mark);
+  if ( bench_selected("tm_tread_scan") )
+    bench_report("tm_tread_scan", nodes, density, n_scan, &bt_scan);
+  if ( bench_selected("tm_tread_flip") )
+    bench_report("tm_tread_flip", nodes, density, n_flip, &bt_flip);
+
+  munmap(order, nodes * sizeof(order[0]));
+  munmap(map, map_size);
+}
+
+
+static
+int tread_bench(int *argcp, char ***argvp, char ***envpp)
+{
+  int argc = *argcp;
+  char **argv = *argvp;
+  size_t max_nodes = bench_nodes[sizeof(bench_nodes) / sizeof(bench_nodes[0]) - 1];
+  int i, d;
+
+  bench = 1;
+
+  for ( i = 2; i < argc; ++ i ) {
+    if ( ! strcmp(argv[i], "-n") && i + 1 < argc ) {
+      max_nodes = strtoul(argv[++ i], 0, 0);
+    } else if ( ! strcmp(argv[i], "-c") && i + 1 < argc ) {
+      if ( ! bench_read_baseline(argv[++ i]) )
+	return 2;
+    } else if ( ! strcmp(argv[i], "-t") && i + 1 < argc ) {
+      bench_threshold = atof(argv[++ i]);
+    } else if ( argv[i][0] == '-' ) {
+      fprintf(stderr, "usage: %s -b [-n max_nodes] [-c baseline] [-t percent] [bench ...]\n", argv[0]);
+      return 2;
+    } else {
+      break;
+    }
+  }
+  bench_only = argv + i;
+  bench_only_n = argc - i;
+
+  if ( ! seed )
+    seed = 1;
+  srand(seed);
+
+  /* The heap primitives first: the tread benchmarks flip tm.colors. */
+  if ( bench_selected("tm_ptr_to_node") || bench_selected("_tm_range_scan") || 
+       bench_selected("tm_size_to_type") || bench_selected("__tm_write_barrier") ||
+       bench_selected("tm_write_barrier_pure") ) {
+    tm_init(argcp, argvp, envpp);
+
+    bench_heap = bench_map(max_nodes * sizeof(bench_heap[0]));
+    tm_root_add_callback("tread_test", bench_heap_scan, 0);
+    bench_words = bench_map(BENCH_WORDS * sizeof(bench_words[0]));
+    bench_req = bench_map(BENCH_WORDS * sizeof(bench_req[0]));
+
+    for ( i = 0; i < sizeof(bench_nodes) / sizeof(bench_nodes[0]) && bench_nodes[i] <= max_nodes; ++ i ) {
+      bench_heap_primitives(bench_nodes[i]);
+    }
+  } else {
+    tm_msg_init();
+  }
+
+  if ( bench_selected("tm_tread") ) {
+    for ( i = 0; i < sizeof(bench_nodes) / sizeof(bench_nodes[0]) && bench_nodes[i] <= max_nodes; ++ i ) {
+      for ( d = 0; d < sizeof(bench_densities) / sizeof(bench_densities[0]); ++ d ) {
+	bench_tread_primitives(bench_nodes[i], bench_densities[d]);
+      }
+    }
+  }
+
+  return bench_regressions ? 1 : 0;
+}
+
+
+int main(int argc, char **argv, char **envp)
 {
   int i;
   tm_node *n = 0;
 
+  if ( argc > 1 && ! strcmp(argv[1], "-b") ) {
+    return tread_bench(&argc, &argv, &envp);
+  }
+
   if ( argc > 1 ) {
     seed = *argv[1] ? atoi(argv[1]) : 0;
   }
@@ -40,6 +40,10 @@ void tm_type_init(tm_type *t, size_t size)
   /*! Force a new tm_block to be allocated and parceled. */
   t->parcel_from_block = 0;
 
+  /*! Nothing to sweep yet. */
+  t->sweep_block = 0;
+  t->sweep_flip_id = tm.colors.flip_id;
+
   /*! Zero the tm_type descriptor. */
   t->desc = 0;
 }
@@ -169,7 +173,8 @@ tm_adesc *tm_adesc_for_size(tm_adesc *desc, int force_new)
       return t->desc;
   }
 
-  t = tm_type_new_2(desc->size);
+  /*! A forced new tm_type is not hashed: tm_alloc() of the same size must not use desc. */
+  t = force_new ? tm_type_new(desc->size) : tm_type_new_2(desc->size);
   t->desc = desc;
   t->desc->hidden = t;
 
@@ -255,8 +260,18 @@ tm_block * _tm_type_alloc_block(tm_type *t)
 {
   tm_block *b;
   
-  /*! Allocate a new tm_block from free list or OS. */
-  b = _tm_block_alloc(tm_block_SIZE);
+  /*! Allocate a new tm_block from free list, */
+  b = _tm_block_alloc_from_free_list(tm_block_SIZE);
+
+  /*! Or scavenge an unused tm_block from another tm_type, */
+  if ( ! b && tm_block_scavenge_enable ) {
+    b = tm_block_scavenge(t);
+  }
+
+  /*! Or allocate a new tm_block from the OS. */
+  if ( ! b ) {
+    b = _tm_block_alloc(tm_block_SIZE);
+  }
 
   // fprintf(stderr, "  _tm_block_alloc(%d) => %p\n", tm_block_SIZE, b);
 
@@ -284,9 +299,14 @@ void _tm_type_add_block(tm_type *t, tm_block *b)
   /*! Associate tm_block with the tm_type. */
   b->type = t;
 
+#if tm_node_SIDE_TABLE
+  /*! Leave room for the tm_node side table before node data. */
+  _tm_block_side_table_init(b);
+#endif
+
   /*! Compute the capacity of this block. */
   tm_assert_test(! b->n[tm_CAPACITY]);
-  b->n[tm_CAPACITY] = (b->end - b->begin) / (sizeof(tm_node) + t->size); 
+  b->n[tm_CAPACITY] = (b->end - b->begin) / tm_block_node_size(b);
 
   /*! Begin parceling from this block. */
   tm_assert_test(! t->parcel_from_block);
@@ -325,6 +345,14 @@ void _tm_type_remove_block(tm_type *t, tm_block *b)
     t->parcel_from_block = 0;
   }
 
+  /*! Do not sweep it any more. */
+  if ( t->sweep_block == b ) {
+    t->sweep_block = tm_list_next(b);
+    if ( (void*) t->sweep_block == (void*) &t->blocks ) {
+      t->sweep_block = 0;
+    }
+  }
+
   /*! Remove tm_block from tm_type.block list. */
   tm_list_remove(b);
 
@@ -333,6 +361,60 @@ void _tm_type_remove_block(tm_type *t, tm_block *b)
 }
 
 
+/**
+ * Lazily sweep some of a tm_type's tm_blocks since the last flip.
+ *
+ * After a flip, the ECRU tm_nodes of a tm_type become WHITE in place.
+ * Instead of sweeping every tm_type at the flip, each tm_type's tm_blocks
+ * are swept lazily: by the tm_type's own allocations,
+ * by other tm_types needing a tm_block, and by tm_gc_idle().
+ *
+ * A tm_block that is fully free is returned to the block free lists.
+ *
+ * - Sweeps at most *leftp tm_blocks; *leftp is decremented for each tm_block swept.
+ * - If want is non-zero, stops after releasing want tm_blocks.
+ *
+ * Returns the number of tm_blocks released.
+ */
+int tm_type_sweep_some_blocks(tm_type *t, long *leftp, int want)
+{
+  int count = 0;
+
+  /*! Begin sweeping after a flip. */
+  if ( t->sweep_flip_id != tm.colors.flip_id ) {
+    t->sweep_flip_id = tm.colors.flip_id;
+    t->sweep_block = tm_list_first(&t->blocks);
+  }
+
+  while ( t->sweep_block && *leftp > 0 ) {
+    tm_block *b = t->sweep_block;
+
+    -- *leftp;
+
+    /*! Advance to the next tm_block before b is released. */
+    t->sweep_block = tm_list_next(b);
+    if ( (void*) t->sweep_block == (void*) &t->blocks ) {
+      t->sweep_block = 0;
+    }
+
+    /*! Release tm_blocks with all of their parceled tm_nodes WHITE, except the tm_block being parceled. */
+    if ( b != t->parcel_from_block &&
+	 b->n[tm_TOTAL] &&
+	 tm_block_unused(b) ) {
+      _tm_block_free(b);
+      if ( ++ count == want )
+	break;
+    }
+  }
+
+  if ( count ) {
+    tm_msg("b s t%p b%d\n", (void*) t, count);
+  }
+
+  return count;
+}
+
+
 /**
  * Allocates a node from at tm_type's free list.
  */
@@ -423,7 +505,7 @@ int tm_type_parcel_some_nodes(tm_type *t, long left)
       // _tm_block_validate(b);
       
       /*! Parcel a tm_node from the tm_block. */
-      n = tm_block_node_next_parcel(b);
+      n = tm_block_node_at(b, tm_block_node_next_parcel(b));
       
       /*! Increment tm_block parcel pointer. */
       b->next_parcel = pe;
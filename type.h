@@ -59,6 +59,12 @@ typedef struct tm_type {
   /*! The current block we are parceling from. */ 
   struct tm_block *parcel_from_block;
 
+  /*! The next block to sweep since the last flip, or 0 if sweeping is done; see tm_type_sweep_some_blocks(). */
+  struct tm_block *sweep_block;
+
+  /*! The tm.colors.flip_id when sweeping began. */
+  unsigned long sweep_flip_id;
+
   /*! User-specified descriptor handle. */ 
   struct tm_adesc *desc;
 } tm_type;
@@ -77,6 +83,11 @@ struct tm_block * _tm_type_alloc_block(tm_type *t);
 void _tm_type_add_block(tm_type *t, struct tm_block *b);
 void _tm_type_remove_block(tm_type *t, struct tm_block *b);
 
+/*! True if the tm_type has not been fully swept since the last flip. */
+#define tm_type_sweep_pending(t) ((t)->sweep_flip_id != tm.colors.flip_id || (t)->sweep_block)
+
+int tm_type_sweep_some_blocks(tm_type *t, long *leftp, int want);
+
 int tm_type_parcel_or_alloc_node(tm_type *t);
 int tm_type_parcel_some_nodes(tm_type *t, long left);
 
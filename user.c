@@ -45,6 +45,7 @@ void *tm_alloc(size_t size)
 
   _tm_clear_some_stack_words();
   _tm_set_stack_ptr(&ptr);
+  _tm_wb_enter();
 
   if ( tm.trigger_full_gc ) {
     tm.trigger_full_gc = 0;
@@ -52,6 +53,9 @@ void *tm_alloc(size_t size)
   }
 
   ptr = _tm_alloc_inner(size);
+  _tm_trace(tm_trace_ALLOC, ptr, 0, size);
+
+  _tm_wb_leave();
 
 #if tm_TIME_STAT
   tm_time_stat_end(&tm.ts_alloc);
@@ -84,7 +88,10 @@ void *tm_alloc_desc(tm_adesc *desc)
 
   _tm_clear_some_stack_words();
   _tm_set_stack_ptr(&ptr);
+  _tm_wb_enter();
   ptr = _tm_alloc_desc_inner(desc);
+  _tm_trace(tm_trace_ALLOC, ptr, 0, desc->size);
+  _tm_wb_leave();
 
 #if tm_TIME_STAT
   tm_time_stat_end(&tm.ts_alloc);
@@ -127,7 +134,10 @@ void *tm_realloc(void *oldptr, size_t size)
 
   _tm_clear_some_stack_words();
   _tm_set_stack_ptr(&ptr);
+  _tm_wb_enter();
   ptr = _tm_realloc_inner(oldptr, size);
+  _tm_trace(tm_trace_REALLOC, ptr, oldptr, size);
+  _tm_wb_leave();
 
 #if tm_TIME_STAT
   tm_time_stat_end(&tm.ts_alloc);
@@ -162,7 +172,10 @@ void tm_free(void *ptr)
 
   _tm_clear_some_stack_words();
   _tm_set_stack_ptr(&ptr);
+  _tm_wb_enter();
+  _tm_trace(tm_trace_FREE, ptr, 0, 0);
   _tm_free_inner(ptr);
+  _tm_wb_leave();
 
 #if tm_TIME_STAT
   tm_time_stat_end(&tm.ts_free);
@@ -197,13 +210,36 @@ void tm_gc_full()
 
   _tm_clear_some_stack_words();
   _tm_set_stack_ptr(&ptr);
+  _tm_wb_enter();
 
   _tm_gc_full_inner();
 
+  _tm_wb_leave();
+
 #if tm_TIME_STAT
   tm_time_stat_end(&tm.ts_gc);
 #endif
 }
 
 
+/**
+ * API: Do some collector work while the mutator is idle.
+ *
+ * - Sweep some tm_blocks of tm_types that are not allocating.
+ */
+int tm_gc_idle()
+{
+  int result;
+
+  if ( ! tm.inited ) 
+    return 0;
+
+  _tm_wb_enter();
+  result = tm_block_sweep_some();
+  _tm_wb_leave();
+
+  return result;
+}
+
+
 /***************************************************************************/
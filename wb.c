@@ -1,210 +1,639 @@
 /** \file wb.c
- * \brief mprotect() write barrier prototype.
+ * \brief mprotect() write barrier.
+ *
+ * When tm_write_barrier_mode is tm_BARRIER_MPROTECT,
+ * mutators need not call tm_write_barrier():
+ *
+ * - At each flip, tm_blocks mostly holding nodes that survived the flip,
+ *   which are likely to become BLACK again, are write-protected.
+ *   The first page of a tm_block, with its header and counts,
+ *   and any tm_node side table are never write-protected: tm writes them.
+ * - A write fault by the mutator unprotects the page and records it.
+ * - On the next call into tm, BLACK nodes on recorded pages are rescheduled
+ *   for scanning with tm_tread_mutation(), and the pages are write-protected again.
+ * - Before the tread writes a tm_node header on a write-protected page,
+ *   tm unprotects the page itself, without a fault; see _tm_wb_node_write().
+ *   Other writes from within tm still fault.  Neither is a mutation:
+ *   those pages are write-protected again when tm returns.
+ * - BLACK nodes in tm_blocks that are not write-protected, and all data roots,
+ *   are rescanned atomically before the next flip; see __tm_wb_final().
+ * .
+ *
+ * Limitations: see wb.h.
  *
  * $Id: wb.c,v 1.3 2008-01-14 00:08:02 stephens Exp $
  */
 
-#include <stdio.h>
-#include <stdlib.h>
+#include "internal.h"
+#include "tread_inline.h"
+
 #include <errno.h>
-#include <sys/mman.h>
 #include <signal.h>
-#include <assert.h>
-#include "internal.h"
-#include "util/bitset.h"
-#include "wb.h"
 
-/*********************************************************************/
-/* Configuration */
+#if tm_USE_MMAP
+#include <sys/mman.h>
+#endif
 
-/*
-#define MAX_ADDR_SPACE tm_PTR_RANGE
-*/
+/*********************************************************************/
+/*! \defgroup write_barrier_mprotect_config Write Barrier: mprotect(): Configuration */
+/*@{*/
 
-#ifndef MAX_ADDR_SPACE
-#define MAX_ADDR_SPACE (512 * 1024 * 1024) /* 512Mb */
+#if tm_USE_MMAP && defined(SA_SIGINFO)
+#define tm_wb_SUPPORTED 1
+#else
+#define tm_wb_SUPPORTED 0
 #endif
 
+/*! Percentage of a tm_block's capacity that must have survived a flip for the tm_block to be write-protected. */
+int tm_wb_protect_percent = 50;
+
+/*! The page of ptr. */
+#define tm_wb_page(ptr) ((char*) ((tm_ptr_word) (ptr) & tm_page_SIZE_MASK))
+
+/*! The tm_block of a page.  Only valid for tm_blocks of tm_block_SIZE. */
+#define tm_wb_page_block(page) ((tm_block*) ((tm_ptr_word) (page) & tm_block_SIZE_MASK))
+
+/*! The first page of a tm_block that may be write-protected: after its header and any tm_node side table. */
+#define tm_wb_block_protect_begin(b) tm_wb_page((b)->begin + tm_page_SIZE - 1)
+
+/*! True if the tm_block was write-protected at the last flip. */
+#define tm_wb_block_protected(b) bitset_get(tm.wb_block_protected, tm_page_index(b))
+
+/*@}*/
+
+#if tm_wb_SUPPORTED
+
 /*********************************************************************/
-/* Page mutated bits */
+/*! \defgroup write_barrier_mprotect_fault Write Barrier: mprotect(): Write Faults */
+/*@{*/
 
-/* mutated bits indexed by page no. */
-bitset_t tm_wb_page_mutated_bits[bitset_ELEM_LEN(MAX_ADDR_SPACE / tm_PAGESIZE)];
+/*! The SIGSEGV action before _tm_wb_init(). */
+static struct sigaction _tm_wb_sa_old;
 
-#define tm_wb_ptr_to_page_ptr(ptr) ((void *)(((size_t) (ptr)) & ~(tm_PAGESIZE-1)))
 
-#define tm_wb_ptr_to_page_no(ptr) ((size_t) (ptr) / tm_PAGESIZE)
+/**
+ * Record a page unprotected by a write fault or by tm.
+ */
+static
+void _tm_wb_record(char *page)
+{
+  if ( tm.wb_in_tm ) {
+    /*! Writes from within tm are not mutations. */
+    if ( tm.wb_reprotect_n < tm_wb_FAULTS_MAX )
+      tm.wb_reprotect[tm.wb_reprotect_n ++] = page;
+    else
+      tm.wb_overflow = 1;
+  } else {
+    if ( tm.wb_dirty_n < tm_wb_FAULTS_MAX )
+      tm.wb_dirty[tm.wb_dirty_n ++] = page;
+    else
+      tm.wb_overflow = 1;
+  }
+}
 
-#define tm_wb_ptr_mutated_get(ptr) bitset_get(tm_wb_page_mutated_bits, tm_wb_ptr_to_page_no(ptr))
-#define tm_wb_ptr_mutated_set(ptr) bitset_set(tm_wb_page_mutated_bits, tm_wb_ptr_to_page_no(ptr))
-#define tm_wb_ptr_mutated_clr(ptr) bitset_clr(tm_wb_page_mutated_bits, tm_wb_ptr_to_page_no(ptr))
 
+/**
+ * Record a write fault on a page.
+ *
+ * Called from the SIGSEGV handler, or from the userfaultfd handler thread
+ * while the faulting thread is blocked.
+ * The caller must unprotect the page.
+ *
+ * Returns 0 if the page was not write-protected by the write barrier.
+ */
+int _tm_wb_fault(char *page)
+{
+  if ( ! (tm_ptr_in_heap(page) && bitset_get(tm.wb_protected, tm_page_index(page))) )
+    return 0;
 
+  bitset_clr(tm.wb_protected, tm_page_index(page));
+  ++ tm.wb_faults;
 
-#if 0
-typedef struct tm_wb_block {
-  struct tm_wb_block *next, *prev;
-  char *begin;
-  size_t len;
-} tm_wb_block;
+  _tm_wb_record(page);
 
-#endif
+  return 1;
+}
 
-/*********************************************************************/
-/* Write fault handler */
 
+/**
+ * SIGSEGV handler.
+ *
+ * If the fault is on a page write-protected by the write barrier,
+ * record the page and unprotect it.
+ * Otherwise, chain to the previous SIGSEGV action.
+ */
 static
-void tm_wb_unprotect_page(void *page_addr)
+void _tm_wb_signal(int sig, siginfo_t *si, void *context)
 {
-  if ( mprotect(page_addr, tm_PAGESIZE, PROT_READ | PROT_WRITE) ) {
-    perror("unprotect: cannot undo write protect");
-    abort();
-  }  
+  char *page = tm_wb_page(si->si_addr);
+  int saved_errno = errno;
+
+  if ( si->si_addr && _tm_wb_fault(page) ) {
+    if ( mprotect(page, tm_page_SIZE, PROT_READ | PROT_WRITE) ) {
+      abort();
+    }
+
+    errno = saved_errno;
+    return;
+  }
+
+  /*! Chain to the previous handler. */
+  if ( _tm_wb_sa_old.sa_flags & SA_SIGINFO ) {
+    _tm_wb_sa_old.sa_sigaction(sig, si, context);
+  } else if ( _tm_wb_sa_old.sa_handler != SIG_DFL && _tm_wb_sa_old.sa_handler != SIG_IGN ) {
+    _tm_wb_sa_old.sa_handler(sig);
+  } else {
+    /*! Otherwise, restore the default action: the faulting instruction faults again. */
+    sigaction(SIGSEGV, &_tm_wb_sa_old, 0);
+  }
 }
 
+/*@}*/
+
 
-/***********************************************************************/
-/* write fault handler */
+/*********************************************************************/
+/*! \defgroup write_barrier_mprotect_protect Write Barrier: mprotect(): Protection */
+/*@{*/
 
-static void tm_wb_fault_default(void *addr, void *page_addr)
+/**
+ * Change the protection of pages [l, h).
+ *
+ * Pages are marked write-protected before they are protected,
+ * so a fault never finds a protected page unmarked.
+ *
+ * Uses userfaultfd, if active; see wb_uffd.c.
+ */
+static
+void _tm_wb_mprotect(char *l, char *h, int protect)
 {
-#if 1
-  fprintf(stderr, "tm_wb: WRITE FAULT: %p: page %p\n", 
-	  (void*) addr, 
-	  (void*) page_addr
-	  );
-#endif  
+  char *p;
+
+  if ( protect ) {
+    for ( p = l; p < h; p += tm_page_SIZE ) {
+      bitset_set(tm.wb_protected, tm_page_index(p));
+    }
+  }
+
+  if ( tm.wb_uffd >= 0 ) {
+    _tm_wb_uffd_protect(l, h, protect);
+  } else if ( mprotect(l, h - l, protect ? PROT_READ : PROT_READ | PROT_WRITE) ) {
+    perror("tm: mprotect() failed");
+    tm_abort();
+  }
+  ++ tm.wb_mprotects;
+
+  if ( ! protect ) {
+    for ( p = l; p < h; p += tm_page_SIZE ) {
+      bitset_clr(tm.wb_protected, tm_page_index(p));
+    }
+  }
 }
 
-tm_wb_fault_handler_t tm_wb_fault_handler = tm_wb_fault_default;
 
-/***********************************************************************/
-/* write fault signal handler */
+/**
+ * Unprotect the write-protected pages of a tm_node header before tm writes it,
+ * instead of taking a write fault.
+ *
+ * The pages are recorded like write-faulted pages:
+ * within tm, they are write-protected again when tm returns.
+ * See _tm_wb_node_write().
+ */
+void __tm_wb_write(void *ptr)
+{
+  char *page = tm_wb_page(ptr), *end = (char*) ptr + sizeof(tm_node);
 
-#ifdef linux
-static void tm_wb_signal(int sig, struct sigcontext sc)
-#endif
+  for ( ; page < end; page += tm_page_SIZE ) {
+    if ( tm_ptr_in_heap(page) && bitset_get(tm.wb_protected, tm_page_index(page)) ) {
+      _tm_wb_mprotect(page, page + tm_page_SIZE, 0);
+      _tm_wb_record(page);
+    }
+  }
+}
 
-#if 0
-static void tm_wb_signal(int sig, struct siginfo *si, void *vp)
-#endif
 
+/**
+ * Compare page addresses for qsort().
+ */
+static
+int _tm_wb_page_cmp(const void *a, const void *b)
 {
-  char *addr, *page_addr;
+  char *pa = *(char**) a, *pb = *(char**) b;
+
+  return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
 
-  /* Get the address of the write fault. */
-#ifdef linux
-  addr = (char*) sc.cr2;
-#endif
 
-  /* Get the page-aligned address */
-  page_addr = tm_wb_ptr_to_page_ptr(addr);
+/**
+ * Change the protection of n regions of size bytes each, at pages.
+ *
+ * Regions are sorted and protected in coalesced runs,
+ * to minimize calls to mprotect().
+ */
+static
+void _tm_wb_mprotect_runs(void **pages, size_t n, size_t size, int protect)
+{
+  size_t i, j;
 
-  /* Mark the page as mutated. */
-  tm_wb_ptr_mutated_set(addr);
+  qsort(pages, n, sizeof(pages[0]), _tm_wb_page_cmp);
 
-  /* Stop write faulting for this page. */
-  tm_wb_unprotect_page(page_addr);
+  for ( i = 0; i < n; i = j ) {
+    char *l = pages[i], *h = l + size;
 
-  /* Call the fault handler. */
-  tm_wb_fault_handler(addr, page_addr);
+    for ( j = i + 1; j < n && (char*) pages[j] <= h; ++ j ) {
+      if ( (char*) pages[j] + size > h )
+	h = (char*) pages[j] + size;
+    }
 
-  /* Return to mutator. */
+    _tm_wb_mprotect(l, h, protect);
+  }
 }
 
-static int tm_wb_inited = 0;
-static void tm_wb_init()
+
+/**
+ * Make sure tm.wb_pages can hold n page addresses.
+ */
+static
+int _tm_wb_pages_reserve(size_t n)
 {
-  tm_wb_inited ++;
+  size_t size = n * sizeof(tm.wb_pages[0]);
 
-  /* Set signal handler to trap write faults. */
-  {
-    struct sigaction sa, sa_old;
+  if ( size > tm.wb_pages_size ) {
+    void **pages;
 
-    sa.sa_sigaction = (void*) tm_wb_signal;
-    sigfillset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
+    size *= 2;
+    size += tm_block_SIZE - size % tm_block_SIZE;
+    if ( ! (pages = _tm_os_alloc_aligned(size)) )
+      return 0;
 
-    if ( sigaction(SIGSEGV, &sa, &sa_old) ) {
-      perror("sigaction");
-      abort();
+    if ( tm.wb_pages ) {
+      _tm_os_free_aligned(tm.wb_pages, tm.wb_pages_size);
     }
-  }  
+
+    tm.wb_pages = pages;
+    tm.wb_pages_size = size;
+  }
+
+  return 1;
 }
 
-/************************************************************************/
-/* User level routines. */
+/*@}*/
 
-void tm_wb_protect(void *addr, size_t len)
+
+/*********************************************************************/
+/*! \defgroup write_barrier_mprotect_mutation Write Barrier: mprotect(): Mutation */
+/*@{*/
+
+/**
+ * Reschedule BLACK nodes of tm_block b in [l, h) for scanning.
+ */
+static
+void _tm_wb_block_mutation(tm_block *b, char *l, char *h)
 {
-  if ( ! tm_wb_inited ) tm_wb_init();
+  tm_type *t = b->type;
+  size_t size;
+  char *n;
 
-  assert(len < tm_PAGESIZE);
+  if ( ! t )
+    return;
+  size = tm_block_node_size(b);
 
-  addr = tm_wb_ptr_to_page_ptr(addr);
+  /*! Start at the node containing l. */
+  if ( l < b->begin ) {
+    l = b->begin;
+  }
+  n = b->begin + (l - b->begin) / size * size;
 
-  tm_wb_ptr_mutated_clr(addr);
+  if ( h > b->next_parcel ) {
+    h = b->next_parcel;
+  }
+
+  for ( ; n < h; n += size ) {
+    tm_node *node = tm_block_node_at(b, n);
 
-  if ( mprotect(addr, tm_PAGESIZE, PROT_READ) ) {
-    perror("mprotect: cannot write protect");
-    abort();
-  }  
+    if ( tm_node_color(node) == BLACK ) {
+      tm_tread_mutation(tm_type_tread(t), node);
+    }
+  }
 }
 
-void tm_wb_unprotect(void *addr, size_t len)
+
+/**
+ * Reschedule BLACK nodes on a page written by the mutator.
+ */
+static
+void _tm_wb_page_mutation(char *page)
 {
-  if ( ! tm_wb_inited ) tm_wb_init();
+  tm_block *b = tm_wb_page_block(page);
 
-  assert(len < tm_PAGESIZE);
+  if ( tm_wb_block_protected(b) ) {
+    _tm_wb_block_mutation(b, page, page + tm_page_SIZE);
+  }
+}
 
-  addr = tm_wb_ptr_to_page_ptr(addr);
 
-  tm_wb_unprotect_page(addr);
+/**
+ * Reschedule BLACK nodes on every unprotected page of write-protected tm_blocks,
+ * and write-protect them again.
+ *
+ * Used when write faults could not be recorded.
+ */
+static
+void _tm_wb_overflow()
+{
+  tm_type *t;
+  tm_block *b;
+
+  tm_msg("w O %d %d\n", tm.wb_dirty_n, tm.wb_reprotect_n);
+
+  tm.wb_overflow = 0;
+  tm.wb_dirty_n = 0;
+
+  tm_list_LOOP(&tm.types, t) {
+    tm_list_LOOP(&t->blocks, b) {
+      if ( tm_wb_block_protected(b) ) {
+	char *p;
+
+	for ( p = (char*) b; p < (char*) b + b->size; p += tm_page_SIZE ) {
+	  if ( ! bitset_get(tm.wb_protected, tm_page_index(p)) ) {
+	    _tm_wb_page_mutation(p);
+	  }
+	}
+	_tm_wb_mprotect(tm_wb_block_protect_begin(b), (char*) b + b->size, 1);
+      }
+    }
+    tm_list_LOOP_END;
+  }
+  tm_list_LOOP_END;
 }
 
-/************************************************************************/
-/* Unit test. */
+/*@}*/
+
 
-#define tm_UNIT_TEST
-#ifdef tm_UNIT_TEST
-int main(int argc, char **argv)
+/*********************************************************************/
+/*! \defgroup write_barrier_mprotect_hook Write Barrier: mprotect(): Hooks */
+/*@{*/
+
+/**
+ * Enter tm.
+ *
+ * On the outermost entry,
+ * reschedule BLACK nodes on pages written by the mutator since tm returned.
+ */
+void __tm_wb_enter()
 {
-  char *p;
-  size_t plen;
   int i;
-  char *x;
-  size_t xi;
 
-  plen = 256;
-  p = malloc(plen);
+  if ( tm.wb_in_tm ++ )
+    return;
+
+  for ( i = 0; i < tm.wb_dirty_n; ++ i ) {
+    char *page = tm.wb_dirty[i];
+
+    _tm_wb_page_mutation(page);
+
+    /*! The page is write-protected again when tm returns. */
+    if ( tm.wb_reprotect_n < tm_wb_FAULTS_MAX )
+      tm.wb_reprotect[tm.wb_reprotect_n ++] = page;
+    else
+      tm.wb_overflow = 1;
+  }
+  tm.wb_dirty_n = 0;
+}
+
+
+/**
+ * Leave tm.
+ *
+ * On the outermost return,
+ * write-protect the pages unprotected by faults and mutations, in coalesced runs.
+ */
+void __tm_wb_leave()
+{
+  int i, n;
+
+  if ( tm.wb_in_tm > 1 ) {
+    -- tm.wb_in_tm;
+    return;
+  }
+
+  if ( tm.wb_overflow ) {
+    _tm_wb_overflow();
+  }
+
+  /*! Only pages of tm_blocks still write-protected since the last flip. */
+  for ( i = n = 0; i < tm.wb_reprotect_n; ++ i ) {
+    char *page = tm.wb_reprotect[i];
+
+    if ( tm_wb_block_protected(tm_wb_page_block(page)) && ! bitset_get(tm.wb_protected, tm_page_index(page)) ) {
+      tm.wb_reprotect[n ++] = page;
+    }
+  }
+
+  _tm_wb_mprotect_runs(tm.wb_reprotect, n, tm_page_SIZE, 1);
+  tm.wb_reprotect_n = 0;
+
+  -- tm.wb_in_tm;
+}
+
+
+/**
+ * After a flip, write-protect the tm_blocks likely to become BLACK.
+ *
+ * Nodes that survived the flip are now ECRU.
+ * A tm_block is write-protected if at least tm_wb_protect_percent of its capacity survived.
+ * Other tm_blocks are unprotected.
+ * Only tm_blocks of tm_block_SIZE that are not being parceled are write-protected,
+ * from tm_wb_block_protect_begin().
+ */
+void __tm_wb_flip()
+{
+  tm_type *t;
+  tm_block *b;
+  size_t np = 0, nu = 0, n, i;
+  void **protect, **unprotect;
+
+  n = tm.n[tm_B] + 1;
+  if ( ! _tm_wb_pages_reserve(n * 2) ) {
+    tm_msg("w WARNING: cannot allocate write barrier page list\n");
+    return;
+  }
+  protect = tm.wb_pages;
+  unprotect = tm.wb_pages + n;
+
+  tm_list_LOOP(&tm.types, t) {
+    tm_list_LOOP(&t->blocks, b) {
+      int was = tm_wb_block_protected(b);
+      int want = b->size == tm_block_SIZE &&
+	b != t->parcel_from_block &&
+	b->n[ECRU] * 100 >= b->n[tm_CAPACITY] * tm_wb_protect_percent &&
+	b->n[ECRU] > 0;
+
+      if ( want && np < n ) {
+	bitset_set(tm.wb_block_protected, tm_page_index(b));
+	protect[np ++] = b;
+      } else if ( was ) {
+	bitset_clr(tm.wb_block_protected, tm_page_index(b));
+	if ( nu < n )
+	  unprotect[nu ++] = b;
+      }
+    }
+    tm_list_LOOP_END;
+  }
+  tm_list_LOOP_END;
+
+  tm_msg("w F %lu %lu\n", (unsigned long) np, (unsigned long) nu);
 
-  for ( i = 0; i < plen; i ++ ) {
-    p[i] = i;
+  _tm_wb_mprotect_runs(unprotect, nu, tm_block_SIZE, 0);
+
+  /*! The unprotected header pages keep adjacent tm_blocks from coalescing. */
+  for ( i = 0; i < np; ++ i ) {
+    b = protect[i];
+    _tm_wb_mprotect(tm_wb_block_protect_begin(b), (char*) b + b->size, 1);
+  }
+
+  /*! Faults before the flip no longer matter. */
+  tm.wb_dirty_n = 0;
+  tm.wb_reprotect_n = 0;
+  tm.wb_overflow = 0;
+}
+
+
+/**
+ * Before a flip, atomically reschedule for scanning
+ * the BLACK nodes that may have been mutated unnoticed:
+ *
+ * - BLACK nodes in tm_blocks that are not write-protected,
+ *   and before tm_wb_block_protect_begin() in tm_blocks that are.
+ * - Data roots, since mutators may not call tm_write_barrier_root().
+ * .
+ *
+ * This is a stop-the-world pause proportional to the tm_blocks that are not write-protected
+ * and to the size of the data roots.
+ */
+void __tm_wb_final()
+{
+  tm_type *t;
+  tm_block *b;
+
+  if ( tm.wb_overflow ) {
+    _tm_wb_overflow();
+  }
+
+  tm_list_LOOP(&tm.types, t) {
+    tm_list_LOOP(&t->blocks, b) {
+      if ( ! tm_wb_block_protected(b) ) {
+	_tm_wb_block_mutation(b, b->begin, b->next_parcel);
+      } else {
+	_tm_wb_block_mutation(b, b->begin, tm_wb_block_protect_begin(b));
+      }
+    }
+    tm_list_LOOP_END;
+  }
+  tm_list_LOOP_END;
+
+  /*! Rescan all data roots; see _tm_root_scan_dirty(). */
+  tm.roots.cards_valid = 0;
+  ++ tm.roots.cards_dirty;
+  tm.dl_roots.cards_valid = 0;
+  ++ tm.dl_roots.cards_dirty;
+}
+
+
+/**
+ * Remove write protection from a tm_block before it is reclaimed.
+ */
+void __tm_wb_block_free(tm_block *b)
+{
+  if ( tm_wb_block_protected(b) ) {
+    bitset_clr(tm.wb_block_protected, tm_page_index(b));
+    _tm_wb_mprotect((char*) b, (char*) b + b->size, 0);
+  }
+}
+
+
+/**
+ * In the child process after fork(): userfaultfd write-protection is not inherited,
+ * and the userfaultfd and its handler thread belong to the parent.
+ *
+ * The child continues with the mprotect() write barrier, with nothing write-protected:
+ * all BLACK nodes are rescanned before the next flip.
+ * Called by tm_atfork_child().
+ */
+void __tm_wb_atfork_child()
+{
+  int in_tm = tm.wb_in_tm;
+
+  if ( tm.wb_uffd < 0 )
+    return;
+
+  close(tm.wb_uffd);
+  if ( ! _tm_wb_init(tm_BARRIER_MPROTECT) ) {
+    tm_abort();
   }
+  tm.wb_in_tm = in_tm;
+  tm_write_barrier_mode = tm_BARRIER_MPROTECT;
+}
 
-  tm_wb_protect(p, plen);
 
-  fprintf(stderr, "p = %p[%lu]\n", p, (unsigned long) plen);
+/**
+ * Initialize the write barrier for a tm_barrier_mode.
+ *
+ * tm_BARRIER_MPROTECT handles write faults with a SIGSEGV handler.
+ * tm_BARRIER_UFFD handles write faults with a userfaultfd handler thread; see wb_uffd.c.
+ *
+ * Returns 0 if the write barrier is not supported.
+ */
+int _tm_wb_init(int mode)
+{
+  tm.wb_uffd = -1;
 
-  xi = 12;
-  x = p + xi;
+  if ( mode == tm_BARRIER_UFFD ) {
+    if ( ! _tm_wb_uffd_init() )
+      return 0;
+  } else {
+    struct sigaction sa;
 
-  fprintf(stderr, "mutated(%p) = %d\n", x, tm_wb_ptr_mutated_get(x) ? 1 : 0);
-  fprintf(stderr, "%p[%lu] = %lu\n", p, (unsigned long) xi, * (unsigned long*) x);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = _tm_wb_signal;
+    sigfillset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+
+    if ( sigaction(SIGSEGV, &sa, &_tm_wb_sa_old) ) {
+      perror("tm: sigaction() failed");
+      return 0;
+    }
+  }
 
-  /* Cause a write fault. */
-  *(long *) x = 12345;
+  memset(tm.wb_protected, 0, sizeof(tm.wb_protected));
+  memset(tm.wb_block_protected, 0, sizeof(tm.wb_block_protected));
+  tm.wb_in_tm = 0;
+  tm.wb_dirty_n = tm.wb_reprotect_n = 0;
+  tm.wb_overflow = 0;
+  tm.wb_faults = tm.wb_mprotects = 0;
+  tm.wb_active = 1;
 
-  fprintf(stderr, "mutated(%p) = %d\n", x, tm_wb_ptr_mutated_get(x) ? 1 : 0);
-  fprintf(stderr, "%p[%lu] = %lu\n", p, (unsigned long) xi, * (unsigned long*) x);
+  return 1;
+}
 
-  /* Doesn't cause a write fault. */
-  *(long *) x = 54321;
+/*@}*/
 
-  fprintf(stderr, "mutated(%p) = %d\n", x, tm_wb_ptr_mutated_get(x) ? 1 : 0);
-  fprintf(stderr, "%p[%lu] = %lu\n", p, (unsigned long) xi, * (unsigned long*) x);
+#else
 
+int _tm_wb_init(int mode)
+{
   return 0;
 }
 
+int _tm_wb_fault(char *page)
+{
+  return 0;
+}
+
+void __tm_wb_enter() { }
+void __tm_wb_leave() { }
+void __tm_wb_flip() { }
+void __tm_wb_final() { }
+void __tm_wb_block_free(tm_block *b) { }
+void __tm_wb_atfork_child() { }
+
 #endif
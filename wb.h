@@ -1,17 +1,68 @@
 /** \file wb.h
- * \brief mprotect() write barrier prototype.
+ * \brief mprotect() and userfaultfd write barriers.
+ *
+ * Limitations of tm_BARRIER_MPROTECT:
+ *
+ * - A write by the kernel into a write-protected page, e.g. read() into a node,
+ *   does not raise SIGSEGV: the system call fails with EFAULT.
+ *   Programs that pass heap nodes to system calls that write them must use
+ *   tm_BARRIER_SOFTWARE, which is the default.
+ *   tm_BARRIER_UFFD handles kernel writes, unless tm_wb_uffd_user_mode_only
+ *   allowed a userfaultfd for user mode faults only; see wb_uffd.c.
+ * - Before each flip, __tm_wb_final() rescans every BLACK node in tm_blocks
+ *   that are not write-protected, and all data roots, atomically:
+ *   a stop-the-world pause proportional to the unprotected heap.
+ * .
  *
  * $Id: wb.h,v 1.1 2000-01-07 09:38:32 stephensk Exp $
  */
 #ifndef tm_WB_H
 #define tm_WB_H
 
-#include <stddef.h>
+/*******************************************************************************/
+/*! \defgroup write_barrier_mprotect Write Barrier: mprotect() */
+/*@{*/
+
+int _tm_wb_init(int mode);
+int _tm_wb_fault(char *page);
+
+int _tm_wb_uffd_init();
+void _tm_wb_uffd_protect(char *l, char *h, int protect);
+
+void __tm_wb_enter();
+void __tm_wb_leave();
+void __tm_wb_flip();
+void __tm_wb_final();
+void __tm_wb_block_free(tm_block *b);
+void __tm_wb_atfork_child();
+void __tm_wb_write(void *ptr);
+
+/*! Called on entry to tm API functions: reschedules BLACK nodes on pages written by the mutator. */
+#define _tm_wb_enter() (tm.wb_active ? __tm_wb_enter() : (void) 0)
+
+/*! Called on return from tm API functions: write-protects pages again. */
+#define _tm_wb_leave() (tm.wb_active ? __tm_wb_leave() : (void) 0)
+
+/*! Called after colors flip: write-protects tm_blocks likely to become BLACK. */
+#define _tm_wb_flip() (tm.wb_active ? __tm_wb_flip() : (void) 0)
+
+/*! Called atomically before colors flip: reschedules BLACK nodes that may have been mutated unnoticed. */
+#define _tm_wb_final() (tm.wb_active ? __tm_wb_final() : (void) 0)
+
+/*! Called before a tm_block is reclaimed: removes its write protection. */
+#define _tm_wb_block_free(b) (tm.wb_active ? __tm_wb_block_free(b) : (void) 0)
+
+#if tm_node_SIDE_TABLE
+/*! Called before tm writes a tm_node header: side table headers are never write-protected. */
+#define _tm_wb_node_write(n) ((void) 0)
+#else
+/*! Called before tm writes a tm_node header: unprotects its page without a write fault. */
+#define _tm_wb_node_write(n) (tm.wb_active ? __tm_wb_write(n) : (void) 0)
+#endif
 
-typedef void (*tm_wb_fault_handler_t)(void *addr, void *page_addr);
-extern tm_wb_fault_handler_t tm_wb_fault_handler;
+/*! Called in the child process after fork(): replaces write-protection not inherited from the parent. */
+#define _tm_wb_atfork_child() (tm.wb_active ? __tm_wb_atfork_child() : (void) 0)
 
-void tm_wb_protect(void *addr, size_t len);
-void tm_wb_unprotect(void *addr, size_t len);
+/*@}*/
 
 #endif
@@ -0,0 +1,75 @@
+/** \file wb_test.c
+ * \brief mprotect() and userfaultfd write barrier test.
+ *
+ * Uses the mprotect() write barrier, unless TM_BARRIER=uffd.
+ *
+ * Builds a list without calling tm_write_barrier(),
+ * splicing new nodes into old, probably BLACK, nodes,
+ * while allocating garbage to force flips.
+ */
+#include "tm.h"
+#include <stdio.h>
+#include <stdlib.h> /* atol() */
+#include <assert.h>
+
+#include "internal.h" /* tm */
+
+
+typedef struct wb_cons {
+  struct wb_cons *next;
+  long value;
+} wb_cons;
+
+static wb_cons *list;
+
+
+int main(int argc, char **argv, char **envp)
+{
+  long n = argc > 1 ? atol(argv[1]) : 100000;
+  long i, count, sum;
+  wb_cons *c;
+
+  tm_write_barrier_mode = tm_BARRIER_MPROTECT;
+  tm_init(&argc, &argv, &envp);
+
+  if ( tm_write_barrier_mode == tm_BARRIER_SOFTWARE ) {
+    fprintf(stderr, "wb_test: write barrier mode not supported\n");
+    return 0;
+  }
+
+  for ( i = 0; i < n; ++ i ) {
+    c = tm_alloc(sizeof(*c));
+    c->value = i;
+
+    /* No write barrier. */
+    if ( list && (i & 1) ) {
+      c->next = list->next;
+      list->next = c;
+    } else {
+      c->next = list;
+      list = c;
+    }
+
+    /* Garbage. */
+    tm_alloc(sizeof(*c) * (1 + i % 7));
+  }
+
+  tm_gc_full();
+
+  count = sum = 0;
+  for ( c = list; c && count <= n; c = c->next ) {
+    ++ count;
+    sum += c->value;
+  }
+
+  fprintf(stderr, "wb_test: %s: %ld nodes, %lu write faults, %lu protection changes\n",
+	  tm.wb_uffd >= 0 ? "userfaultfd" : "mprotect()",
+	  count,
+	  (unsigned long) tm.wb_faults,
+	  (unsigned long) tm.wb_mprotects);
+
+  assert(count == n);
+  assert(sum == n * (n - 1) / 2);
+
+  return 0;
+}
@@ -0,0 +1,234 @@
+/** \file wb_uffd.c
+ * \brief userfaultfd write barrier.
+ *
+ * When tm_write_barrier_mode is tm_BARRIER_UFFD,
+ * heap pages are write-protected with UFFDIO_WRITEPROTECT instead of mprotect():
+ *
+ * - Write-protecting a range does not split the mapping, so runs of any length
+ *   can be protected and unprotected without growing the process's mappings.
+ * - Write faults are delivered to a handler thread reading the userfaultfd,
+ *   instead of a SIGSEGV handler in the faulting thread.
+ *   The handler records the page with _tm_wb_fault(), then unprotects the page,
+ *   which wakes the faulting thread.
+ * .
+ *
+ * Everything else is shared with the mprotect() write barrier; see wb.c.
+ *
+ * Write faults from the kernel, e.g. read() into a node, are handled like any other,
+ * unless the userfaultfd only handles faults from user mode:
+ * then such system calls fail with EFAULT, as with mprotect().
+ * Unprivileged processes may only open such a userfaultfd
+ * when vm.unprivileged_userfaultfd is 0;
+ * it is only used if tm_wb_uffd_user_mode_only is set.
+ * Otherwise _tm_wb_uffd_init() fails, and tm_init() falls back to tm_BARRIER_SOFTWARE.
+ *
+ * $Id: wb_uffd.c,v 1.1 2008-01-14 00:08:02 stephens Exp $
+ */
+
+#include "internal.h"
+
+#include <errno.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+/*********************************************************************/
+/*! \defgroup write_barrier_uffd_config Write Barrier: userfaultfd: Configuration */
+/*@{*/
+
+#if tm_USE_MMAP && defined(__linux__) && defined(SYS_userfaultfd) && defined(UFFDIO_WRITEPROTECT)
+#define tm_wb_uffd_SUPPORTED 1
+#else
+#define tm_wb_uffd_SUPPORTED 0
+#endif
+
+/*! If true, accept a userfaultfd that only handles write faults from user mode: system calls writing into write-protected nodes fail with EFAULT. */
+int tm_wb_uffd_user_mode_only = 0;
+
+/*@}*/
+
+#if tm_wb_uffd_SUPPORTED
+
+/*********************************************************************/
+/*! \defgroup write_barrier_uffd_fault Write Barrier: userfaultfd: Write Faults */
+/*@{*/
+
+/*! The write fault handler thread. */
+static pthread_t _tm_wb_uffd_thread;
+
+
+/**
+ * Write-protect or unprotect pages [l, h) with the userfaultfd.
+ *
+ * Returns the ioctl() result.
+ */
+static
+int _tm_wb_uffd_writeprotect(char *l, char *h, int protect)
+{
+  struct uffdio_writeprotect wp;
+
+  wp.range.start = (tm_ptr_word) l;
+  wp.range.len = h - l;
+  wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+
+  return ioctl(tm.wb_uffd, UFFDIO_WRITEPROTECT, &wp);
+}
+
+
+/**
+ * Write fault handler thread.
+ *
+ * Faults on pages not write-protected by the write barrier
+ * are unprotected without being recorded.
+ */
+static
+void *_tm_wb_uffd_handler(void *arg)
+{
+  struct uffd_msg msg;
+  ssize_t n;
+  char *page;
+
+  for (;;) {
+    n = read(tm.wb_uffd, &msg, sizeof(msg));
+    if ( n < 0 ) {
+      if ( errno == EINTR || errno == EAGAIN )
+	continue;
+      break;
+    }
+    if ( n != sizeof(msg) )
+      continue;
+
+    if ( msg.event != UFFD_EVENT_PAGEFAULT ||
+	 ! (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) )
+      continue;
+
+    page = (char*) ((tm_ptr_word) msg.arg.pagefault.address & tm_page_SIZE_MASK);
+
+    /*! The faulting thread is blocked until the page is unprotected. */
+    _tm_wb_fault(page);
+    __sync_synchronize();
+
+    if ( _tm_wb_uffd_writeprotect(page, page + tm_page_SIZE, 0) ) {
+      perror("tm: UFFDIO_WRITEPROTECT failed");
+      tm_abort();
+    }
+  }
+
+  return 0;
+}
+
+/*@}*/
+
+
+/*********************************************************************/
+/*! \defgroup write_barrier_uffd_protect Write Barrier: userfaultfd: Protection */
+/*@{*/
+
+/**
+ * Change the protection of pages [l, h).
+ *
+ * Ranges are registered with the userfaultfd when first write-protected.
+ * Called by _tm_wb_mprotect().
+ */
+void _tm_wb_uffd_protect(char *l, char *h, int protect)
+{
+  if ( ! _tm_wb_uffd_writeprotect(l, h, protect) )
+    return;
+
+  if ( protect && (errno == ENOENT || errno == EINVAL) ) {
+    struct uffdio_register reg;
+
+    reg.range.start = (tm_ptr_word) l;
+    reg.range.len = h - l;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+
+    if ( ! ioctl(tm.wb_uffd, UFFDIO_REGISTER, &reg) &&
+	 ! _tm_wb_uffd_writeprotect(l, h, protect) )
+      return;
+  }
+
+  /*! Unprotecting pages never registered is harmless. */
+  if ( ! protect && errno == ENOENT )
+    return;
+
+  perror("tm: UFFDIO_WRITEPROTECT failed");
+  tm_abort();
+}
+
+/*@}*/
+
+
+/*********************************************************************/
+/*! \defgroup write_barrier_uffd_init Write Barrier: userfaultfd: Initialization */
+/*@{*/
+
+/**
+ * Open the userfaultfd and start the write fault handler thread.
+ *
+ * Called by _tm_wb_init().
+ * Returns 0 if userfaultfd write-protection is not available.
+ */
+int _tm_wb_uffd_init()
+{
+  struct uffdio_api api;
+  int fd = -1;
+
+  /*! Handle write faults from the kernel too, so system calls writing into nodes do not fail. */
+  fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+#ifdef UFFD_USER_MODE_ONLY
+  /*! Unprivileged processes may only handle faults from user mode: only if allowed. */
+  if ( fd < 0 && tm_wb_uffd_user_mode_only ) {
+    fd = syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+    if ( fd >= 0 )
+      tm_msg("WARNING: userfaultfd handles user mode faults only: system calls writing into nodes may fail with EFAULT.\n");
+  }
+#endif
+  if ( fd < 0 ) {
+    perror("tm: userfaultfd() failed");
+    return 0;
+  }
+
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+  if ( ioctl(fd, UFFDIO_API, &api) ) {
+    perror("tm: UFFDIO_API failed");
+    close(fd);
+    return 0;
+  }
+
+  tm.wb_uffd = fd;
+
+  if ( pthread_create(&_tm_wb_uffd_thread, 0, _tm_wb_uffd_handler, 0) ) {
+    tm_msg("WARNING: userfaultfd handler thread not created.\n");
+    tm.wb_uffd = -1;
+    close(fd);
+    return 0;
+  }
+  pthread_detach(_tm_wb_uffd_thread);
+
+  return 1;
+}
+
+/*@}*/
+
+#else
+
+int _tm_wb_uffd_init()
+{
+  return 0;
+}
+
+void _tm_wb_uffd_protect(char *l, char *h, int protect)
+{
+  tm_abort();
+}
+
+#endif
+
@@ -0,0 +1,429 @@
+/** \file weak.c
+ * \brief Weak References.
+ *
+ * Weak references and weak-keyed tables do not keep their targets alive:
+ *
+ * - tm_weak_ref and tm_weak_entry nodes are allocated with tm_adesc scan functions
+ *   that skip their first word, the weak pointer.
+ * - Every such node is recorded in tm_data.weak_nodes,
+ *   which is allocated from the OS and not scanned.
+ * - At the end of marking, before colors flip, weak pointers to nodes still ECRU
+ *   are cleared, in one pass, before the nodes become WHITE.
+ * - Reading a weak pointer marks its target,
+ *   so a target stored elsewhere by the mutator is not cleared.
+ * - Entries with cleared keys are removed from a tm_weak_table
+ *   on its first use after a flip that cleared weak pointers.
+ * .
+ *
+ * A weak-keyed table entry whose value references its key is never cleared.
+ */
+#include "internal.h"
+
+
+/****************************************************************************/
+/*! \defgroup weak_reference_set Weak References: Sets */
+/*@{*/
+
+/**
+ * Make sure s can hold n nodes.
+ *
+ * Returns 0 if s could not be grown.
+ */
+static
+int _tm_weak_set_reserve(tm_weak_set *s, size_t n)
+{
+  if ( n > s->max ) {
+    size_t new_size = n * 2 * sizeof(s->p[0]);
+    void **p;
+
+    new_size += tm_block_SIZE - new_size % tm_block_SIZE;
+    if ( ! (p = _tm_os_alloc_aligned(new_size)) )
+      return 0;
+
+    if ( s->p ) {
+      memcpy(p, s->p, s->n * sizeof(s->p[0]));
+      _tm_os_free_aligned(s->p, s->size);
+    }
+
+    s->p = p;
+    s->size = new_size;
+    s->max = new_size / sizeof(s->p[0]);
+  }
+
+  return 1;
+}
+
+
+/**
+ * Record a node with a weak first word.
+ *
+ * Returns 0 if the node could not be recorded.
+ */
+static
+int _tm_weak_add(void *ptr)
+{
+  if ( ! _tm_weak_set_reserve(&tm.weak_nodes, tm.weak_nodes.n + 1) )
+    return 0;
+
+  tm.weak_nodes.p[tm.weak_nodes.n ++] = ptr;
+
+  return 1;
+}
+
+
+/**
+ * Read a weak pointer.
+ *
+ * The target is marked: the mutator may store it where it has already been scanned.
+ */
+static __inline
+void *_tm_weak_read(void *target)
+{
+  if ( target ) {
+    _tm_wb_enter();
+    _tm_mark_possible_ptr(target);
+    _tm_wb_leave();
+  }
+
+  return target;
+}
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup weak_reference_gc Weak References: GC */
+/*@{*/
+
+/**
+ * Scan function for tm_weak_ref: nothing is scanned.
+ */
+static
+void _tm_weak_ref_scan(tm_adesc *desc, void *ptr)
+{
+}
+
+
+/**
+ * Scan function for tm_weak_entry: scan everything but the key.
+ */
+static
+void _tm_weak_entry_scan(tm_adesc *desc, void *ptr)
+{
+  tm_weak_entry *e = ptr;
+
+  _tm_mark_possible_ptr(e->value);
+  _tm_mark_possible_ptr(e->next);
+}
+
+
+/**
+ * Clear weak pointers to unreachable nodes.
+ *
+ * Called atomically at the end of marking, after finalizers are queued, before colors flip.
+ * Nodes still ECRU are unreachable.
+ * Weak nodes that are themselves unreachable are forgotten.
+ *
+ * Returns the number of weak pointers cleared.
+ */
+int _tm_weak_flip()
+{
+  tm_weak_set *s = &tm.weak_nodes;
+  size_t i, j;
+  int n = 0;
+
+  for ( i = j = 0; i < s->n; ++ i ) {
+    void **ptr = s->p[i];
+    tm_node *node;
+
+    if ( tm_node_color(tm_pure_ptr_to_node(ptr)) == ECRU )
+      continue;
+
+    if ( *ptr && (node = tm_ptr_to_node(*ptr)) && tm_node_color(node) == ECRU ) {
+      *ptr = 0;
+      ++ n;
+    }
+
+    s->p[j ++] = ptr;
+  }
+  s->n = j;
+
+  if ( n ) {
+    tm_msg("W c %d\n", n);
+    ++ tm.weak_epoch;
+    tm.weak_cleared += n;
+  }
+
+  return n;
+}
+
+
+/**
+ * Initialize weak references.
+ *
+ * Called by tm_init().
+ */
+int _tm_weak_init()
+{
+  memset(&tm.weak_nodes, 0, sizeof(tm.weak_nodes));
+  tm.weak_epoch = tm.weak_cleared = 0;
+
+  /*! The tm_types are created by the first allocation; see _tm_weak_alloc(). */
+  memset(&tm.weak_ref_desc, 0, sizeof(tm.weak_ref_desc));
+  tm.weak_ref_desc.size = sizeof(struct tm_weak_ref);
+  tm.weak_ref_desc.scan = _tm_weak_ref_scan;
+
+  memset(&tm.weak_entry_desc, 0, sizeof(tm.weak_entry_desc));
+  tm.weak_entry_desc.size = sizeof(tm_weak_entry);
+  tm.weak_entry_desc.scan = _tm_weak_entry_scan;
+
+  return 1;
+}
+
+
+/**
+ * Allocate a node with a weak first word, and record it.
+ *
+ * Returns 0 if out of memory.
+ */
+static
+void *_tm_weak_alloc(tm_adesc *desc)
+{
+  void *ptr = 0;
+
+  if ( ! tm.inited ) {
+    tm_init(0, (char***) ptr, 0);
+  }
+
+  if ( ! desc->hidden ) {
+    _tm_wb_enter();
+    tm_adesc_for_size(desc, 1);
+    _tm_wb_leave();
+  }
+
+  if ( ! (ptr = tm_alloc_desc(desc)) || ! _tm_weak_add(ptr) )
+    return 0;
+
+  /*! The weak word is cleared before the caller sets it. */
+  *(void**) ptr = 0;
+
+  return ptr;
+}
+
+/*@}*/
+
+
+/****************************************************************************/
+/*! \defgroup weak_reference_api Weak References: API */
+/*@{*/
+
+/**
+ * API: Allocate a weak reference to target.
+ *
+ * Returns 0 if out of memory.
+ */
+tm_weak_ref *tm_weak_ref_new(void *target)
+{
+  tm_weak_ref *w = _tm_weak_alloc(&tm.weak_ref_desc);
+
+  if ( ! w )
+    return 0;
+
+  w->target = target;
+
+  return w;
+}
+
+
+/**
+ * API: Returns the target of a weak reference,
+ * or 0 if the target was collected.
+ */
+void *tm_weak_ref_get(tm_weak_ref *w)
+{
+  return _tm_weak_read(w->target);
+}
+
+
+/**
+ * API: Change the target of a weak reference.
+ */
+void tm_weak_ref_set(tm_weak_ref *w, void *target)
+{
+  w->target = target;
+}
+
+
+/**
+ * Write barrier after unlinking an entry:
+ * its predecessor, or the buckets, may already be BLACK.
+ */
+#define tm_weak_table_unlinked(t, prev) \
+  ((prev) ? tm_write_barrier_pure(prev) : tm_write_barrier_pure((t)->buckets))
+
+
+/**
+ * Remove entries with cleared keys,
+ * if any weak pointer was cleared since they were last removed.
+ */
+static
+void _tm_weak_table_purge(tm_weak_table *t)
+{
+  size_t i;
+
+  if ( t->epoch == tm.weak_epoch )
+    return;
+
+  for ( i = 0; i < t->nbuckets; ++ i ) {
+    tm_weak_entry **ep = &t->buckets[i], *e, *prev = 0;
+
+    while ( (e = *ep) ) {
+      if ( e->key ) {
+	prev = e;
+	ep = &e->next;
+      } else {
+	*ep = e->next;
+	tm_weak_table_unlinked(t, prev);
+	-- t->n;
+      }
+    }
+  }
+
+  t->epoch = tm.weak_epoch;
+}
+
+
+/*! The bucket of key in t. */
+#define tm_weak_table_bucket(t, key) (&(t)->buckets[((tm_ptr_word) (key) / tm_ALLOC_ALIGN) % (t)->nbuckets])
+
+
+/**
+ * API: Allocate a weak-keyed hash table with nbuckets buckets.
+ *
+ * Keys must be pure pointers to nodes.
+ * Entries are removed when their keys are collected.
+ *
+ * Returns 0 if out of memory.
+ */
+tm_weak_table *tm_weak_table_new(size_t nbuckets)
+{
+  tm_weak_table *t;
+  tm_weak_entry **buckets;
+
+  if ( ! nbuckets )
+    nbuckets = 61;
+
+  if ( ! (t = tm_alloc(sizeof(*t))) )
+    return 0;
+  t->buckets = 0;
+  t->nbuckets = 0;
+  t->n = 0;
+  t->epoch = tm.weak_epoch;
+
+  if ( ! (buckets = tm_alloc(sizeof(buckets[0]) * nbuckets)) )
+    return 0;
+  memset(buckets, 0, sizeof(buckets[0]) * nbuckets);
+
+  t->buckets = buckets;
+  t->nbuckets = nbuckets;
+  tm_write_barrier_pure(t);
+
+  return t;
+}
+
+
+/**
+ * API: Returns the value for key in t, or 0.
+ */
+void *tm_weak_table_get(tm_weak_table *t, void *key)
+{
+  tm_weak_entry *e;
+
+  if ( ! key )
+    return 0;
+
+  for ( e = *tm_weak_table_bucket(t, key); e; e = e->next ) {
+    if ( e->key == key )
+      return e->value;
+  }
+
+  return 0;
+}
+
+
+/**
+ * API: Set the value for key in t.
+ *
+ * Returns 0 if out of memory.
+ */
+int tm_weak_table_put(tm_weak_table *t, void *key, void *value)
+{
+  tm_weak_entry **bp, *e;
+
+  if ( ! key )
+    return 0;
+
+  _tm_weak_table_purge(t);
+
+  bp = tm_weak_table_bucket(t, key);
+  for ( e = *bp; e; e = e->next ) {
+    if ( e->key == key ) {
+      e->value = value;
+      tm_write_barrier_pure(e);
+      return 1;
+    }
+  }
+
+  if ( ! (e = _tm_weak_alloc(&tm.weak_entry_desc)) )
+    return 0;
+
+  e->key = key;
+  e->value = value;
+  e->next = *bp;
+  tm_write_barrier_pure(e);
+
+  *bp = e;
+  tm_write_barrier_pure(t->buckets);
+  ++ t->n;
+
+  return 1;
+}
+
+
+/**
+ * API: Remove key from t.
+ *
+ * Returns 0 if key was not in t.
+ */
+int tm_weak_table_remove(tm_weak_table *t, void *key)
+{
+  tm_weak_entry **ep, *e, *prev = 0;
+
+  if ( ! key )
+    return 0;
+
+  for ( ep = tm_weak_table_bucket(t, key); (e = *ep); prev = e, ep = &e->next ) {
+    if ( e->key == key ) {
+      *ep = e->next;
+      tm_weak_table_unlinked(t, prev);
+      -- t->n;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * API: Returns the number of entries in t.
+ */
+size_t tm_weak_table_count(tm_weak_table *t)
+{
+  _tm_weak_table_purge(t);
+
+  return t->n;
+}
+
+/*@}*/
+
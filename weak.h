@@ -0,0 +1,82 @@
+/** \file weak.h
+ * \brief Weak References.
+ */
+#ifndef tm_WEAK_H
+#define tm_WEAK_H
+
+/****************************************************************************/
+/*! \defgroup weak_reference Weak References */
+/*@{*/
+
+/**
+ * A weak reference.
+ *
+ * Allocated with tm_data.weak_ref_desc, which does not scan target.
+ */
+struct tm_weak_ref {
+  /*! The weak pointer: must be first; see _tm_weak_flip(). */
+  void *target;
+};
+
+
+/**
+ * A weak-keyed table entry.
+ *
+ * Allocated with tm_data.weak_entry_desc, which scans value and next, but not key.
+ */
+typedef struct tm_weak_entry {
+  /*! The weak key: must be first; see _tm_weak_flip(). */
+  void *key;
+
+  /*! The value. */
+  void *value;
+
+  /*! The next entry in the bucket. */
+  struct tm_weak_entry *next;
+} tm_weak_entry;
+
+
+/**
+ * A weak-keyed hash table.
+ */
+struct tm_weak_table {
+  /*! The buckets. */
+  tm_weak_entry **buckets;
+
+  /*! The number of buckets. */
+  size_t nbuckets;
+
+  /*! The number of entries, including entries with cleared keys. */
+  size_t n;
+
+  /*! The value of tm_data.weak_epoch when entries with cleared keys were last removed. */
+  size_t epoch;
+};
+
+
+/**
+ * A growable array of pointers to nodes with a weak first word.
+ *
+ * Allocated from the OS, so it is not scanned as a root.
+ */
+typedef struct tm_weak_set {
+  /*! The nodes. */
+  void **p;
+
+  /*! The number of nodes. */
+  size_t n;
+
+  /*! The number of nodes allocated. */
+  size_t max;
+
+  /*! The size of the allocation, in bytes. */
+  size_t size;
+} tm_weak_set;
+
+
+int _tm_weak_init();
+int _tm_weak_flip();
+
+/*@}*/
+
+#endif